@@ -35,8 +35,14 @@ class _DeviceScreenState extends State<DeviceScreen> {
   late StreamSubscription<int> _mtuSubscription;
   late BluetoothCharacteristic _setTempCharacteristic;
   late BluetoothCharacteristic _setModeCharacteristic;
-  late int _setTemp;
+  // Latest values pushed by the spa, null until the first notification
+  int? _temp;
+  int? _setTemp;
+  int? _mode;
   bool _isJetsOn = false;
+  // Reconnect timing, from the connect request to the first value from the spa
+  final Stopwatch _connectTimer = Stopwatch();
+  bool _firstValueLogged = false;
 
   List<String> systemState = [
     'startup',
@@ -56,9 +62,22 @@ class _DeviceScreenState extends State<DeviceScreen> {
         widget.device.connectionState.listen((state) async {
       _connectionState = state;
       if (state == BluetoothConnectionState.connected) {
+        // Reconnects that were not started from the button are timed from here
+        if (!_connectTimer.isRunning) {
+          _connectTimer
+            ..reset()
+            ..start();
+        }
+        _logTiming('connected');
         _services = []; // must rediscover services
         onDiscoverServicesPressed();
       }
+      if (state == BluetoothConnectionState.disconnected) {
+        _connectTimer
+          ..stop()
+          ..reset();
+        _firstValueLogged = false;
+      }
       if (state == BluetoothConnectionState.connected && _rssi == null) {
         _rssi = await widget.device.readRssi();
       }
@@ -103,7 +122,18 @@ class _DeviceScreenState extends State<DeviceScreen> {
     return _connectionState == BluetoothConnectionState.connected;
   }
 
+  void _logTiming(String step) {
+    if (_connectTimer.isRunning) {
+      debugPrint('${widget.device.remoteId}: $step after '
+          '${_connectTimer.elapsedMilliseconds} ms');
+    }
+  }
+
   Future onConnectPressed() async {
+    _connectTimer
+      ..reset()
+      ..start();
+    _firstValueLogged = false;
     try {
       await widget.device.connectAndUpdateStream();
       Snackbar.show(ABC.c, "Connect: Success", success: true);
@@ -149,7 +179,12 @@ class _DeviceScreenState extends State<DeviceScreen> {
       });
     }
     try {
+      // The spa bonds on the first connection and supports robust caching,
+      // so for a bonded spa the OS answers this from its cached attribute
+      // table instead of discovering over the air
       _services = await widget.device.discoverServices();
+      _logTiming('services discovered');
+      await _subscribe(widget.device);
       Snackbar.show(ABC.c, "Discover Services: Success", success: true);
     } catch (e) {
       Snackbar.show(ABC.c, prettyException("Discover Services Error:", e),
@@ -172,9 +207,60 @@ class _DeviceScreenState extends State<DeviceScreen> {
     }
   }
 
-  Future<Widget> _buildTempTile(BuildContext context, BluetoothDevice d) async {
-    // the service is 0x00FF and the characteristic is 0xFF01
-    if (d.servicesList.length < 3) {
+  // Listens to a characteristic and enables notifications, the spa sends
+  // the current value straight away and then again on every change
+  Future _listen(BluetoothCharacteristic c, void Function(int) onValue) async {
+    final subscription = c.onValueReceived.listen((value) {
+      if (!_firstValueLogged) {
+        _firstValueLogged = true;
+        _logTiming('first value');
+        _connectTimer.stop();
+      }
+      if (value.isNotEmpty && mounted) {
+        setState(() {
+          onValue(value[0]);
+        });
+      }
+    });
+    widget.device.cancelWhenDisconnected(subscription);
+    await c.setNotifyValue(true);
+  }
+
+  Future _subscribe(BluetoothDevice d) async {
+    // the service is 0x00FF, 0xFF01 is temp, 0xFF02 set temp and 0xFF03 mode.
+    // Looked up by UUID, robust caching adds characteristics to the GATT
+    // service so positions in the table are not fixed.
+    final spa = d.servicesList.where((s) => s.uuid == Guid('00ff'));
+    if (spa.isEmpty) {
+      return;
+    }
+    BluetoothCharacteristic? find(String uuid) {
+      for (final c in spa.first.characteristics) {
+        if (c.uuid == Guid(uuid)) {
+          return c;
+        }
+      }
+      return null;
+    }
+
+    final temp = find('ff01');
+    final setTemp = find('ff02');
+    final mode = find('ff03');
+    if (temp == null || setTemp == null || mode == null) {
+      return;
+    }
+    _setTempCharacteristic = setTemp;
+    _setModeCharacteristic = mode;
+    await _listen(temp, (v) => _temp = v);
+    await _listen(_setTempCharacteristic, (v) => _setTemp = v);
+    await _listen(_setModeCharacteristic, (v) {
+      _mode = v;
+      _isJetsOn = v == systemState.indexOf('jets');
+    });
+  }
+
+  Widget _buildTempTile(BuildContext context) {
+    if (_temp == null) {
       return Card(
         shape: CircleBorder(side: BorderSide(color: Colors.grey[300]!)),
         child: Center(
@@ -185,7 +271,6 @@ class _DeviceScreenState extends State<DeviceScreen> {
         ),
       );
     }
-    List<int> temperature = await d.servicesList[2].characteristics[0].read();
     return ConstrainedBox(
       constraints: BoxConstraints(minWidth: 200, minHeight: 200),
       child: Card(
@@ -193,41 +278,30 @@ class _DeviceScreenState extends State<DeviceScreen> {
         clipBehavior: Clip.antiAliasWithSaveLayer,
         shape: CircleBorder(side: BorderSide(color: Colors.grey[300]!)),
         child: Center(
-          child: Text(temperature[0].toString() + '°C',
+          child: Text(_temp.toString() + '°C',
               style: TextStyle(fontSize: 50, color: Colors.blue[300])),
         ),
       ),
     );
   }
 
-  Future<Widget> _buildModeTile(BuildContext context, BluetoothDevice d) async {
-    // the service is 0x00FF and the characteristic is 0xFF03
-
-    if (d.servicesList.length < 3) {
+  Widget _buildModeTile(BuildContext context) {
+    if (_mode == null || _mode! >= systemState.length) {
       return CircularProgressIndicator(
         color: Colors.grey[300]!,
       );
     }
-    _setModeCharacteristic = d.servicesList[2].characteristics[2];
-    List<int> mode = await _setModeCharacteristic.read();
-
-    if (mode[0] == systemState.indexOf('jets')) {
-      _isJetsOn = true;
-    } else {
-      _isJetsOn = false;
-    }
-    return Text('Mode: ' + systemState[mode[0]],
+    return Text('Mode: ' + systemState[_mode!],
         style: Theme.of(context).textTheme.bodyMedium);
   }
 
   Future onUpPressed() async {
+    if (_setTemp == null) {
+      return;
+    }
     try {
-      List<int> temperature =
-          await widget.device.servicesList[2].characteristics[1].read();
-      temperature[0] = temperature[0] + 1;
-      await _setTempCharacteristic.write(temperature);
+      await _setTempCharacteristic.write([_setTemp! + 1]);
       Snackbar.show(ABC.c, "Set temp : Success", success: true);
-      setState(() {});
     } catch (e) {
       Snackbar.show(ABC.c, prettyException("Descriptor Write Error:", e),
           success: false);
@@ -235,13 +309,12 @@ class _DeviceScreenState extends State<DeviceScreen> {
   }
 
   Future onDownPressed() async {
+    if (_setTemp == null) {
+      return;
+    }
     try {
-      List<int> temperature =
-          await widget.device.servicesList[2].characteristics[1].read();
-      temperature[0] = temperature[0] - 1;
-      await _setTempCharacteristic.write(temperature);
+      await _setTempCharacteristic.write([_setTemp! - 1]);
       Snackbar.show(ABC.c, "Set temp : Success", success: true);
-      setState(() {});
     } catch (e) {
       Snackbar.show(ABC.c, prettyException("Descriptor Write Error:", e),
           success: false);
@@ -268,21 +341,20 @@ class _DeviceScreenState extends State<DeviceScreen> {
   }
 
   Future onJetsPressed() async {
+    if (_mode == null) {
+      return;
+    }
     try {
-      List<int> mode = await _setModeCharacteristic.read();
-      if (mode[0] == systemState.indexOf('jets')) {
-        mode[0] = systemState.indexOf('transitionToHeating');
-        await _setModeCharacteristic.write(mode);
+      // The new mode arrives as a notification once the spa has switched
+      if (_mode == systemState.indexOf('jets')) {
+        await _setModeCharacteristic
+            .write([systemState.indexOf('transitionToHeating')]);
         Snackbar.show(ABC.c, "Jets Off", success: true);
-        _isJetsOn = false;
       } else {
-        mode[0] = systemState.indexOf('transitionToJets');
-        await _setModeCharacteristic.write(mode);
+        await _setModeCharacteristic
+            .write([systemState.indexOf('transitionToJets')]);
         Snackbar.show(ABC.c, "Jets On", success: true);
-        _isJetsOn = true;
       }
-
-      setState(() {});
     } catch (e) {
       Snackbar.show(ABC.c, prettyException("Descriptor Write Error:", e),
           success: false);
@@ -308,10 +380,8 @@ class _DeviceScreenState extends State<DeviceScreen> {
     );
   }
 
-  Future<Widget> _buildSetTempTile(
-      BuildContext context, BluetoothDevice d) async {
-    // the service is 0x00FF and the characteristic is 0xFF02
-    if (d.servicesList.length < 3) {
+  Widget _buildSetTempTile(BuildContext context) {
+    if (_setTemp == null) {
       return Container(
         constraints: BoxConstraints(minWidth: 200, minHeight: 150),
         child: Text('Getting set temp',
@@ -319,15 +389,12 @@ class _DeviceScreenState extends State<DeviceScreen> {
             style: Theme.of(context).textTheme.displaySmall),
       );
     }
-    _setTempCharacteristic = d.servicesList[2].characteristics[1];
-    List<int> temperature = await d.servicesList[2].characteristics[1].read();
-    _setTemp = temperature[0];
     return Row(
       mainAxisAlignment: MainAxisAlignment.center,
       children: [
         buildRoundButton(context, onDownPressed, '-'),
         Text(
-          ' ' + temperature[0].toString() + '°C ',
+          ' ' + _setTemp.toString() + '°C ',
           style: TextStyle(fontSize: 30, color: Colors.blue[300]),
         ),
         buildRoundButton(context, onUpPressed, '+')
@@ -450,45 +517,12 @@ class _DeviceScreenState extends State<DeviceScreen> {
         body: SingleChildScrollView(
           child: Column(
             children: <Widget>[
-              FutureBuilder<Widget>(
-                future: _buildTempTile(context, widget.device),
-                builder: (context, snapshot) {
-                  if (snapshot.hasData) {
-                    return snapshot.data!;
-                  } else if (snapshot.hasError) {
-                    return Text('Error: ${snapshot.error}');
-                  } else {
-                    return CircularProgressIndicator();
-                  }
-                },
-              ),
-              FutureBuilder<Widget>(
-                future: _buildModeTile(context, widget.device),
-                builder: (context, snapshot) {
-                  if (snapshot.hasData) {
-                    return snapshot.data!;
-                  } else if (snapshot.hasError) {
-                    return Text('Error: ${snapshot.error}');
-                  } else {
-                    return CircularProgressIndicator();
-                  }
-                },
-              ),
+              _buildTempTile(context),
+              _buildModeTile(context),
               Padding(
                 padding: EdgeInsets.all(10),
               ),
-              FutureBuilder<Widget>(
-                future: _buildSetTempTile(context, widget.device),
-                builder: (context, snapshot) {
-                  if (snapshot.hasData) {
-                    return snapshot.data!;
-                  } else if (snapshot.hasError) {
-                    return Text('Error: ${snapshot.error}');
-                  } else {
-                    return CircularProgressIndicator();
-                  }
-                },
-              ),
+              _buildSetTempTile(context),
               Padding(padding: EdgeInsets.all(10)),
               Row(
                 mainAxisAlignment: MainAxisAlignment.center,
@@ -0,0 +1,488 @@
+/****************************************************************************
+*
+* The open spa GATT server on the NimBLE host. Same service, characteristics,
+* advertising and notification behaviour as the Bluedroid server in
+* gatts_table_creat_demo.c, with a much smaller host stack.
+*
+****************************************************************************/
+
+#include "sdkconfig.h"
+#if CONFIG_BT_NIMBLE_ENABLED
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+#include "gatts_table_creat_demo.h"
+
+// App specific includes
+#include "inc/input_manager.h"
+#include "inc/state_handler.h"
+#include "inc/spa_state.h"
+#include "inc/ble_ota.h"
+#include "inc/gatt_conn.h"
+
+#define GATTS_TABLE_TAG "GATT_NIMBLE_OPEN_SPA"
+
+_Static_assert(GATT_MAX_CONNECTIONS <= CONFIG_BT_NIMBLE_MAX_CONNECTIONS, "more GATT connections than NimBLE allows");
+// Application error from the common profile error codes, as returned by the Bluedroid server
+#define GATT_ERR_OUT_OF_RANGE       0xFF
+
+// Provided by the NimBLE store, has no public header
+void ble_store_config_init(void);
+
+static uint16_t value_handles[NUMBER_OF_NOTIFY];
+static uint16_t ota_ctrl_handle;
+
+// NimBLE keeps the CCCDs itself, the subscriptions are mirrored into gatt_conn.c from the
+// subscribe events so notifications can be rate limited per connection and fanned out from
+// one buffer
+
+// Company id then adv_status_t
+static uint8_t adv_mfg_data[2 + sizeof(adv_status_t)] = { ADV_COMPANY_ID & 0xFF, ADV_COMPANY_ID >> 8 };
+
+static uint8_t own_addr_type;
+// Only touched from the NimBLE host task
+static bool advertising = false;
+
+static int chr_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int ota_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int gap_event_handler(struct ble_gap_event *event, void *arg);
+
+static const struct ble_gatt_svc_def gatt_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(GATTS_SERVICE_UUID),
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = BLE_UUID16_DECLARE(0xFF01),
+                .access_cb = chr_access,
+                .arg = (void *)NOTIFY_TEMP,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &value_handles[NOTIFY_TEMP],
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(0xFF02),
+                .access_cb = chr_access,
+                .arg = (void *)NOTIFY_SET_TEMP,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &value_handles[NOTIFY_SET_TEMP],
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(0xFF03),
+                .access_cb = chr_access,
+                .arg = (void *)NOTIFY_MODE,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &value_handles[NOTIFY_MODE],
+            },
+            {
+                // spa_state_t answered from the latest snapshot, long reads are split up by the host
+                .uuid = BLE_UUID16_DECLARE(0xFF04),
+                .access_cb = chr_access,
+                .arg = (void *)NOTIFY_TELEMETRY,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &value_handles[NOTIFY_TELEMETRY],
+            },
+            {
+                // Firmware update commands, replies are notified. Only over a link paired with the passkey
+                .uuid = BLE_UUID16_DECLARE(0xFF05),
+                .access_cb = ota_access,
+                .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC | BLE_GATT_CHR_F_WRITE_AUTHEN |
+                         BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &ota_ctrl_handle,
+            },
+            {
+                // Firmware image, written without response, same permission as the control
+                .uuid = BLE_UUID16_DECLARE(0xFF06),
+                .access_cb = ota_access,
+                .arg = (void *)1,
+                .flags = BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_WRITE_ENC | BLE_GATT_CHR_F_WRITE_AUTHEN,
+            },
+            { 0 },
+        },
+    },
+    { 0 },
+};
+
+static int find_value(uint16_t handle)
+{
+    for (int i = 0; i < NUMBER_OF_NOTIFY; i++) {
+        if (value_handles[i] == handle) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void send_value(uint16_t conn_handle, int index, const uint8_t *value, uint16_t length, bool indicate)
+{
+    // The host consumes the mbuf, so each connection gets its own copy of the same bytes
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(value, length);
+    if (om == NULL) {
+        return;
+    }
+    if (indicate) {
+        ble_gatts_indicate_custom(conn_handle, value_handles[index], om);
+    } else {
+        ble_gatts_notify_custom(conn_handle, value_handles[index], om);
+    }
+}
+
+// Updates the cached value and notifies subscribers if it changed
+static void update_value(int index, uint8_t value)
+{
+    if (gatt_conn_set_value(index, value)) {
+        gatt_conn_flush();
+    }
+}
+
+static int chr_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    int index = (int)(intptr_t)arg;
+
+    switch (ctxt->op) {
+        case BLE_GATT_ACCESS_OP_READ_CHR: {
+            // Answered from the last value the state handler published, never from its live state
+            uint8_t value[sizeof(spa_state_t)];
+            uint16_t length = gatt_conn_current_value(index, value);
+            int rc = os_mbuf_append(ctxt->om, value, length);
+            gatt_conn_first_value(conn_handle);
+            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        }
+        case BLE_GATT_ACCESS_OP_WRITE_CHR: {
+            // Commands are only validated and queued here, the state handler applies them
+            uint8_t buffer[2] = {0};
+            uint16_t length = 0;
+            uint16_t packet_length = OS_MBUF_PKTLEN(ctxt->om);
+            if (packet_length < 1 || packet_length > sizeof(buffer) ||
+                ble_hs_mbuf_to_flat(ctxt->om, buffer, sizeof(buffer), &length) != 0) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            uint16_t value = buffer[0] | (length == 2 ? buffer[1] << 8 : 0);
+            bool accepted = false;
+            if (value <= UINT8_MAX) {
+                accepted = index == NOTIFY_SET_TEMP ? updateSetTemp(value) : setMode(value);
+            }
+            ESP_LOGI(GATTS_TABLE_TAG, "Write %d = %d, %s", index, value, accepted ? "accepted" : "rejected");
+            return accepted ? 0 : GATT_ERR_OUT_OF_RANGE;
+        }
+        default:
+            return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+static int ota_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    static uint8_t buffer[BLE_ATT_ATTR_MAX_LEN];
+    uint16_t length = 0;
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    // Only the host task gets here, so one flat buffer is enough
+    if (ble_hs_mbuf_to_flat(ctxt->om, buffer, sizeof(buffer), &length) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    if (arg != NULL) {
+        ble_ota_data(conn_handle, buffer, length);
+        return 0;
+    }
+    if (length > 0 && buffer[0] == OTA_OP_BEGIN) {
+        // More than one write per 20-40 ms connection event is needed to reach tens of kB/s
+        struct ble_gap_upd_params params = {
+            .itvl_min = 0x06,       // 7.5ms
+            .itvl_max = 0x0C,       // 15ms
+            .latency = 0,
+            .supervision_timeout = 400,
+        };
+        ble_gap_update_params(conn_handle, &params);
+    }
+    ble_ota_control(conn_handle, buffer, length);
+    return 0;
+}
+
+// Flags, service uuid, name and the status, the same layout as the Bluedroid raw_adv_data
+static int set_adv_fields(void)
+{
+    struct ble_hs_adv_fields fields = {0};
+    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    fields.uuids16 = (ble_uuid16_t[]) { BLE_UUID16_INIT(GATTS_SERVICE_UUID) };
+    fields.num_uuids16 = 1;
+    fields.uuids16_is_complete = 1;
+    fields.name = (uint8_t *)OPEN_SPA_DEVICE_NAME;
+    fields.name_len = strlen(OPEN_SPA_DEVICE_NAME);
+    fields.name_is_complete = 1;
+    fields.mfg_data = adv_mfg_data;
+    fields.mfg_data_len = sizeof(adv_mfg_data);
+    return ble_gap_adv_set_fields(&fields);
+}
+
+static void start_advertising(void)
+{
+    int rc = set_adv_fields();
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "config adv data failed, error code = %d", rc);
+        return;
+    }
+
+    // Tx power is only in the scan response, the space goes to the status
+    struct ble_hs_adv_fields rsp_fields = {0};
+    rsp_fields.tx_pwr_lvl_is_present = 1;
+    rsp_fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
+    rc = ble_gap_adv_rsp_set_fields(&rsp_fields);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "config scan rsp data failed, error code = %d", rc);
+        return;
+    }
+
+    struct ble_gap_adv_params adv_params = {
+        .conn_mode = BLE_GAP_CONN_MODE_UND,
+        .disc_mode = BLE_GAP_DISC_MODE_GEN,
+        .itvl_min = 0x20,
+        .itvl_max = 0x40,
+    };
+    rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER, &adv_params, gap_event_handler, NULL);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "advertising start failed, error code = %d", rc);
+        return;
+    }
+    ESP_LOGI(GATTS_TABLE_TAG, "advertising start successfully");
+    static bool first_start = true;
+    if (first_start) {
+        // Boot time and memory figures used to compare the Bluedroid and NimBLE builds
+        first_start = false;
+        ESP_LOGI(GATTS_TABLE_TAG, "NimBLE advertising %lld ms after boot, free heap %u, minimum %u",
+                 esp_timer_get_time() / 1000, esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+        // The services were registered before the host synced
+        ble_ota_ready(OTA_READY_GATT | OTA_READY_ADV);
+    }
+    advertising = true;
+}
+
+// Only the data changes, advertising keeps running. When stopped the new data goes out
+// with the next start.
+static void set_adv_status(const adv_status_t *status)
+{
+    memcpy(&adv_mfg_data[2], status, sizeof(*status));
+    if (ble_gap_adv_active()) {
+        int rc = set_adv_fields();
+        if (rc != 0) {
+            ESP_LOGE(GATTS_TABLE_TAG, "update adv data failed, error code = %d", rc);
+        }
+    }
+}
+
+static const gatt_conn_host_t gatt_host = {
+    .send = send_value,
+    .set_adv_status = set_adv_status,
+};
+
+static int gap_event_handler(struct ble_gap_event *event, void *arg)
+{
+    switch (event->type) {
+        case BLE_GAP_EVENT_CONNECT: {
+            advertising = false;
+            if (event->connect.status != 0) {
+                ESP_LOGW(GATTS_TABLE_TAG, "connection failed, status %d", event->connect.status);
+                start_advertising();
+                break;
+            }
+            uint16_t conn_handle = event->connect.conn_handle;
+            ESP_LOGI(GATTS_TABLE_TAG, "BLE_GAP_EVENT_CONNECT, conn_handle = %d", conn_handle);
+            struct ble_gap_conn_desc desc;
+            uint8_t addr[GATT_ADDR_LEN] = {0};
+            if (ble_gap_conn_find(conn_handle, &desc) == 0) {
+                memcpy(addr, desc.peer_id_addr.val, sizeof(addr));
+            }
+            int free_slots = gatt_conn_add(conn_handle, addr);
+            if (free_slots < 0) {
+                ESP_LOGW(GATTS_TABLE_TAG, "No free connection slot, disconnecting conn_handle %d", conn_handle);
+                ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                break;
+            }
+            // Advertising stops on every connection, keep it going while another central can join
+            ESP_LOGI(GATTS_TABLE_TAG, "%d connection slots free", free_slots);
+            if (free_slots > 0) {
+                start_advertising();
+            }
+#if CONFIG_BLE_BONDING
+            // Pairs on the first connection, a bonded client just re-encrypts with the stored keys
+            ble_gap_security_initiate(conn_handle);
+#endif
+            break;
+        }
+        case BLE_GAP_EVENT_DISCONNECT:
+            ESP_LOGI(GATTS_TABLE_TAG, "BLE_GAP_EVENT_DISCONNECT, reason = 0x%x", event->disconnect.reason);
+            gatt_conn_remove(event->disconnect.conn.conn_handle);
+            ble_ota_disconnected(event->disconnect.conn.conn_handle);
+            // Still running if there was a free slot before this disconnect
+            if (!advertising) {
+                start_advertising();
+            }
+            break;
+        case BLE_GAP_EVENT_ADV_COMPLETE:
+            advertising = false;
+            break;
+        case BLE_GAP_EVENT_SUBSCRIBE: {
+            int index = find_value(event->subscribe.attr_handle);
+            if (index < 0) {
+                break;
+            }
+            ESP_LOGI(GATTS_TABLE_TAG, "conn %d, value %d, notify %d, indicate %d", event->subscribe.conn_handle,
+                     index, event->subscribe.cur_notify, event->subscribe.cur_indicate);
+            gatt_conn_subscribe(event->subscribe.conn_handle, index,
+                                (event->subscribe.cur_notify ? GATT_CCCD_NOTIFY : 0) |
+                                (event->subscribe.cur_indicate ? GATT_CCCD_INDICATE : 0));
+            break;
+        }
+        case BLE_GAP_EVENT_MTU:
+            ESP_LOGI(GATTS_TABLE_TAG, "BLE_GAP_EVENT_MTU, MTU %d", event->mtu.value);
+            gatt_conn_set_mtu(event->mtu.conn_handle, event->mtu.value);
+            break;
+#if CONFIG_BLE_BONDING
+        case BLE_GAP_EVENT_ENC_CHANGE: {
+            int64_t connected_at = gatt_conn_connected_at(event->enc_change.conn_handle);
+            if (event->enc_change.status == 0) {
+                struct ble_gap_conn_desc desc;
+                bool authenticated = ble_gap_conn_find(event->enc_change.conn_handle, &desc) == 0 &&
+                                     desc.sec_state.authenticated;
+                ESP_LOGI(GATTS_TABLE_TAG, "link encrypted, %s, %lld ms after connect",
+                         authenticated ? "passkey" : "Just Works",
+                         connected_at != 0 ? (esp_timer_get_time() - connected_at) / 1000 : -1);
+            } else {
+                ESP_LOGW(GATTS_TABLE_TAG, "pairing failed, status %d", event->enc_change.status);
+            }
+            break;
+        }
+        case BLE_GAP_EVENT_PASSKEY_ACTION:
+            // The static passkey, the client has to enter it
+            if (event->passkey.params.action == BLE_SM_IOACT_DISP) {
+                struct ble_sm_io io = {
+                    .action = BLE_SM_IOACT_DISP,
+                    .passkey = CONFIG_BLE_PASSKEY,
+                };
+                ble_sm_inject_io(event->passkey.conn_handle, &io);
+            }
+            break;
+        case BLE_GAP_EVENT_REPEAT_PAIRING: {
+            // The phone lost its keys, forget ours and pair again
+            struct ble_gap_conn_desc desc;
+            if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) {
+                ble_store_util_delete_peer(&desc.peer_id_addr);
+            }
+            return BLE_GAP_REPEAT_PAIRING_RETRY;
+        }
+#endif
+        default:
+            break;
+    }
+    return 0;
+}
+
+void gattUpdateTemp(uint8_t currentTemp){
+    update_value(NOTIFY_TEMP, currentTemp);
+}
+
+void gattUpdateMode(uint8_t mode){
+    update_value(NOTIFY_MODE, mode);
+}
+
+void gattUpdateSetpoint(uint8_t setpoint){
+    update_value(NOTIFY_SET_TEMP, setpoint);
+}
+
+void gattUpdateTelemetry(void){
+    gatt_conn_telemetry_changed();
+}
+
+void gattOtaNotify(uint16_t conn_id, const uint8_t *data, uint16_t length){
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(data, length);
+    if (om != NULL) {
+        ble_gatts_notify_custom(conn_id, ota_ctrl_handle, om);
+    }
+}
+
+static void on_sync(void)
+{
+    int rc = ble_hs_util_ensure_addr(0);
+    if (rc == 0) {
+        rc = ble_hs_id_infer_auto(0, &own_addr_type);
+    }
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "no usable address, error code = %d", rc);
+        return;
+    }
+    start_advertising();
+}
+
+static void on_reset(int reason)
+{
+    ESP_LOGE(GATTS_TABLE_TAG, "host reset, reason = %d", reason);
+}
+
+static void host_task(void *param)
+{
+    // Returns when nimble_port_stop() is called
+    nimble_port_run();
+    nimble_port_freertos_deinit();
+}
+
+bool gatt_server_init(void)
+{
+    esp_err_t ret = nimble_port_init();
+    if (ret) {
+        ESP_LOGE(GATTS_TABLE_TAG, "%s init nimble failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    ble_hs_cfg.reset_cb = on_reset;
+    ble_hs_cfg.sync_cb = on_sync;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+#if CONFIG_BLE_BONDING
+    // The spa has no display or keys, it claims a display and shows the static passkey from the
+    // label. Clients without input still pair Just Works, only the firmware update needs the
+    // passkey. Keys are kept in NVS by the store.
+    ble_hs_cfg.sm_io_cap = BLE_HS_IO_DISPLAY_ONLY;
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_mitm = 1;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+#endif
+
+    ble_svc_gap_init();
+    ble_svc_gatt_init();
+    int rc = ble_gatts_count_cfg(gatt_svcs);
+    if (rc == 0) {
+        rc = ble_gatts_add_svcs(gatt_svcs);
+    }
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "add service failed, error code = %d", rc);
+        return false;
+    }
+    rc = ble_svc_gap_device_name_set(OPEN_SPA_DEVICE_NAME);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "set device name failed, error code = %d", rc);
+    }
+    rc = ble_att_set_preferred_mtu(500);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TABLE_TAG, "set local  MTU failed, error code = %d", rc);
+    }
+
+    if (!gatt_conn_init(&gatt_host)) {
+        return false;
+    }
+
+    ble_store_config_init();
+    nimble_port_freertos_init(host_task);
+    return true;
+}
+
+#endif // CONFIG_BT_NIMBLE_ENABLED
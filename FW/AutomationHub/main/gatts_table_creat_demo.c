@@ -14,6 +14,8 @@
 *
 ****************************************************************************/
 
+#include "sdkconfig.h"
+#if CONFIG_BT_BLUEDROID_ENABLED
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -22,6 +24,7 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_bt.h"
+#include "esp_timer.h"
 
 #include "esp_gap_ble_api.h"
 #include "esp_gatts_api.h"
@@ -31,17 +34,16 @@
 
 // App specific includes
 #include "inc/input_manager.h"
-#include "inc/output_manager.h"
 #include "inc/state_handler.h"
-#include "inc/bus_manager.h"
-#include "inc/config.h"
+#include "inc/spa_state.h"
+#include "inc/ble_ota.h"
+#include "inc/gatt_conn.h"
 
 #define GATTS_TABLE_TAG "GATTS_TABLE_OPEN_SPA"
 
 #define PROFILE_NUM                 1
 #define PROFILE_APP_IDX             0
 #define ESP_APP_ID                  0x55
-#define OPEN_SPA_DEVICE_NAME        "OPEN_SPA"
 #define SVC_INST_ID                 0
 
 /* The max length of characteristic value. When the GATT client performs a write or prepare write operation,
@@ -51,10 +53,15 @@
 #define PREPARE_BUF_MAX_SIZE        1024
 #define CHAR_DECLARATION_SIZE       (sizeof(uint8_t))
 
+_Static_assert(GATT_MAX_CONNECTIONS <= CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF, "more GATT connections than the controller allows");
+_Static_assert(ESP_GATT_DEF_BLE_MTU_SIZE == GATT_DEFAULT_MTU, "connections start at the default MTU");
+
 #define ADV_CONFIG_FLAG             (1 << 0)
 #define SCAN_RSP_CONFIG_FLAG        (1 << 1)
 
 static uint8_t adv_config_done       = 0;
+// Only touched from the Bluetooth task
+static bool advertising              = false;
 
 uint16_t open_spa_handle_table[HRS_IDX_NB];
 
@@ -65,18 +72,37 @@ typedef struct {
 
 static prepare_type_env_t prepare_write_env;
 
+typedef struct {
+    uint16_t value_idx;
+    uint16_t cfg_idx;
+} notify_char_t;
+
+static const notify_char_t notify_chars[NUMBER_OF_NOTIFY] = {
+    [NOTIFY_TEMP]       = { .value_idx = IDX_CHAR_VAL_A,        .cfg_idx = IDX_CHAR_CFG_A },
+    [NOTIFY_SET_TEMP]   = { .value_idx = IDX_CHAR_VAL_SET_TEMP, .cfg_idx = IDX_CHAR_CFG_SET_TEMP },
+    [NOTIFY_MODE]       = { .value_idx = IDX_CHAR_VAL_MODE,     .cfg_idx = IDX_CHAR_CFG_MODE },
+    [NOTIFY_TELEMETRY]  = { .value_idx = IDX_CHAR_VAL_TELEMETRY, .cfg_idx = IDX_CHAR_CFG_TELEMETRY },
+};
+
+// Client configuration and notification rate limiting are kept per connection in gatt_conn.c,
+// not in the shared attribute table
+
+#define ADV_STATUS_OFFSET           21          // Start of adv_status_t in raw_adv_data
+
 #define CONFIG_SET_RAW_ADV_DATA
 #ifdef CONFIG_SET_RAW_ADV_DATA
-static uint8_t raw_adv_data[20] = {
+// Tx power is only in the scan response, the space goes to the status
+static uint8_t raw_adv_data[ADV_STATUS_OFFSET + sizeof(adv_status_t)] = {
         /* flags */
         0x02, 0x01, 0x06,
-        /* tx power*/
-        0x02, 0x0a, 0xeb,
         /* service uuid */
         0x03, 0x03, 0xFF, 0x00,
         /* device name */
-        0x09, 0x09, 'O', 'P', 'E', 'N', '_', 'S', 'P', 'A'
+        0x09, 0x09, 'O', 'P', 'E', 'N', '_', 'S', 'P', 'A',
+        /* manufacturer data, company id then adv_status_t */
+        0x03 + sizeof(adv_status_t), 0xFF, ADV_COMPANY_ID & 0xFF, ADV_COMPANY_ID >> 8,
 };
+_Static_assert(sizeof(raw_adv_data) <= ESP_BLE_ADV_DATA_LEN_MAX, "advertising data too long");
 
 static uint8_t raw_scan_rsp_data[] = {
         /* flags */
@@ -167,10 +193,13 @@ static struct gatts_profile_inst heart_rate_profile_tab[PROFILE_NUM] = {
 };
 
 /* Service */
-static const uint16_t GATTS_SERVICE_UUID_TEST      = 0x00FF;
+static const uint16_t GATTS_SERVICE_UUID_TEST      = GATTS_SERVICE_UUID;
 static const uint16_t GATTS_CHAR_UUID_TEST_A       = 0xFF01;
 static const uint16_t GATTS_CHAR_UUID_TEST_B       = 0xFF02;
 static const uint16_t GATTS_CHAR_UUID_TEST_C       = 0xFF03;
+static const uint16_t GATTS_CHAR_UUID_TELEMETRY    = 0xFF04;
+static const uint16_t GATTS_CHAR_UUID_OTA_CTRL     = 0xFF05;
+static const uint16_t GATTS_CHAR_UUID_OTA_DATA     = 0xFF06;
 
 static const uint16_t primary_service_uuid         = ESP_GATT_UUID_PRI_SERVICE;
 static const uint16_t character_declaration_uuid   = ESP_GATT_UUID_CHAR_DECLARE;
@@ -179,9 +208,17 @@ static const uint8_t char_prop_read                = ESP_GATT_CHAR_PROP_BIT_READ
 //static const uint8_t char_prop_write               = ESP_GATT_CHAR_PROP_BIT_WRITE;
 static const uint8_t char_prop_read_write          = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE;
 //static const uint8_t char_prop_read_write_notify   = ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+static const uint8_t char_prop_read_notify         = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE;
+static const uint8_t char_prop_read_write_notify   = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE |
+                                                     ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE;
+static const uint8_t char_prop_write_notify        = ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+static const uint8_t char_prop_write_nr            = ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
+static const uint16_t cccd_value                   = 0x0000;
 static const uint8_t temp_value                    = 0x00;
 static const uint8_t setTemp_value                 = 0x23;
 static const uint8_t mode_value                    = 0x00;
+static const uint8_t telemetry_value               = 0x00;
+static const uint8_t ota_value                     = 0x00;
 
 /* Full Database Description - Used to add attributes into the database */
 static const esp_gatts_attr_db_t gatt_db[HRS_IDX_NB] =
@@ -194,38 +231,152 @@ static const esp_gatts_attr_db_t gatt_db[HRS_IDX_NB] =
     /* Characteristic Declaration */
     [IDX_CHAR_A]     =
     {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
-      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read}},
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_notify}},
 
     /* Characteristic Value */
     [IDX_CHAR_VAL_A] =
     {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_TEST_A, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
       GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(temp_value), (uint8_t *)&temp_value}},
 
-    /* Client Characteristic Configuration Descriptor */
+    /* Client Characteristic Configuration Descriptor, answered per connection */
     [IDX_CHAR_CFG_A]  =
-    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
-      sizeof(uint16_t), sizeof(temp_value), (uint8_t *)&temp_value}},
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+      sizeof(uint16_t), sizeof(cccd_value), (uint8_t *)&cccd_value}},
 
     /* Characteristic Declaration */
     [IDX_CHAR_SET_TEMP]      =
     {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
-      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_write}},
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_write_notify}},
 
     /* Characteristic Value */
     [IDX_CHAR_VAL_SET_TEMP]  =
-    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_TEST_B, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_TEST_B, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
       GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(setTemp_value), (uint8_t *)&setTemp_value}},
 
+    /* Client Characteristic Configuration Descriptor, answered per connection */
+    [IDX_CHAR_CFG_SET_TEMP]  =
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+      sizeof(uint16_t), sizeof(cccd_value), (uint8_t *)&cccd_value}},
+
     /* Characteristic Declaration */
     [IDX_CHAR_MODE]      =
     {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
-      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_write}},
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_write_notify}},
 
     /* Characteristic Value */
     [IDX_CHAR_VAL_MODE]  =
-    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_TEST_C, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_TEST_C, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
       GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(mode_value), (uint8_t *)&mode_value}},
 
+    /* Client Characteristic Configuration Descriptor, answered per connection */
+    [IDX_CHAR_CFG_MODE]  =
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+      sizeof(uint16_t), sizeof(cccd_value), (uint8_t *)&cccd_value}},
+
+    /* Characteristic Declaration */
+    [IDX_CHAR_TELEMETRY]      =
+    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_notify}},
+
+    /* Characteristic Value, a spa_state_t answered from the latest snapshot */
+    [IDX_CHAR_VAL_TELEMETRY]  =
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_TELEMETRY, ESP_GATT_PERM_READ,
+      sizeof(spa_state_t), sizeof(telemetry_value), (uint8_t *)&telemetry_value}},
+
+    /* Client Characteristic Configuration Descriptor, answered per connection */
+    [IDX_CHAR_CFG_TELEMETRY]  =
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+      sizeof(uint16_t), sizeof(cccd_value), (uint8_t *)&cccd_value}},
+
+    /* Characteristic Declaration */
+    [IDX_CHAR_OTA_CTRL]      =
+    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_write_notify}},
+
+    /* Characteristic Value, firmware update commands, replies are notified. Only over a link paired with the passkey */
+    [IDX_CHAR_VAL_OTA_CTRL]  =
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_OTA_CTRL, ESP_GATT_PERM_WRITE_ENC_MITM,
+      GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(ota_value), (uint8_t *)&ota_value}},
+
+    /* Client Characteristic Configuration Descriptor */
+    [IDX_CHAR_CFG_OTA_CTRL]  =
+    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+      sizeof(uint16_t), sizeof(cccd_value), (uint8_t *)&cccd_value}},
+
+    /* Characteristic Declaration */
+    [IDX_CHAR_OTA_DATA]      =
+    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_write_nr}},
+
+    /* Characteristic Value, firmware image written without response, same permission as the control */
+    [IDX_CHAR_VAL_OTA_DATA]  =
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_OTA_DATA, ESP_GATT_PERM_WRITE_ENC_MITM,
+      GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(ota_value), (uint8_t *)&ota_value}},
+
+};
+
+// A firmware update needs more than one write per 20-40 ms connection event to reach tens
+// of kB/s, so the link is asked for the shortest interval for the rest of the connection
+static void request_fast_link(esp_bd_addr_t bda)
+{
+    esp_ble_conn_update_params_t conn_params = {0};
+    memcpy(conn_params.bda, bda, sizeof(esp_bd_addr_t));
+    conn_params.latency = 0;
+    conn_params.min_int = 0x06;    // min_int = 0x06*1.25ms = 7.5ms
+    conn_params.max_int = 0x0C;    // max_int = 0x0C*1.25ms = 15ms
+    conn_params.timeout = 400;    // timeout = 400*10ms = 4000ms
+    esp_ble_gap_update_conn_params(&conn_params);
+}
+
+// Returns the subscribable value whose CCCD has this handle, -1 if none
+static int find_cccd(uint16_t handle)
+{
+    for (int i = 0; i < NUMBER_OF_NOTIFY; i++) {
+        if (open_spa_handle_table[notify_chars[i].cfg_idx] == handle) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void send_value(uint16_t conn_id, int index, const uint8_t *value, uint16_t length, bool indicate)
+{
+    esp_gatt_if_t gatts_if = heart_rate_profile_tab[PROFILE_APP_IDX].gatts_if;
+    if (gatts_if == ESP_GATT_IF_NONE) {
+        return;
+    }
+    esp_ble_gatts_send_indicate(gatts_if, conn_id, open_spa_handle_table[notify_chars[index].value_idx],
+                                length, (uint8_t *)value, indicate);
+}
+
+// Updates the attribute value and notifies subscribers if it changed
+static void update_value(int index, uint8_t value)
+{
+    if (!gatt_conn_set_value(index, value)) {
+        return;
+    }
+    uint16_t handle = open_spa_handle_table[notify_chars[index].value_idx];
+    if (handle != 0) {
+        esp_ble_gatts_set_attr_value(handle, sizeof(value), &value);
+    }
+    gatt_conn_flush();
+}
+
+// Not tracked in adv_config_done, the set complete event must not restart advertising
+static void set_adv_status(const adv_status_t *status)
+{
+#ifdef CONFIG_SET_RAW_ADV_DATA
+    memcpy(&raw_adv_data[ADV_STATUS_OFFSET], status, sizeof(*status));
+    esp_err_t ret = esp_ble_gap_config_adv_data_raw(raw_adv_data, sizeof(raw_adv_data));
+    if (ret) {
+        ESP_LOGE(GATTS_TABLE_TAG, "update adv data failed, error code = %x", ret);
+    }
+#endif
+}
+
+static const gatt_conn_host_t gatt_host = {
+    .send = send_value,
+    .set_adv_status = set_adv_status,
 };
 
 static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
@@ -233,6 +384,10 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
     switch (event) {
     #ifdef CONFIG_SET_RAW_ADV_DATA
         case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
+            if (!(adv_config_done & ADV_CONFIG_FLAG)){
+                // Status update while already advertising
+                break;
+            }
             adv_config_done &= (~ADV_CONFIG_FLAG);
             if (adv_config_done == 0){
                 esp_ble_gap_start_advertising(&adv_params);
@@ -264,6 +419,15 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
                 ESP_LOGE(GATTS_TABLE_TAG, "advertising start failed");
             }else{
                 ESP_LOGI(GATTS_TABLE_TAG, "advertising start successfully");
+                static bool first_start = true;
+                if (first_start) {
+                    // Boot time and memory figures used to compare the Bluedroid and NimBLE builds
+                    first_start = false;
+                    ESP_LOGI(GATTS_TABLE_TAG, "Bluedroid advertising %lld ms after boot, free heap %u, minimum %u",
+                             esp_timer_get_time() / 1000, esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+                    ble_ota_ready(OTA_READY_ADV);
+                }
+                advertising = true;
             }
             break;
         case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
@@ -272,8 +436,34 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
             }
             else {
                 ESP_LOGI(GATTS_TABLE_TAG, "Stop adv successfully\n");
+                advertising = false;
             }
             break;
+#if CONFIG_BLE_BONDING
+        case ESP_GAP_BLE_SEC_REQ_EVT:
+            esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
+            break;
+        case ESP_GAP_BLE_PASSKEY_NOTIF_EVT:
+            // The static passkey, the client has to enter it
+            ESP_LOGI(GATTS_TABLE_TAG, "passkey pairing requested");
+            break;
+        case ESP_GAP_BLE_AUTH_CMPL_EVT: {
+            int64_t connected_at = 0;
+            uint16_t conn_id;
+            if (gatt_conn_find_addr(param->ble_security.auth_cmpl.bd_addr, &conn_id)) {
+                connected_at = gatt_conn_connected_at(conn_id);
+            }
+            if (param->ble_security.auth_cmpl.success) {
+                ESP_LOGI(GATTS_TABLE_TAG, "link encrypted, %s, %s, %lld ms after connect",
+                         param->ble_security.auth_cmpl.auth_mode & ESP_LE_AUTH_BOND ? "bonded" : "not bonded",
+                         param->ble_security.auth_cmpl.auth_mode & ESP_LE_AUTH_REQ_MITM ? "passkey" : "Just Works",
+                         connected_at != 0 ? (esp_timer_get_time() - connected_at) / 1000 : -1);
+            } else {
+                ESP_LOGW(GATTS_TABLE_TAG, "pairing failed, reason 0x%x", param->ble_security.auth_cmpl.fail_reason);
+            }
+            break;
+        }
+#endif
         case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "update connection params status = %d, min_int = %d, max_int = %d,conn_int = %d,latency = %d, timeout = %d",
                   param->update_conn_params.status,
@@ -347,6 +537,19 @@ void example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble
     prepare_write_env->prepare_len = 0;
 }
 
+// Command values are one byte, a little endian 16 bit write is accepted as well
+static bool decode_write_value(const esp_ble_gatts_cb_param_t *param, uint16_t *value)
+{
+    if (param->write.len == 1) {
+        *value = param->write.value[0];
+    } else if (param->write.len == 2) {
+        *value = param->write.value[1]<<8 | param->write.value[0];
+    } else {
+        return false;
+    }
+    return true;
+}
+
 static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
 {
     switch (event) {
@@ -388,79 +591,100 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
        	    break;
         case ESP_GATTS_READ_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_READ_EVT");
-            if(open_spa_handle_table[IDX_CHAR_VAL_SET_TEMP] == param->write.handle){
-                    uint8_t currentSetTemp = readSetTemp();
-                    ESP_LOGI(GATTS_TABLE_TAG, "Read temp setting = %d", currentSetTemp);
-                    esp_ble_gatts_set_attr_value(open_spa_handle_table[IDX_CHAR_VAL_SET_TEMP],
-                                                sizeof(currentSetTemp), 
-                                                &currentSetTemp);
+            if (open_spa_handle_table[IDX_CHAR_VAL_TELEMETRY] == param->read.handle){
+                // Long reads come back with an offset when the MTU is smaller than the state
+                esp_gatt_rsp_t rsp = {0};
+                spa_state_t telemetry = {0};
+                esp_gatt_status_t status = ESP_GATT_OK;
+                spa_state_read(&telemetry);
+                rsp.attr_value.handle = param->read.handle;
+                rsp.attr_value.offset = param->read.offset;
+                if (param->read.offset > sizeof(telemetry)){
+                    status = ESP_GATT_INVALID_OFFSET;
+                }else{
+                    rsp.attr_value.len = sizeof(telemetry) - param->read.offset;
+                    memcpy(rsp.attr_value.value, (uint8_t *)&telemetry + param->read.offset, rsp.attr_value.len);
+                }
+                esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, status, &rsp);
+                gatt_conn_first_value(param->read.conn_id);
+                break;
             }
-
-            if(open_spa_handle_table[IDX_CHAR_VAL_MODE] == param->write.handle){
-                uint8_t currentMode = getMode();
-                ESP_LOGI(GATTS_TABLE_TAG, "Read mode = %d", currentMode);
-                esp_ble_gatts_set_attr_value(open_spa_handle_table[IDX_CHAR_VAL_MODE],
-                                            sizeof(currentMode), 
-                                            &currentMode);
+            int cccd_index = find_cccd(param->read.handle);
+            if (cccd_index >= 0){
+                esp_gatt_rsp_t rsp = {0};
+                uint16_t cccd = gatt_conn_cccd(param->read.conn_id, cccd_index);
+                rsp.attr_value.handle = param->read.handle;
+                rsp.attr_value.len = sizeof(cccd);
+                rsp.attr_value.value[0] = cccd & 0xFF;
+                rsp.attr_value.value[1] = cccd >> 8;
+                esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, ESP_GATT_OK, &rsp);
+                break;
             }
-
-            if(open_spa_handle_table[IDX_CHAR_VAL_A] == param->write.handle){
-                uint8_t currentTemp = getTemp();
-                ESP_LOGI(GATTS_TABLE_TAG, "Read temp = %d", currentTemp);
-                esp_ble_gatts_set_attr_value(open_spa_handle_table[IDX_CHAR_VAL_A],
-                                            sizeof(currentTemp), 
-                                            &currentTemp);
+            if (open_spa_handle_table[IDX_CHAR_VAL_SET_TEMP] == param->read.handle ||
+                open_spa_handle_table[IDX_CHAR_VAL_MODE] == param->read.handle){
+                // Answered from the last value the state handler published, never from its live state
+                int index = open_spa_handle_table[IDX_CHAR_VAL_MODE] == param->read.handle ? NOTIFY_MODE : NOTIFY_SET_TEMP;
+                esp_gatt_rsp_t rsp = {0};
+                rsp.attr_value.handle = param->read.handle;
+                rsp.attr_value.len = gatt_conn_current_value(index, rsp.attr_value.value);
+                esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, ESP_GATT_OK, &rsp);
+                gatt_conn_first_value(param->read.conn_id);
             }
        	    break;
         case ESP_GATTS_WRITE_EVT:
+            if (!param->write.is_prep && open_spa_handle_table[IDX_CHAR_VAL_OTA_DATA] == param->write.handle){
+                // Firmware image, hundreds of writes a second, so no logging here
+                ble_ota_data(param->write.conn_id, param->write.value, param->write.len);
+                if (param->write.need_rsp){
+                    esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
+                }
+                break;
+            }
             if (!param->write.is_prep){
                 // the data length of gattc write  must be less than GATTS_DEMO_CHAR_VAL_LEN_MAX.
                 ESP_LOGI(GATTS_TABLE_TAG, "GATT_WRITE_EVT, handle = %d, value len = %d, value :", param->write.handle, param->write.len);
                 esp_log_buffer_hex(GATTS_TABLE_TAG, param->write.value, param->write.len);
+                // Commands are only validated and queued here, the state handler applies them
+                // and the set point is stored to flash in the background
+                esp_gatt_status_t status = ESP_GATT_OK;
                 if(open_spa_handle_table[IDX_CHAR_VAL_SET_TEMP] == param->write.handle){
-                    uint16_t setTemp = param->write.value[1]<<8 | param->write.value[0];
-                    ESP_LOGI(GATTS_TABLE_TAG, "Set temp = %d", setTemp);
-                    updateSetTemp(setTemp);
+                    uint16_t setTemp = 0;
+                    if(!decode_write_value(param, &setTemp)){
+                        status = ESP_GATT_INVALID_ATTR_LEN;
+                    }else if(setTemp > UINT8_MAX || !updateSetTemp(setTemp)){
+                        status = ESP_GATT_OUT_OF_RANGE;
+                    }
+                    ESP_LOGI(GATTS_TABLE_TAG, "Set temp = %d, status 0x%x", setTemp, status);
                 }
                 if(open_spa_handle_table[IDX_CHAR_VAL_MODE] == param->write.handle){
-                    uint16_t mode = param->write.value[1]<<8 | param->write.value[0];
-                    ESP_LOGI(GATTS_TABLE_TAG, "Set Mode = %d", mode);
-                    setMode(mode);
+                    uint16_t mode = 0;
+                    if(!decode_write_value(param, &mode)){
+                        status = ESP_GATT_INVALID_ATTR_LEN;
+                    }else if(mode > UINT8_MAX || !setMode(mode)){
+                        status = ESP_GATT_OUT_OF_RANGE;
+                    }
+                    ESP_LOGI(GATTS_TABLE_TAG, "Set Mode = %d, status 0x%x", mode, status);
                 }
-                if (open_spa_handle_table[IDX_CHAR_CFG_A] == param->write.handle && param->write.len == 2){
-                    uint16_t descr_value = param->write.value[1]<<8 | param->write.value[0];
-                    if (descr_value == 0x0001){
-                        ESP_LOGI(GATTS_TABLE_TAG, "notify enable");
-                        uint8_t notify_data[15];
-                        for (int i = 0; i < sizeof(notify_data); ++i)
-                        {
-                            notify_data[i] = i % 0xff;
-                        }
-                        //the size of notify_data[] need less than MTU size
-                        esp_ble_gatts_send_indicate(gatts_if, param->write.conn_id, open_spa_handle_table[IDX_CHAR_VAL_A],
-                                                sizeof(notify_data), notify_data, false);
-                    }else if (descr_value == 0x0002){
-                        ESP_LOGI(GATTS_TABLE_TAG, "indicate enable");
-                        uint8_t indicate_data[15];
-                        for (int i = 0; i < sizeof(indicate_data); ++i)
-                        {
-                            indicate_data[i] = i % 0xff;
-                        }
-                        //the size of indicate_data[] need less than MTU size
-                        esp_ble_gatts_send_indicate(gatts_if, param->write.conn_id, open_spa_handle_table[IDX_CHAR_VAL_A],
-                                            sizeof(indicate_data), indicate_data, true);
+                if(open_spa_handle_table[IDX_CHAR_VAL_OTA_CTRL] == param->write.handle){
+                    if(param->write.len > 0 && param->write.value[0] == OTA_OP_BEGIN){
+                        request_fast_link(param->write.bda);
                     }
-                    else if (descr_value == 0x0000){
-                        ESP_LOGI(GATTS_TABLE_TAG, "notify/indicate disable ");
+                    ble_ota_control(param->write.conn_id, param->write.value, param->write.len);
+                }
+                int index = find_cccd(param->write.handle);
+                if (index >= 0 && param->write.len == 2){
+                    uint16_t descr_value = param->write.value[1]<<8 | param->write.value[0];
+                    if (descr_value == 0x0000 || descr_value == GATT_CCCD_NOTIFY || descr_value == GATT_CCCD_INDICATE){
+                        ESP_LOGI(GATTS_TABLE_TAG, "conn %d, value %d, cccd 0x%x", param->write.conn_id, index, descr_value);
+                        gatt_conn_subscribe(param->write.conn_id, index, descr_value);
                     }else{
                         ESP_LOGE(GATTS_TABLE_TAG, "unknown descr value");
                         esp_log_buffer_hex(GATTS_TABLE_TAG, param->write.value, param->write.len);
                     }
-
                 }
                 /* send response when param->write.need_rsp is true*/
                 if (param->write.need_rsp){
-                    esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
+                    esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
                 }
             }else{
                 /* handle prepare write */
@@ -474,16 +698,36 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
             break;                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                   
         case ESP_GATTS_MTU_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_MTU_EVT, MTU %d", param->mtu.mtu);
+            gatt_conn_set_mtu(param->mtu.conn_id, param->mtu.mtu);
             break;
         case ESP_GATTS_CONF_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_CONF_EVT, status = %d, attr_handle %d", param->conf.status, param->conf.handle);
             break;
         case ESP_GATTS_START_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "SERVICE_START_EVT, status %d, service_handle %d", param->start.status, param->start.service_handle);
+            if (param->start.status == ESP_GATT_OK) {
+                ble_ota_ready(OTA_READY_GATT);
+            }
             break;
         case ESP_GATTS_CONNECT_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_CONNECT_EVT, conn_id = %d", param->connect.conn_id);
             esp_log_buffer_hex(GATTS_TABLE_TAG, param->connect.remote_bda, 6);
+            int free_slots = gatt_conn_add(param->connect.conn_id, param->connect.remote_bda);
+            if (free_slots < 0) {
+                ESP_LOGW(GATTS_TABLE_TAG, "No free connection slot, disconnecting conn_id %d", param->connect.conn_id);
+                esp_ble_gap_disconnect(param->connect.remote_bda);
+                break;
+            }
+            // Advertising stops on every connection, keep it going while another central can join
+            advertising = false;
+            ESP_LOGI(GATTS_TABLE_TAG, "%d connection slots free", free_slots);
+            if (free_slots > 0) {
+                esp_ble_gap_start_advertising(&adv_params);
+            }
+#if CONFIG_BLE_BONDING
+            // Pairs on the first connection, a bonded client just re-encrypts with the stored keys
+            esp_ble_set_encryption(param->connect.remote_bda, ESP_BLE_SEC_ENCRYPT_NO_MITM);
+#endif
             esp_ble_conn_update_params_t conn_params = {0};
             memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
             /* For the iOS system, please refer to Apple official documents about the BLE connection parameters restrictions. */
@@ -496,7 +740,12 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
             break;
         case ESP_GATTS_DISCONNECT_EVT:
             ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_DISCONNECT_EVT, reason = 0x%x", param->disconnect.reason);
-            esp_ble_gap_start_advertising(&adv_params);
+            gatt_conn_remove(param->disconnect.conn_id);
+            ble_ota_disconnected(param->disconnect.conn_id);
+            // Still running if there was a free slot before this disconnect
+            if (!advertising) {
+                esp_ble_gap_start_advertising(&adv_params);
+            }
             break;
         case ESP_GATTS_CREAT_ATTR_TAB_EVT:{
             if (param->add_attr_tab.status != ESP_GATT_OK){
@@ -509,6 +758,14 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
             else {
                 ESP_LOGI(GATTS_TABLE_TAG, "create attribute table successfully, the number handle = %d\n",param->add_attr_tab.num_handle);
                 memcpy(open_spa_handle_table, param->add_attr_tab.handles, sizeof(open_spa_handle_table));
+                // Values set before the table existed
+                for (int i = 0; i < NUMBER_OF_NOTIFY; i++) {
+                    uint8_t value;
+                    if (i != NOTIFY_TELEMETRY && gatt_conn_current_value(i, &value) != 0) {
+                        esp_ble_gatts_set_attr_value(open_spa_handle_table[notify_chars[i].value_idx],
+                                                    sizeof(value), &value);
+                    }
+                }
                 esp_ble_gatts_start_service(open_spa_handle_table[IDX_SVC]);
             }
             break;
@@ -527,15 +784,28 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
 }
 
 void gattUpdateTemp(uint8_t currentTemp){
-    esp_ble_gatts_set_attr_value(open_spa_handle_table[IDX_CHAR_VAL_A],
-                                sizeof(currentTemp), 
-                                &currentTemp);
+    update_value(NOTIFY_TEMP, currentTemp);
 }
 
 void gattUpdateMode(uint8_t mode){
-    esp_ble_gatts_set_attr_value(open_spa_handle_table[IDX_CHAR_VAL_MODE],
-                                sizeof(mode), 
-                                &mode);
+    update_value(NOTIFY_MODE, mode);
+}
+
+void gattUpdateSetpoint(uint8_t setpoint){
+    update_value(NOTIFY_SET_TEMP, setpoint);
+}
+
+void gattUpdateTelemetry(void){
+    gatt_conn_telemetry_changed();
+}
+
+void gattOtaNotify(uint16_t conn_id, const uint8_t *data, uint16_t length){
+    esp_gatt_if_t gatts_if = heart_rate_profile_tab[PROFILE_APP_IDX].gatts_if;
+    if (gatts_if == ESP_GATT_IF_NONE) {
+        return;
+    }
+    esp_ble_gatts_send_indicate(gatts_if, conn_id, open_spa_handle_table[IDX_CHAR_VAL_OTA_CTRL],
+                                length, (uint8_t *)data, false);
 }
 
 static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
@@ -565,70 +835,84 @@ static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
     } while (0);
 }
 
-void app_main(void)
+bool gatt_server_init(void)
 {
     esp_err_t ret;
 
-    if (!init_nvm()){
-        ESP_LOGE(GATTS_TABLE_TAG, "Error initializing NVM");
-        return;
-    }
-    /* Initialize NVS. */
-
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
     ret = esp_bt_controller_init(&bt_cfg);
     if (ret) {
         ESP_LOGE(GATTS_TABLE_TAG, "%s enable controller failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return false;
     }
 
     ret = esp_bt_controller_enable(ESP_BT_MODE_BLE);
     if (ret) {
         ESP_LOGE(GATTS_TABLE_TAG, "%s enable controller failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return false;
     }
 
     ret = esp_bluedroid_init();
     if (ret) {
         ESP_LOGE(GATTS_TABLE_TAG, "%s init bluetooth failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return false;
     }
 
     ret = esp_bluedroid_enable();
     if (ret) {
         ESP_LOGE(GATTS_TABLE_TAG, "%s enable bluetooth failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return false;
+    }
+
+    if (!gatt_conn_init(&gatt_host)){
+        return false;
     }
 
     ret = esp_ble_gatts_register_callback(gatts_event_handler);
     if (ret){
         ESP_LOGE(GATTS_TABLE_TAG, "gatts register error, error code = %x", ret);
-        return;
+        return false;
     }
 
     ret = esp_ble_gap_register_callback(gap_event_handler);
     if (ret){
         ESP_LOGE(GATTS_TABLE_TAG, "gap register error, error code = %x", ret);
-        return;
+        return false;
     }
 
     ret = esp_ble_gatts_app_register(ESP_APP_ID);
     if (ret){
         ESP_LOGE(GATTS_TABLE_TAG, "gatts app register error, error code = %x", ret);
-        return;
+        return false;
     }
 
+#if CONFIG_BLE_BONDING
+    // The spa has no display or keys, it claims a display and shows the static passkey from the
+    // label. Clients without input still pair Just Works, only the firmware update needs the
+    // passkey. Keys are kept in NVS by the stack, and bonded clients may cache the attribute
+    // table (robust caching, database hash).
+    esp_ble_auth_req_t auth_req = ESP_LE_AUTH_REQ_SC_MITM_BOND;
+    esp_ble_io_cap_t iocap = ESP_IO_CAP_OUT;
+    uint32_t passkey = CONFIG_BLE_PASSKEY;
+    uint8_t key_size = 16;
+    uint8_t init_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+    uint8_t rsp_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+    esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &auth_req, sizeof(auth_req));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &iocap, sizeof(iocap));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_STATIC_PASSKEY, &passkey, sizeof(passkey));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(key_size));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &init_key, sizeof(init_key));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rsp_key, sizeof(rsp_key));
+#endif
+
     esp_err_t local_mtu_ret = esp_ble_gatt_set_local_mtu(500);
     if (local_mtu_ret){
         ESP_LOGE(GATTS_TABLE_TAG, "set local  MTU failed, error code = %x", local_mtu_ret);
     }
 
-    init_input_task();
-    init_output_task();
-    init_bus_task();
-    
-    // Start the state handler
-    init_state_handler();
+    return true;
 }
+
+#endif // CONFIG_BT_BLUEDROID_ENABLED
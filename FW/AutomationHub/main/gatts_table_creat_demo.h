@@ -8,12 +8,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "inc/spa_state.h"
+
+#define OPEN_SPA_DEVICE_NAME        "OPEN_SPA"
+#define GATTS_SERVICE_UUID          0x00FF
+
+// Values that clients can subscribe to, shared by the Bluedroid and NimBLE servers
+enum {
+    NOTIFY_TEMP,                    // 0xFF01
+    NOTIFY_SET_TEMP,                // 0xFF02
+    NOTIFY_MODE,                    // 0xFF03
+    NOTIFY_TELEMETRY,               // 0xFF04
+    NUMBER_OF_NOTIFY
+};
+
+// Spa status broadcast in the advertising data so scanners can monitor without connecting.
+// Manufacturer specific data, little endian, after the company id.
+#define ADV_COMPANY_ID              0xFFFF      // Reserved for testing, no id has been assigned
+#define ADV_STATUS_VERSION          1
+#define ADV_STATUS_FAULT            (1 << 0)    // Any input alert or the state machine is in fault
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;        // 0 until the spa state is first published
+    int16_t temp;           // Water temperature, centi degrees
+    uint8_t setpoint;       // Whole degrees
+    uint8_t mode;           // enum systemState
+    uint8_t flags;          // ADV_STATUS_*
+} adv_status_t;
+
+static inline void adv_status_from_state(const spa_state_t *state, adv_status_t *status)
+{
+    status->version = ADV_STATUS_VERSION;
+    status->temp = state->temps[eInput1];
+    status->setpoint = state->setpoint;
+    status->mode = state->mode;
+    status->flags = state->faults != 0 ? ADV_STATUS_FAULT : 0;
+}
+
+// Brings up the controller and the host selected in menuconfig (Bluedroid or NimBLE),
+// registers the open spa service and starts advertising
+bool gatt_server_init(void);
 
 void gattUpdateTemp(uint8_t currentTemp);
 void gattUpdateMode(uint8_t mode);
 void gattUpdateSetpoint(uint8_t setpoint);
+// Notifies subscribers that a new spa_state_t was published
+void gattUpdateTelemetry(void);
+// Sends a firmware update reply on the OTA control characteristic of one connection
+void gattOtaNotify(uint16_t conn_id, const uint8_t *data, uint16_t length);
 
-/* Attributes State Machine */
+/* Attributes State Machine, Bluedroid attribute table */
 enum
 {
     IDX_SVC,
@@ -23,9 +69,22 @@ enum
 
     IDX_CHAR_SET_TEMP,
     IDX_CHAR_VAL_SET_TEMP,
+    IDX_CHAR_CFG_SET_TEMP,
 
     IDX_CHAR_MODE,
     IDX_CHAR_VAL_MODE,
+    IDX_CHAR_CFG_MODE,
+
+    IDX_CHAR_TELEMETRY,
+    IDX_CHAR_VAL_TELEMETRY,
+    IDX_CHAR_CFG_TELEMETRY,
+
+    IDX_CHAR_OTA_CTRL,
+    IDX_CHAR_VAL_OTA_CTRL,
+    IDX_CHAR_CFG_OTA_CTRL,
+
+    IDX_CHAR_OTA_DATA,
+    IDX_CHAR_VAL_OTA_DATA,
 
     HRS_IDX_NB,
 };
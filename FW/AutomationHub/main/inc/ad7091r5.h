@@ -0,0 +1,39 @@
+#ifndef _AD7091R5_H_
+#define _AD7091R5_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AD7091R5_NUM_CHANNELS       4
+#define AD7091R5_MAX_CODE           0xFFF
+#define AD7091R5_DEFAULT_ADDRESS    0x2F
+
+// Alert indication bits, two per channel
+#define AD7091R5_ALERT_HIGH(ch)     (1 << ((ch) * 2))
+#define AD7091R5_ALERT_LOW(ch)      (1 << ((ch) * 2 + 1))
+
+// Bus operations, kept separate from the driver so it can run against a mock bus off target
+typedef struct {
+    bool (*write)(void *ctx, uint8_t address, const uint8_t *data, size_t length);
+    bool (*write_read)(void *ctx, uint8_t address, const uint8_t *write_data, size_t write_length,
+                       uint8_t *read_data, size_t read_length);
+    void *ctx;
+} ad7091r5_bus_t;
+
+typedef struct {
+    const ad7091r5_bus_t *bus;
+    uint8_t address;
+    uint8_t channel_mask;
+} ad7091r5_t;
+
+bool ad7091r5_init(ad7091r5_t *dev, const ad7091r5_bus_t *bus, uint8_t address, uint8_t channel_mask);
+bool ad7091r5_set_limits(ad7091r5_t *dev, uint8_t channel, uint16_t low, uint16_t high, uint16_t hysteresis);
+// Reads conversions back to back in one transaction, buffer must hold 2 bytes per conversion.
+// Each result is tagged with its channel id and accumulated into sum/count.
+bool ad7091r5_read_burst(ad7091r5_t *dev, uint8_t *buffer, size_t conversions,
+                         uint32_t sum[AD7091R5_NUM_CHANNELS], uint32_t count[AD7091R5_NUM_CHANNELS]);
+// Reads and clears the alert indication register
+bool ad7091r5_read_alerts(ad7091r5_t *dev, uint16_t *alerts);
+
+#endif // _AD7091R5_H_
@@ -0,0 +1,65 @@
+#ifndef _BLE_OTA_H_
+#define _BLE_OTA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Firmware update over BLE, independent of the host stack. The GATT server passes writes
+// to the control (0xFF05) and data (0xFF06) characteristics in here, and sends the replies
+// through gattOtaNotify().
+//
+// Control writes, little endian:
+//   OTA_OP_BEGIN  uint8 op, uint32 image size, uint8 sha256[32] of the image
+//                 optionally followed by uint8 format (OTA_FORMAT_*), uint32 payload size and
+//                 for OTA_FORMAT_DELTA the first 8 bytes of the running app's ELF SHA-256
+//   OTA_OP_END    uint8 op
+//   OTA_OP_ABORT  uint8 op
+// Data writes (write without response) carry the payload bytes in order, see ota_decoder.h.
+// Replies, notified on the control characteristic: uint8 op | OTA_REPLY, uint8 status, uint32 value.
+//   BEGIN  value is the window, the most bytes the client may send beyond the last ack
+//   ACK    value is the number of payload bytes decoded and written to flash so far
+//   END    value is 0, the spa restarts into the new image after a successful END
+
+#define OTA_OP_BEGIN            0x01
+#define OTA_OP_END              0x02
+#define OTA_OP_ABORT            0x03
+#define OTA_OP_ACK              0x04
+#define OTA_REPLY               0x80
+
+enum {
+    OTA_OK,
+    OTA_ERR_STATE,              // Command not valid now, e.g. data without BEGIN
+    OTA_ERR_SIZE,               // Image does not fit the slot, or more data than announced
+    OTA_ERR_FLASH,              // esp_ota_* failed
+    OTA_ERR_HASH,               // SHA-256 of the received image does not match
+    OTA_ERR_OVERFLOW,           // Client sent more than the window
+    OTA_ERR_BUSY,               // Another connection is updating
+    OTA_ERR_FORMAT,             // Unknown format or corrupt compressed/delta payload
+    OTA_ERR_BASE,               // Delta made against a different image than the running one
+    OTA_ERR_NO_MEM,             // No RAM for the decompressor
+    OTA_ERR_SIGNATURE,          // Image not signed with the project's key, or its header is invalid
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t op;
+    uint8_t status;
+    uint32_t value;
+} ota_reply_t;
+
+void ble_ota_init(void);
+// Accepts the running image if it is still on trial after an update, once the rest of the
+// application (OTA_READY_APP, from app_main), the GATT service (OTA_READY_GATT) and
+// advertising (OTA_READY_ADV) have all come up. Until then a reset rolls back to the previous
+// image, so an update that breaks Bluetooth cannot lock out the next one.
+#define OTA_READY_APP           (1 << 0)
+#define OTA_READY_GATT          (1 << 1)
+#define OTA_READY_ADV           (1 << 2)
+#define OTA_READY_ALL           (OTA_READY_APP | OTA_READY_GATT | OTA_READY_ADV)
+void ble_ota_ready(uint32_t part);
+
+// Called from the Bluetooth task
+void ble_ota_control(uint16_t conn_id, const uint8_t *data, uint16_t length);
+void ble_ota_data(uint16_t conn_id, const uint8_t *data, uint16_t length);
+void ble_ota_disconnected(uint16_t conn_id);
+
+#endif // _BLE_OTA_H_
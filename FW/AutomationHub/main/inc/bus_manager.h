@@ -1,6 +1,113 @@
 #ifndef _BUS_MANAGER_H_
 #define _BUS_MANAGER_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// The RS485 port runs Modbus RTU, as a slave (bus_manager.c) or as the master of the spa's
+// own devices (bus_master.c), picked in menuconfig.
+
+// Slave register map. Register numbers are the 0 based PDU addresses.
+// Input registers are answered from the spa state snapshot at the time of the poll.
+enum {
+    MB_IR_STATE_VERSION,            // SPA_STATE_VERSION, 0 until the first state is published
+    MB_IR_MODE,                     // enum systemState
+    MB_IR_SETPOINT,                 // Whole degrees
+    MB_IR_OUTPUTS,                  // Output bitmask, OUTPUT_BIT()
+    MB_IR_TEMP_1,                   // centi degrees, signed, one register per input
+    MB_IR_TEMP_2,
+    MB_IR_TEMP_3,
+    MB_IR_TEMP_4,
+    MB_IR_FAULTS,                   // SPA_FAULT_*
+    MB_IR_CIRC_REMAINING,           // Seconds
+    MB_IR_JETS_REMAINING,           // Seconds
+    MB_IR_HEATER_DUTY,              // permille
+    MB_IR_UPTIME_HI,                // Seconds since boot, high word first
+    MB_IR_UPTIME_LO,
+    MB_IR_POLLS_HI,                 // Requests answered by this slave, high word first
+    MB_IR_POLLS_LO,
+    // Bus timing of the built in RTU stack, 0 with esp-modbus. Saturate at 65535.
+    MB_IR_FRAME_ERRORS,             // Request frames dropped
+    MB_IR_FRAME_CPU_AVG,            // us, request received until the response was written
+    MB_IR_FRAME_CPU_MAX,
+    MB_IR_TURNAROUND_AVG,           // us, request received until the response was queued
+    MB_IR_TURNAROUND_MAX,
+    MB_IR_COUNT
+};
+
+// Holding registers read back the published state, writes are queued for the state handler.
+// The settings registers read back the stored configuration. The registers of one group are
+// validated together, write a whole group with one request when its values depend on each
+// other, e.g. the heater window and minimum times.
+enum {
+    MB_HR_SETPOINT,
+    MB_HR_MODE,
+    // Heater PI controller, heater_pid_params_t, used with HEATER_CONTROL_PI
+    MB_HR_HEATER_KP,                // Duty permille per degree
+    MB_HR_HEATER_KI,                // Duty permille per degree minute
+    MB_HR_HEATER_KD,                // Duty permille per degree per minute
+    MB_HR_HEATER_WINDOW,            // Seconds
+    MB_HR_HEATER_MIN_ON,            // Seconds
+    MB_HR_HEATER_MIN_OFF,           // Seconds
+    // Output 4, not used by the spa. Write the minutes to run it for, 0 to switch it off.
+    // Reads 1 while it is on.
+    MB_HR_AUX_OUTPUT,
+    // Circulation and jets timers, spa_schedule_t, taken up when the timer next starts
+    MB_HR_CIRC_PERIOD,              // Seconds on, then the same off
+    MB_HR_JETS_TIME,                // Seconds
+    // Input temperature offsets, spa_calibration_t, centi degrees, signed
+    MB_HR_TEMP_OFFSET_1,
+    MB_HR_TEMP_OFFSET_2,
+    MB_HR_TEMP_OFFSET_3,
+    MB_HR_TEMP_OFFSET_4,
+    // Input filter, input_filter_params_t, one register per input. Restarts the filter.
+    MB_HR_FILTER_MEDIAN_1,          // Odd median window, 1 bypasses it
+    MB_HR_FILTER_MEDIAN_2,
+    MB_HR_FILTER_MEDIAN_3,
+    MB_HR_FILTER_MEDIAN_4,
+    MB_HR_FILTER_EMA_1,             // EMA weight 1/2^n, 0 bypasses it
+    MB_HR_FILTER_EMA_2,
+    MB_HR_FILTER_EMA_3,
+    MB_HR_FILTER_EMA_4,
+    MB_HR_FILTER_SLEW_1,            // mV per sample, 0 bypasses it
+    MB_HR_FILTER_SLEW_2,
+    MB_HR_FILTER_SLEW_3,
+    MB_HR_FILTER_SLEW_4,
+    MB_HR_COUNT
+};
+
+// Devices polled when the spa is the bus master
+enum {
+    BUS_DEVICE_FLOW,                // Flow meter
+    BUS_DEVICE_PUMP,                // Variable speed pump drive
+    BUS_DEVICE_WATER,               // ORP/pH sensor
+    BUS_DEVICE_COUNT
+};
+
+enum {
+    BUS_FLOW_RATE,                  // 0.1 l/min
+    BUS_FLOW_TOTAL,                 // Litres
+    BUS_PUMP_SPEED,                 // 0.1 Hz
+    BUS_PUMP_CURRENT,               // 0.1 A
+    BUS_PUMP_FAULT,                 // Drive fault code, 0 when running fine
+    BUS_WATER_PH,                   // 0.01 pH
+    BUS_WATER_ORP,                  // mV
+    BUS_VALUE_COUNT
+};
+
+typedef struct {
+    int32_t values[BUS_VALUE_COUNT];
+    uint8_t online;                 // Bit per BUS_DEVICE_*, values of offline devices are stale
+    uint16_t utilisation;           // permille of the last report period the bus was busy
+    uint16_t rtt_avg_ms;            // Request to response, last report period
+    uint16_t rtt_max_ms;
+} bus_values_t;
+
 void init_bus_task(void);
+#if CONFIG_BUS_ROLE_MASTER
+// Latest values read from the bus devices, false until the first poll
+bool bus_read_values(bus_values_t *values);
+#endif
 
-#endif // _BUS_MANAGER_H_
\ No newline at end of file
+#endif // _BUS_MANAGER_H_
@@ -0,0 +1,57 @@
+#ifndef _BUS_SCHEDULE_H_
+#define _BUS_SCHEDULE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Polling plan for the Modbus master. Values that sit in adjacent registers of the same
+// device are read with one request (a block). Each block has its own interval, short while
+// its values are moving, growing towards the slow interval while they are steady, and
+// backing off exponentially while its device does not answer.
+
+#define BUS_BLOCK_MAX_REGS          (32)
+
+enum {
+    BUS_REG_INPUT,
+    BUS_REG_HOLDING,
+};
+
+typedef struct {
+    uint8_t device;
+    uint8_t reg_type;               // BUS_REG_*
+    uint16_t reg;                   // 0 based
+    uint8_t size;                   // Registers, 1 or 2 (high word first)
+    bool is_signed;
+    int32_t deadband;               // Change that counts as moving
+} bus_param_t;
+
+typedef struct {
+    uint8_t device;
+    uint8_t reg_type;
+    uint16_t reg_start;
+    uint16_t reg_count;
+    uint8_t first;                  // Into the order array from bus_schedule_build
+    uint8_t count;
+    uint32_t interval_ms;
+    int64_t due_us;
+} bus_block_t;
+
+typedef struct {
+    uint32_t fast_ms;
+    uint32_t slow_ms;
+    uint32_t backoff_max_ms;
+} bus_schedule_params_t;
+
+// Sorts params into order[] (indexes into params) and merges them into blocks, returns the
+// number of blocks. All blocks start due.
+int bus_schedule_build(const bus_param_t *params, int count, uint8_t *order,
+                       bus_block_t *blocks, int max_blocks, const bus_schedule_params_t *schedule);
+// Returns the index of the most overdue block, or -1 and how long until the next one is due
+int bus_schedule_next(const bus_block_t *blocks, int count, int64_t now_us, int64_t *wait_us);
+// Plans the next read of a block. failures is the device's count of consecutive failed reads.
+void bus_schedule_done(bus_block_t *block, bool ok, bool changed, uint8_t failures,
+                       int64_t now_us, const bus_schedule_params_t *schedule);
+// Value of a param from the registers of its block, as read into host order
+int32_t bus_param_decode(const bus_param_t *param, const bus_block_t *block, const uint16_t *regs);
+
+#endif // _BUS_SCHEDULE_H_
@@ -0,0 +1,40 @@
+#ifndef _COMMAND_QUEUE_H_
+#define _COMMAND_QUEUE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bounded lock-free ring carrying user commands to the state handler.
+// Any number of tasks may push, only the state handler pops. Pure C with no RTOS dependency.
+
+#define COMMAND_QUEUE_SIZE      16      // Power of two
+
+typedef enum {
+    cmdSetMode,         // value is a mode request, see spa_fsm_is_request()
+    cmdSetTemp,         // value is the new set point in whole degrees
+    cmdAuxOutput,       // value is the minutes to run output 4 for, 0 switches it off
+} spa_command_type_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t value;
+} spa_command_t;
+
+typedef struct {
+    uint32_t sequence;      // Slot is free for position sequence, or holds position sequence - 1
+    spa_command_t command;
+} command_slot_t;
+
+typedef struct {
+    command_slot_t slots[COMMAND_QUEUE_SIZE];
+    uint32_t head;          // Next position a producer claims
+    uint32_t tail;          // Next position the consumer reads
+} command_queue_t;
+
+void command_queue_init(command_queue_t *queue);
+// Returns false when the queue is full
+bool command_queue_push(command_queue_t *queue, const spa_command_t *command);
+// Returns false when there is nothing to pop, single consumer only
+bool command_queue_pop(command_queue_t *queue, spa_command_t *command);
+
+#endif // _COMMAND_QUEUE_H_
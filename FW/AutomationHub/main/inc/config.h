@@ -2,7 +2,47 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "inc/input_manager.h"
+#include "inc/input_filter.h"
+#include "inc/heater_pid.h"
 
+// Bump when spa_config_t changes layout, older blobs are then replaced by the defaults
+#define SPA_CONFIG_VERSION      1
+
+typedef struct {
+    uint32_t circ_period_s;             // Circulation on time, then the same time off
+    uint32_t jets_time_s;               // Jets run time before returning to heating
+} spa_schedule_t;
+
+typedef struct {
+    int16_t temp_offset[NUMBER_OF_INPUTS];  // centi degrees added to each input temperature
+} spa_calibration_t;
+
+// Every persistent setting. A copy lives in RAM, readers never touch flash and
+// changes are written back as one blob once they stop coming in.
+typedef struct {
+    uint8_t setTemp;
+    input_filter_params_t filter;
+    heater_pid_params_t heater;
+    spa_schedule_t schedule;
+    spa_calibration_t calibration;
+} spa_config_t;
+
+// Initialises NVS and loads the configuration, must run before any other config call
 bool init_nvm(void);
-bool storeSetTemp(uint8_t temp);
-uint8_t fetchSetTemp(void);
\ No newline at end of file
+// Starts the task that commits changes to flash
+void init_config_task(void);
+
+// Lock free copy of the current configuration
+void config_get(spa_config_t *config);
+uint8_t config_get_set_temp(void);
+
+// Update the RAM copy and schedule a commit. Values are not validated here.
+void config_set_set_temp(uint8_t temp);
+void config_set_filter_params(const input_filter_params_t *params);
+void config_set_heater_params(const heater_pid_params_t *params);
+void config_set_schedule(const spa_schedule_t *schedule);
+void config_set_calibration(const spa_calibration_t *calibration);
+
+// Writes pending changes now, also runs automatically before a restart
+bool config_flush(void);
@@ -0,0 +1,61 @@
+#ifndef _GATT_CONN_H_
+#define _GATT_CONN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "gatts_table_creat_demo.h"
+
+// Connection table, per connection notification rate limiting and the advertising status,
+// shared by the Bluedroid (gatts_table_creat_demo.c) and NimBLE (gatt_nimble.c) servers.
+// Nothing here calls into a Bluetooth host: the server reports connections, subscriptions
+// and MTU changes, and is called back to put values and advertising data on air.
+
+#define GATT_MAX_CONNECTIONS        CONFIG_GATT_MAX_CONNECTIONS
+#define GATT_DEFAULT_MTU            23
+#define GATT_ADDR_LEN               6
+
+#define GATT_CCCD_NOTIFY            0x0001
+#define GATT_CCCD_INDICATE          0x0002
+
+typedef struct {
+    // Notifies one value to one connection, or indicates it. Called without any lock held,
+    // the value already fits the connection's MTU.
+    void (*send)(uint16_t conn_id, int index, const uint8_t *value, uint16_t length, bool indicate);
+    // Puts a new status in the advertising data
+    void (*set_adv_status)(const adv_status_t *status);
+} gatt_conn_host_t;
+
+bool gatt_conn_init(const gatt_conn_host_t *host);
+
+// conn_id is the Bluedroid conn_id or the NimBLE conn_handle. Returns the slots still free
+// after adding, -1 when there was none for this connection.
+int gatt_conn_add(uint16_t conn_id, const uint8_t addr[GATT_ADDR_LEN]);
+void gatt_conn_remove(uint16_t conn_id);
+void gatt_conn_set_mtu(uint16_t conn_id, uint16_t mtu);
+bool gatt_conn_find_addr(const uint8_t addr[GATT_ADDR_LEN], uint16_t *conn_id);
+// esp_timer time the connection was made, 0 once its first value has gone out
+int64_t gatt_conn_connected_at(uint16_t conn_id);
+
+// Sets the client configuration of one value, GATT_CCCD_*. A new subscriber gets the
+// current value straight away.
+void gatt_conn_subscribe(uint16_t conn_id, int index, uint16_t cccd);
+uint16_t gatt_conn_cccd(uint16_t conn_id, int index);
+
+// Caches a one byte value and marks it for every subscriber, true if it changed.
+// Changed values go out with gatt_conn_flush().
+bool gatt_conn_set_value(int index, uint8_t value);
+// A new spa_state_t was published, notifies telemetry and refreshes the advertising status
+void gatt_conn_telemetry_changed(void);
+// Copies the current value, returns its length or 0 if not set yet
+uint16_t gatt_conn_current_value(int index, uint8_t *buffer);
+// Sends every changed value whose minimum interval has passed on that connection, the
+// rest go out from a timer
+void gatt_conn_flush(void);
+// Logs the time from connecting to the first value a client got, for values it read
+void gatt_conn_first_value(uint16_t conn_id);
+
+// Refreshes the status in the advertising data, at most once per CONFIG_BLE_ADV_UPDATE_MIN_INTERVAL_MS
+void gatt_conn_update_adv_status(void);
+
+#endif // _GATT_CONN_H_
@@ -0,0 +1,58 @@
+#ifndef _HEATER_PID_H_
+#define _HEATER_PID_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fixed point PI(D) heater controller driving the heater relay with a time proportioned duty.
+// Pure C with no RTOS dependency, the caller supplies a millisecond clock.
+
+#define HEATER_DUTY_MAX             1000    // Duty is in permille
+
+typedef struct heater_pid_params {
+    uint16_t kp;            // Duty permille per degree of error
+    uint16_t ki;            // Duty permille per degree minute of accumulated error
+    uint16_t kd;            // Duty permille per degree per minute of temperature change, 0 disables
+    uint32_t window_ms;     // Time proportioning window, the duty sets the on time within it
+    uint32_t min_on_ms;     // Shortest the relay may stay on
+    uint32_t min_off_ms;    // Shortest the relay may stay off
+} heater_pid_params_t;
+
+typedef struct {
+    uint32_t cycles;            // Relay off to on switches
+    int32_t overshoot;          // Peak centi degrees above the set point once it was reached
+    uint32_t reach_ms;          // Time from the last set point change to reaching it, 0 until reached
+} heater_pid_stats_t;
+
+typedef struct {
+    heater_pid_params_t params;
+    int32_t integrator;         // Duty permille, Q16
+    int32_t duty;               // Last computed duty, permille
+    int32_t setpoint;           // centi degrees
+    int32_t lastTemp;           // centi degrees
+    uint32_t lastUpdate;
+    uint32_t windowStart;
+    uint32_t onTime;
+    uint32_t lastSwitch;
+    uint32_t setpointTime;
+    bool updated;               // lastTemp and lastUpdate hold a sample
+    bool windowActive;
+    bool switched;              // lastSwitch is valid
+    bool relayOn;
+    bool reached;
+    heater_pid_stats_t stats;
+} heater_pid_t;
+
+void heater_pid_default_params(heater_pid_params_t *params);
+bool heater_pid_params_valid(const heater_pid_params_t *params);
+// Applies new parameters, the integrator is kept so the heater does not restart from zero
+void heater_pid_configure(heater_pid_t *pid, const heater_pid_params_t *params);
+// Feeds a new temperature sample, returns the duty in permille. While not enabled the
+// integrator is held where heating left it and the duty is 0.
+int32_t heater_pid_update(heater_pid_t *pid, int32_t setpoint_centi, int32_t temp_centi, uint32_t now_ms, bool enabled);
+// Returns whether the heater relay should be on now. When not enabled the relay is
+// forced off immediately and the next enable starts a new window.
+bool heater_pid_relay(heater_pid_t *pid, uint32_t now_ms, bool enabled);
+void heater_pid_get_stats(const heater_pid_t *pid, heater_pid_stats_t *stats);
+
+#endif // _HEATER_PID_H_
@@ -0,0 +1,38 @@
+#ifndef _INPUT_FILTER_H_
+#define _INPUT_FILTER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "inc/input_manager.h"
+
+#define INPUT_FILTER_MEDIAN_MAX     7
+#define INPUT_FILTER_EMA_SHIFT_MAX  8
+
+// Per channel filter settings. The stages run in order median -> EMA -> slew limit,
+// and a stage is bypassed by setting it to 1, 0 and 0 respectively.
+typedef struct input_filter_params {
+    uint8_t median_len[NUMBER_OF_INPUTS];   // Odd window length, 1..INPUT_FILTER_MEDIAN_MAX
+    uint8_t ema_shift[NUMBER_OF_INPUTS];    // EMA weight of 1/2^shift for each new sample
+    uint16_t slew_limit[NUMBER_OF_INPUTS];  // Largest output step per sample, same unit as the input
+} input_filter_params_t;
+
+// Struct of arrays so one pass over a stage touches every channel with contiguous loads
+typedef struct {
+    input_filter_params_t params;
+    int32_t window[INPUT_FILTER_MEDIAN_MAX][NUMBER_OF_INPUTS];
+    int32_t ema[NUMBER_OF_INPUTS];      // Q8
+    int32_t output[NUMBER_OF_INPUTS];
+    int32_t noise[NUMBER_OF_INPUTS];    // Q8 mean absolute deviation of the median output from the EMA
+    uint8_t window_pos;
+    uint8_t window_fill;
+    bool primed;
+} input_filter_t;
+
+void input_filter_default_params(input_filter_params_t *params);
+bool input_filter_params_valid(const input_filter_params_t *params);
+// Applies new parameters and restarts the filter from the next sample
+void input_filter_configure(input_filter_t *filter, const input_filter_params_t *params);
+// Filters one sample of every channel, noise is returned in the input unit
+void input_filter_process(input_filter_t *filter, const int *input, int *output, int *noise);
+
+#endif // _INPUT_FILTER_H_
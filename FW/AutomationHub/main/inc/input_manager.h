@@ -1,6 +1,11 @@
 #ifndef _ADC_INPUT_H_
 #define _ADC_INPUT_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #define NUMBER_OF_INPUTS 4
 enum{
     eInput1 = 0,
@@ -9,12 +14,35 @@ enum{
     eInput4
 };
 
+// Alert layout matches the AD7091R-5 alert indication register, two bits per input
+#define INPUT_ALERT_HIGH(input)     (1 << ((input) * 2))
+#define INPUT_ALERT_LOW(input)      (1 << ((input) * 2 + 1))
+
 typedef struct{
     int raw[NUMBER_OF_INPUTS];
     int voltage[NUMBER_OF_INPUTS];
+    int filtered[NUMBER_OF_INPUTS];     // Voltage after the per channel filter pipeline
+    int noise[NUMBER_OF_INPUTS];        // Estimated noise on the filtered voltage in mV
+    uint16_t alerts;        // Per channel high/low limit alerts, backends without limits leave this 0
+    uint32_t sequence;      // Increments with every published sample
+    int64_t timestamp_us;   // esp_timer time the sample was published
 }input_state_t;
 
+#define INPUT_MAX_SUBSCRIBERS       4
+
 void init_input_task(void);
 bool get_state(input_state_t * state);
+// Notifies task with notify_bits (eSetBits) whenever a filtered input moves by at least
+// deadband_mV since its last notification, or the alerts change
+bool input_subscribe(TaskHandle_t task, uint32_t notify_bits, int deadband_mV);
+
+// Filter parameters are validated, persisted and take effect from the next sample
+struct input_filter_params;
+bool input_set_filter_params(const struct input_filter_params *params);
+void input_get_filter_params(struct input_filter_params *params);
+
+// Used by the input backends to publish a new sample
+void set_state(int * voltage, int * raw, uint16_t alerts);
+void ad7091r5_input_task(void *pvParameters);
 
 #endif // _ADC_INPUT_H_
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef _MODBUS_CRC_H_
+#define _MODBUS_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-16/MODBUS (reflected 0x8005, start 0xFFFF), low byte first on the wire. A frame
+// followed by its CRC checks to 0.
+// modbus_crc16 is the implementation picked in menuconfig. With slice by 4 or 8 it also
+// computes the CRC of esp-modbus frames, usMBCRC16 is wrapped at link time.
+
+// Builds the tables, before the first CRC. Safe to call more than once.
+void modbus_crc_init(void);
+uint16_t modbus_crc16(const uint8_t *data, size_t length);
+
+// All implementations, for checking and benchmarking them against each other. The sliced
+// ones only exist when picked, with the benchmark, and on the host.
+uint16_t modbus_crc16_bitwise(const uint8_t *data, size_t length);
+uint16_t modbus_crc16_table(const uint8_t *data, size_t length);
+uint16_t modbus_crc16_slice4(const uint8_t *data, size_t length);
+uint16_t modbus_crc16_slice8(const uint8_t *data, size_t length);
+
+// Checks every implementation against esp-modbus and logs cycles per byte
+void modbus_crc_benchmark(void);
+
+#endif // _MODBUS_CRC_H_
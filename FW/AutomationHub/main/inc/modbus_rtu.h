@@ -0,0 +1,39 @@
+#ifndef _MODBUS_RTU_H_
+#define _MODBUS_RTU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal Modbus RTU slave: read holding (0x03), read input (0x04), write single (0x06)
+// and write multiple (0x10) registers. Works on whole frames, address to CRC, and does
+// not touch the UART, so it runs the same against the RS485 port and on the host.
+
+#define MODBUS_RTU_FRAME_MAX            (256)
+#define MODBUS_RTU_BROADCAST            (0)
+
+#define MODBUS_FC_READ_HOLDING          (0x03)
+#define MODBUS_FC_READ_INPUT            (0x04)
+#define MODBUS_FC_WRITE_SINGLE          (0x06)
+#define MODBUS_FC_WRITE_MULTIPLE        (0x10)
+
+// Exception codes, returned by the register callbacks, 0 for success
+#define MODBUS_EX_NONE                  (0x00)
+#define MODBUS_EX_ILLEGAL_FUNCTION      (0x01)
+#define MODBUS_EX_ILLEGAL_ADDRESS       (0x02)
+#define MODBUS_EX_ILLEGAL_VALUE         (0x03)
+#define MODBUS_EX_DEVICE_FAILURE        (0x04)
+
+// Registers are passed big endian, as on the wire. first is the 0 based PDU address.
+typedef struct {
+    uint8_t address;
+    uint8_t (*read_input)(uint8_t *out, uint16_t first, uint16_t count);
+    uint8_t (*read_holding)(uint8_t *out, uint16_t first, uint16_t count);
+    uint8_t (*write_holding)(const uint8_t *in, uint16_t first, uint16_t count);
+} modbus_rtu_slave_t;
+
+// Answers one request frame into response (MODBUS_RTU_FRAME_MAX bytes). Returns the
+// response length, 0 when no answer is due: bad CRC, another slave, or a broadcast.
+size_t modbus_rtu_slave_handle(const modbus_rtu_slave_t *slave, const uint8_t *request, size_t length,
+                               uint8_t *response);
+
+#endif // _MODBUS_RTU_H_
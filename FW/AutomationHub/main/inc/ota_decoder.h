@@ -0,0 +1,67 @@
+#ifndef _OTA_DECODER_H_
+#define _OTA_DECODER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Turns a firmware update payload back into the image, streaming, in fixed RAM.
+//
+//   OTA_FORMAT_RAW      the image itself
+//   OTA_FORMAT_DEFLATE  the image as a zlib stream
+//   OTA_FORMAT_DELTA    a zlib stream of a patch against the running image (the base):
+//                       "OSP1", uint32 base size, then records until the stream ends of
+//                       uint32 diff length, uint32 extra length, int32 seek, the diff bytes
+//                       (added to the base bytes at the base position, which then moves on)
+//                       and the extra bytes (copied), after which the base position moves
+//                       by seek. This is the bsdiff control/diff/extra layout interleaved.
+//
+// Inflating needs a 32 KB window plus the decompressor state, allocated by begin and
+// freed by end. tools/ota_patch.py produces all three formats.
+
+enum {
+    OTA_FORMAT_RAW,
+    OTA_FORMAT_DEFLATE,
+    OTA_FORMAT_DELTA,
+};
+
+#define OTA_DELTA_MAGIC         "OSP1"
+
+// Called with each piece of the image in order, returns false to stop
+typedef bool (*ota_output_fn)(void *ctx, const uint8_t *data, size_t length);
+// Reads from the base image, returns false on failure
+typedef bool (*ota_base_fn)(void *ctx, uint32_t offset, uint8_t *data, size_t length);
+
+typedef struct {
+    uint8_t format;
+    ota_output_fn output;
+    ota_base_fn read_base;
+    void *ctx;
+    uint32_t base_limit;                // Readable size of the base
+
+    void *inflator;                     // tinfl_decompressor
+    uint8_t *window;
+    size_t window_pos;
+    bool inflated;                      // Saw the end of the zlib stream
+
+    // Delta
+    uint8_t header[12];
+    uint8_t header_length;
+    bool have_magic;
+    uint32_t base_size;
+    uint32_t base_pos;
+    uint32_t diff_left;
+    uint32_t extra_left;
+    int32_t seek;
+} ota_decoder_t;
+
+// Returns false for an unknown format or when the buffers can't be allocated
+bool ota_decoder_begin(ota_decoder_t *decoder, uint8_t format, ota_output_fn output,
+                       ota_base_fn read_base, uint32_t base_limit, void *ctx);
+// Returns false if the payload is corrupt or output/read_base failed
+bool ota_decoder_feed(ota_decoder_t *decoder, const uint8_t *data, size_t length);
+// True once the whole payload has been decoded
+bool ota_decoder_finished(const ota_decoder_t *decoder);
+void ota_decoder_end(ota_decoder_t *decoder);
+
+#endif // _OTA_DECODER_H_
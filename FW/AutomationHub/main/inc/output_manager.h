@@ -1,5 +1,6 @@
 #ifndef _OUTPUT_MANAGER_H_
 #define _OUTPUT_MANAGER_H_
+#include <stdbool.h>
 #include <stdint.h>
 
 #define OUT_1               4
@@ -7,6 +8,17 @@
 #define OUT_3               2
 #define OUT_4               15
 
+// Output channels as used in the desired state bitmask
+enum{
+    eOutput1 = 0,
+    eOutput2,
+    eOutput3,
+    eOutput4,
+    NUMBER_OF_OUTPUTS
+};
+#define OUTPUT_BIT(output)  (1 << (output))
+#define ALL_OUTPUTS         ((1 << NUMBER_OF_OUTPUTS) - 1)
+
 typedef enum {
     off,
     on
@@ -18,6 +30,9 @@ typedef enum {
     flash
 } output_mode_t;
 
+// latch: hold state until told otherwise
+// timed: hold state for time ms, then switch to the opposite state
+// flash: start in state and toggle every time ms until latched or cancelled
 typedef struct {
     uint32_t ioNumber;
     uint8_t state;
@@ -25,7 +40,21 @@ typedef struct {
     uint8_t mode;
 } output_command_t;
 
+typedef struct {
+    uint32_t state;                             // Current output bitmask
+    uint32_t timed;                             // Outputs running a timed or flash operation
+    uint32_t transitions[NUMBER_OF_OUTPUTS];    // Times each output actually switched
+    uint32_t commands;                          // Calls to set_outputs/set_output
+    uint32_t suppressed;                        // Calls that changed nothing
+} output_stats_t;
+
 void init_output_task(void);
+// Applies the desired state of every output, only the outputs that differ are switched.
+// Outputs running a timed or flash operation are left alone until it ends or is cancelled.
+bool set_outputs(uint32_t state);
 bool set_output(uint32_t ioNumber, uint8_t state);
+bool output_command(const output_command_t *command);
+void cancel_timed_outputs(uint32_t mask);
+void get_output_stats(output_stats_t *stats);
 
-#endif // _OUTPUT_MANAGER_H_
\ No newline at end of file
+#endif // _OUTPUT_MANAGER_H_
@@ -0,0 +1,86 @@
+#ifndef _RS485_BUS_H_
+#define _RS485_BUS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "inc/modbus_rtu.h"
+
+// Frame layer on a half duplex RS485 line. The end of a frame is the line going idle for a
+// few characters, as reported by the port. Frames live in a small pool per bus and are
+// passed around by pointer; whoever holds a frame either sends it or frees it.
+// A bus is not locked, all calls come from the task that runs it.
+
+#define RS485_FRAME_POOL        (4)
+#define RS485_WAIT_FOREVER      (UINT32_MAX)
+
+enum {
+    RS485_EVENT_DATA,               // size bytes can be read
+    RS485_EVENT_OVERRUN,            // Received data was lost, the input was flushed
+    RS485_EVENT_LINE_ERROR,         // Framing or parity error
+};
+
+typedef struct {
+    uint8_t type;                   // RS485_EVENT_*
+    bool idle;                      // DATA: the line went idle after these bytes
+    size_t size;
+} rs485_event_t;
+
+// What the frame layer needs from a UART. The ESP32 one is in rs485_uart.c, the host
+// simulator in tools/bus_sim has one on a pseudo terminal.
+typedef struct {
+    void *ctx;
+    // false when wait_ms ran out without an event
+    bool (*wait_event)(void *ctx, rs485_event_t *event, uint32_t wait_ms);
+    int (*read)(void *ctx, uint8_t *data, size_t size);
+    int (*write)(void *ctx, const uint8_t *data, size_t size);
+    bool (*wait_tx_done)(void *ctx, uint32_t wait_ms);
+    int64_t (*now_us)(void);
+} rs485_port_t;
+
+typedef struct {
+    uint16_t length;
+    uint8_t data[MODBUS_RTU_FRAME_MAX];
+} rs485_frame_t;
+
+typedef struct {
+    uint32_t frames;                // Frames received
+    uint32_t errors;                // Frames dropped: too long, framing/parity error, overrun, pool empty
+    uint32_t sent;                  // Frames sent
+    uint32_t cpu_avg_us;            // Request handed out until its response was written
+    uint32_t cpu_max_us;
+    uint32_t turnaround_avg_us;     // Request handed out until its response was queued, or sent with wait_done
+    uint32_t turnaround_max_us;
+} rs485_stats_t;
+
+typedef struct {
+    const rs485_port_t *port;
+    rs485_frame_t frames[RS485_FRAME_POOL];
+    uint32_t frames_free;
+    rs485_frame_t *rx_frame;        // Being received
+    bool rx_bad;
+    int64_t rx_end_us;              // When the last complete frame was handed out
+    uint32_t received;
+    uint32_t errors;
+    uint32_t sent;
+    uint64_t cpu_sum_us;
+    uint32_t cpu_max_us;
+    uint64_t turnaround_sum_us;
+    uint32_t turnaround_max_us;
+} rs485_bus_t;
+
+void rs485_bus_init(rs485_bus_t *bus, const rs485_port_t *port);
+// Waits for the next complete frame, NULL when wait_ms ran out
+rs485_frame_t *rs485_receive(rs485_bus_t *bus, uint32_t wait_ms);
+// NULL when the pool is empty
+rs485_frame_t *rs485_frame_alloc(rs485_bus_t *bus);
+void rs485_frame_free(rs485_bus_t *bus, rs485_frame_t *frame);
+// Writes the frame in one go and frees it. Timing is taken against the last frame received,
+// which is the request a slave answers. Only wait_done when the caller needs the frame to
+// have left the wire, e.g. before changing the line settings.
+bool rs485_send(rs485_bus_t *bus, rs485_frame_t *frame, bool wait_done);
+// Statistics since the last reset
+void rs485_get_stats(const rs485_bus_t *bus, rs485_stats_t *stats);
+void rs485_reset_stats(rs485_bus_t *bus);
+
+#endif // _RS485_BUS_H_
@@ -0,0 +1,11 @@
+#ifndef _RS485_UART_H_
+#define _RS485_UART_H_
+
+#include <stdbool.h>
+#include "inc/rs485_bus.h"
+
+// rs485_bus port on an ESP32 UART in RS485 half duplex mode. The driver event queue
+// reports data, and the RX timeout marks the line going idle. One UART per image.
+bool rs485_uart_init(rs485_port_t *port, int uart, int baud_rate, int tx_pin, int rx_pin, int rts_pin);
+
+#endif // _RS485_UART_H_
@@ -0,0 +1,23 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single writer, multi reader "latest value" channel.
+// The writer keeps two copies and flips between them with a sequence counter, so readers
+// never block and never wait on a writer that was preempted half way through an update.
+typedef struct {
+    volatile uint32_t sequence;
+    void *copies[2];
+    size_t size;
+} snapshot_t;
+
+void snapshot_init(snapshot_t *snapshot, void *copy0, void *copy1, size_t size);
+// Only one task may publish to a given snapshot
+void snapshot_publish(snapshot_t *snapshot, const void *value);
+// Returns the number of values published so far, 0 if value was not written
+uint32_t snapshot_read(const snapshot_t *snapshot, void *value);
+
+#endif // _SNAPSHOT_H_
@@ -0,0 +1,64 @@
+#ifndef _SPA_FSM_H_
+#define _SPA_FSM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Spa control state machine. Pure C with no RTOS dependency, the caller owns timers,
+// outputs and notifications and performs whatever a dispatch result asks for.
+
+// Mode numbers are exposed over BLE, keep the values stable.
+// The transition states are only accepted as requests, the machine never rests in them.
+enum systemState {
+    startup,
+    transitionToHeating,
+    idle,
+    heating,
+    transitionToJets,
+    jets,
+    fault,
+    NUMBER_OF_STATES
+};
+
+typedef enum {
+    evStart,            // Power on initialisation finished
+    evHeatRequest,      // User asked for heating
+    evJetsRequest,      // User asked for jets
+    evCircTimer,        // Circulation period elapsed
+    evJetsTimer,        // Jets period elapsed
+    evFault,            // Sensor out of limits
+    evTempUpdate,       // Heater demand changed, outputs only
+    NUMBER_OF_EVENTS
+} spa_fsm_event_t;
+
+// Side effects requested by a transition
+#define FSM_ACT_START_CIRC_TIMER        (1 << 0)
+#define FSM_ACT_STOP_CIRC_TIMER         (1 << 1)
+#define FSM_ACT_START_JETS_TIMER        (1 << 2)
+#define FSM_ACT_STOP_JETS_TIMER         (1 << 3)
+#define FSM_ACT_CANCEL_TIMED_OUTPUTS    (1 << 4)
+
+typedef struct {
+    uint8_t state;
+    bool heatDemand;    // Heater wanted, only applied in states that allow it
+    uint32_t outputs;   // Output bitmask last handed to the caller
+} spa_fsm_t;
+
+typedef struct {
+    uint8_t from;
+    uint8_t to;
+    uint8_t actions;        // FSM_ACT_* to perform, only set when a transition fired
+    bool transitioned;
+    bool outputsChanged;    // outputs differs from the previous result
+    uint32_t outputs;
+} spa_fsm_result_t;
+
+void spa_fsm_init(spa_fsm_t *fsm);
+// Runs one event through the table. Returns false when the event is ignored in the
+// current state and nothing needs to be done.
+bool spa_fsm_dispatch(spa_fsm_t *fsm, spa_fsm_event_t event, spa_fsm_result_t *result);
+void spa_fsm_set_heat_demand(spa_fsm_t *fsm, bool demand);
+bool spa_fsm_is_request(uint8_t mode);
+spa_fsm_event_t spa_fsm_request_event(uint8_t mode);
+
+#endif // _SPA_FSM_H_
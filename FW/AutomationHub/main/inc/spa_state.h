@@ -0,0 +1,45 @@
+#ifndef _SPA_STATE_H_
+#define _SPA_STATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "inc/input_manager.h"
+
+#define SPA_STATE_VERSION           2
+
+// Fault bitfield, the low byte carries the INPUT_ALERT_* bits of the inputs
+#define SPA_FAULT_INPUT_ALERTS      0x00FF
+#define SPA_FAULT_LATCHED           (1 << 8)    // State machine is in fault
+
+// Whole spa state as published by the state handler. This is also the wire format of
+// the telemetry characteristic and is sent as is, so it is packed and little endian.
+// Only append fields, and bump SPA_STATE_VERSION when the layout changes.
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t mode;                           // enum systemState
+    uint8_t setpoint;                       // Whole degrees
+    uint8_t outputs;                        // Output bitmask, OUTPUT_BIT()
+    int16_t temps[NUMBER_OF_INPUTS];        // centi degrees
+    uint16_t faults;                        // SPA_FAULT_*
+    // Fields from here on drift continuously and do not count as a change
+    uint16_t circRemaining;                 // Seconds left on the circulation timer, 0 when stopped
+    uint16_t jetsRemaining;                 // Seconds left on the jets timer, 0 when stopped
+    uint16_t heaterDuty;                    // permille
+    uint32_t uptime;                        // Seconds since boot
+    // Version 2, readings of the RS485 devices, 0 unless the spa is the bus master. These
+    // count as a change again.
+    uint16_t flowRate;                      // 0.1 l/min
+    uint16_t pumpSpeed;                     // 0.1 Hz
+    uint16_t waterPh;                       // 0.01 pH
+    int16_t waterOrp;                       // mV
+    uint8_t busOnline;                      // Bit per BUS_DEVICE_*
+} spa_state_t;
+
+void spa_state_init(void);
+// Only the state handler publishes. Returns true when anything but the drifting fields
+// changed since the last publish.
+bool spa_state_publish(const spa_state_t *state);
+// Returns false until the first state is published
+bool spa_state_read(spa_state_t *state);
+
+#endif // _SPA_STATE_H_
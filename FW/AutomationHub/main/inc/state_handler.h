@@ -1,11 +1,30 @@
 #ifndef _TEST_TASK_H_
 #define _TEST_TASK_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "inc/heater_pid.h"
+#include "inc/config.h"
+
 void init_state_handler(void);
 
-void updateSetTemp(uint8_t temp);
+// Both only validate and queue the request for the state handler, false if rejected
+bool updateSetTemp(uint8_t temp);
+bool setMode(uint8_t mode);
 uint8_t readSetTemp();
 uint8_t getMode(void);
-void setMode(uint8_t mode);
 uint8_t getTemp();
+// Runs output 4, which the state machine does not use, for minutes then switches it off,
+// 0 switches it off now. Queued like the above, ignored while the spa is in fault.
+bool setAuxOutput(uint8_t minutes);
+// Validates, applies and stores the heater controller settings, written through the Modbus
+// holding registers. Applied by the state handler on its next heater update.
+bool setHeaterParams(const heater_pid_params_t *params);
+void getHeaterParams(heater_pid_params_t *params);
+// Validate and store the timer schedule and the input offsets, false if rejected. Nothing
+// is cached, the state handler reads them from the configuration each time it uses them.
+bool setSchedule(const spa_schedule_t *schedule);
+bool setCalibration(const spa_calibration_t *calibration);
+// Called by the bus master when a reading moved past its deadband or a device came or went
+void busValuesChanged(void);
 #endif // _TEST_TASK_H_
\ No newline at end of file
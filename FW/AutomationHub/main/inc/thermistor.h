@@ -0,0 +1,13 @@
+#ifndef _THERMISTOR_H_
+#define _THERMISTOR_H_
+
+#include <stdint.h>
+
+// Temperatures are fixed point in hundredths of a degree C
+#define THERMISTOR_TEMP_MIN_CENTI       (-4000)
+#define THERMISTOR_TEMP_MAX_CENTI       (15000)
+
+void thermistor_init(void);
+int32_t thermistor_mv_to_centi(int voltage_mV);
+
+#endif // _THERMISTOR_H_
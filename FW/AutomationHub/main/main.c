@@ -0,0 +1,43 @@
+#include "esp_log.h"
+#include "gatts_table_creat_demo.h"
+
+// App specific includes
+#include "inc/input_manager.h"
+#include "inc/output_manager.h"
+#include "inc/state_handler.h"
+#include "inc/bus_manager.h"
+#include "inc/modbus_crc.h"
+#include "inc/config.h"
+#include "inc/ble_ota.h"
+
+static const char *TAG = "OPEN_SPA";
+
+void app_main(void)
+{
+    if (!init_nvm()){
+        ESP_LOGE(TAG, "Error initializing NVM");
+        return;
+    }
+
+    ble_ota_init();
+
+    // Bluedroid or NimBLE, picked in menuconfig
+    if (!gatt_server_init()){
+        ESP_LOGE(TAG, "Error starting the GATT server");
+        return;
+    }
+
+    init_config_task();
+    init_input_task();
+    init_output_task();
+#if CONFIG_MODBUS_CRC_BENCHMARK
+    modbus_crc_benchmark();
+#endif
+    init_bus_task();
+
+    // Start the state handler
+    init_state_handler();
+
+    // Everything but Bluetooth came up, the image is kept once the GATT service advertises too
+    ble_ota_ready(OTA_READY_APP);
+}
@@ -0,0 +1,81 @@
+#include "inc/ad7091r5.h"
+
+// Register map
+#define REG_RESULT                  0x00
+#define REG_CHANNEL                 0x01
+#define REG_CONF                    0x02
+#define REG_ALERT                   0x03
+#define REG_CH_LOW_LIMIT(ch)        ((ch) * 3 + 4)
+#define REG_CH_HIGH_LIMIT(ch)       ((ch) * 3 + 5)
+#define REG_CH_HYSTERESIS(ch)       ((ch) * 3 + 6)
+
+// Configuration register bits
+#define CONF_INT_VREF               (1 << 0)
+#define CONF_ALERT_EN               (1 << 4)
+#define CONF_CMD                    (1 << 10)
+
+// Conversion result register fields
+#define RESULT_CH_ID(x)             (((x) >> 13) & 0x3)
+#define RESULT_CONV(x)              ((x) & 0xFFF)
+
+static bool write_reg(ad7091r5_t *dev, uint8_t reg, uint16_t value){
+    uint8_t data[3] = {reg, value >> 8, value & 0xFF};
+    return dev->bus->write(dev->bus->ctx, dev->address, data, sizeof(data));
+}
+
+static bool read_reg(ad7091r5_t *dev, uint8_t reg, uint16_t *value){
+    uint8_t data[2];
+    if(!dev->bus->write_read(dev->bus->ctx, dev->address, &reg, 1, data, sizeof(data))){
+        return false;
+    }
+    *value = (data[0] << 8) | data[1];
+    return true;
+}
+
+bool ad7091r5_init(ad7091r5_t *dev, const ad7091r5_bus_t *bus, uint8_t address, uint8_t channel_mask){
+    dev->bus = bus;
+    dev->address = address;
+    dev->channel_mask = channel_mask & ((1 << AD7091R5_NUM_CHANNELS) - 1);
+
+    // Command mode: every read of the result register converts the next channel in the sequence
+    if(!write_reg(dev, REG_CONF, CONF_CMD | CONF_ALERT_EN | CONF_INT_VREF)){
+        return false;
+    }
+    if(!write_reg(dev, REG_CHANNEL, dev->channel_mask)){
+        return false;
+    }
+    // The sequence update takes effect one conversion later, flush it
+    uint16_t discard;
+    return read_reg(dev, REG_RESULT, &discard);
+}
+
+bool ad7091r5_set_limits(ad7091r5_t *dev, uint8_t channel, uint16_t low, uint16_t high, uint16_t hysteresis){
+    if(channel >= AD7091R5_NUM_CHANNELS){
+        return false;
+    }
+    return write_reg(dev, REG_CH_LOW_LIMIT(channel), low & AD7091R5_MAX_CODE)
+        && write_reg(dev, REG_CH_HIGH_LIMIT(channel), high & AD7091R5_MAX_CODE)
+        && write_reg(dev, REG_CH_HYSTERESIS(channel), hysteresis & AD7091R5_MAX_CODE);
+}
+
+bool ad7091r5_read_burst(ad7091r5_t *dev, uint8_t *buffer, size_t conversions,
+                         uint32_t sum[AD7091R5_NUM_CHANNELS], uint32_t count[AD7091R5_NUM_CHANNELS]){
+    uint8_t reg = REG_RESULT;
+    if(!dev->bus->write_read(dev->bus->ctx, dev->address, &reg, 1, buffer, conversions * 2)){
+        return false;
+    }
+    for(size_t i = 0; i < conversions * 2; i += 2){
+        uint16_t result = (buffer[i] << 8) | buffer[i + 1];
+        uint8_t channel = RESULT_CH_ID(result);
+        if(!(dev->channel_mask & (1 << channel))){
+            continue;
+        }
+        sum[channel] += RESULT_CONV(result);
+        count[channel]++;
+    }
+    return true;
+}
+
+bool ad7091r5_read_alerts(ad7091r5_t *dev, uint16_t *alerts){
+    return read_reg(dev, REG_ALERT, alerts);
+}
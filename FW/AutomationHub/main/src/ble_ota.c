@@ -0,0 +1,431 @@
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/stream_buffer.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "mbedtls/sha256.h"
+#include "inc/ble_ota.h"
+#include "inc/ota_decoder.h"
+#include "gatts_table_creat_demo.h"
+
+// Images are only switched to once esp_ota_end has checked their signature
+#if !CONFIG_SECURE_SIGNED_ON_UPDATE
+#error "BLE firmware updates need signed images, enable CONFIG_SECURE_SIGNED_APPS_NO_SECURE_BOOT"
+#endif
+
+#define OTA_TASK_STACK_SIZE     (4096)
+#define OTA_TASK_PRIORITY       (2)
+#define OTA_WINDOW              (CONFIG_BLE_OTA_WINDOW_KB * 1024)
+// Acks go out every half window so the client never stalls waiting for one
+#define OTA_ACK_INTERVAL        (OTA_WINDOW / 2)
+#define OTA_CHUNK_SIZE          (4096)      // Up to one flash sector per esp_ota_write
+#define OTA_IDLE_TIMEOUT_MS     (30000)
+#define OTA_RESTART_DELAY_MS    (1000)      // Lets the END reply go out before restarting
+#define OTA_BASE_ID_SIZE        (8)
+
+#define OTA_EVT_BEGIN           (1 << 0)
+#define OTA_EVT_END             (1 << 1)
+#define OTA_EVT_ABORT           (1 << 2)
+
+static const char *TAG = "BLE_OTA";
+
+typedef enum {
+    otaIdle,
+    otaErasing,                 // BEGIN accepted, the task is erasing the slot
+    otaReceiving,
+} ota_state_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t op;
+    uint32_t size;
+    uint8_t sha256[32];
+    // Optional, a raw image when left out
+    uint8_t format;
+    uint32_t payload_size;
+    uint8_t base_id[OTA_BASE_ID_SIZE];
+} ota_begin_t;
+
+#define OTA_BEGIN_RAW_SIZE      offsetof(ota_begin_t, format)
+
+// Shared between the Bluetooth task and the OTA task
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static ota_state_t state = otaIdle;
+static uint16_t session_conn = 0;
+static uint32_t image_size = 0;
+static uint8_t image_sha256[32];
+static uint8_t payload_format = OTA_FORMAT_RAW;
+static uint32_t payload_size = 0;       // Bytes on air, the image size unless compressed
+static uint32_t acked = 0;              // Payload bytes decoded and acked
+static uint32_t received = 0;           // Payload bytes queued by the Bluetooth task
+
+static TaskHandle_t otaTask = NULL;
+static StreamBufferHandle_t stream = NULL;
+
+// Only touched by the OTA task
+static uint8_t chunk[OTA_CHUNK_SIZE];
+static ota_decoder_t decoder;
+static esp_ota_handle_t handle = 0;
+static mbedtls_sha256_context sha;
+static uint32_t image_written = 0;
+static bool flash_failed = false;
+
+static void reply(uint16_t conn_id, uint8_t op, uint8_t status, uint32_t value)
+{
+    ota_reply_t r = { .op = op | OTA_REPLY, .status = status, .value = value };
+    gattOtaNotify(conn_id, (const uint8_t *)&r, sizeof(r));
+}
+
+static void end_session(void)
+{
+    taskENTER_CRITICAL(&ota_lock);
+    state = otaIdle;
+    taskEXIT_CRITICAL(&ota_lock);
+}
+
+static uint8_t check_begin(const uint8_t *data, uint16_t length, ota_begin_t *begin)
+{
+    const esp_partition_t *slot = esp_ota_get_next_update_partition(NULL);
+    if (length != OTA_BEGIN_RAW_SIZE && length != sizeof(*begin)) {
+        return OTA_ERR_SIZE;
+    }
+    memset(begin, 0, sizeof(*begin));
+    memcpy(begin, data, length);
+    if (length == OTA_BEGIN_RAW_SIZE) {
+        begin->format = OTA_FORMAT_RAW;
+        begin->payload_size = begin->size;
+    }
+    if (slot == NULL || begin->size == 0 || begin->size > slot->size || begin->payload_size == 0) {
+        return OTA_ERR_SIZE;
+    }
+    switch (begin->format) {
+        case OTA_FORMAT_RAW:
+            return begin->payload_size == begin->size ? OTA_OK : OTA_ERR_SIZE;
+        case OTA_FORMAT_DEFLATE:
+            return OTA_OK;
+        case OTA_FORMAT_DELTA: {
+            // The patch only works against the exact image it was made from
+            const esp_app_desc_t *app = esp_app_get_description();
+            return memcmp(app->app_elf_sha256, begin->base_id, OTA_BASE_ID_SIZE) == 0 ? OTA_OK : OTA_ERR_BASE;
+        }
+        default:
+            return OTA_ERR_FORMAT;
+    }
+}
+
+void ble_ota_control(uint16_t conn_id, const uint8_t *data, uint16_t length)
+{
+    if (length < 1 || otaTask == NULL) {
+        return;
+    }
+    uint8_t op = data[0];
+
+    taskENTER_CRITICAL(&ota_lock);
+    bool busy = state != otaIdle && session_conn != conn_id;
+    bool active = state != otaIdle;
+    taskEXIT_CRITICAL(&ota_lock);
+    if (busy) {
+        reply(conn_id, op, OTA_ERR_BUSY, 0);
+        return;
+    }
+    if (!active && (op == OTA_OP_END || op == OTA_OP_ABORT)) {
+        reply(conn_id, op, op == OTA_OP_ABORT ? OTA_OK : OTA_ERR_STATE, 0);
+        return;
+    }
+
+    switch (op) {
+        case OTA_OP_BEGIN: {
+            ota_begin_t begin;
+            uint8_t status = check_begin(data, length, &begin);
+            if (status != OTA_OK) {
+                reply(conn_id, op, status, 0);
+                return;
+            }
+            taskENTER_CRITICAL(&ota_lock);
+            bool idle = state == otaIdle;
+            if (idle) {
+                state = otaErasing;
+                session_conn = conn_id;
+                image_size = begin.size;
+                memcpy(image_sha256, begin.sha256, sizeof(image_sha256));
+                payload_format = begin.format;
+                payload_size = begin.payload_size;
+            }
+            taskEXIT_CRITICAL(&ota_lock);
+            if (!idle) {
+                reply(conn_id, op, OTA_ERR_STATE, 0);
+                return;
+            }
+            // Erasing takes seconds, the OTA task replies once the slot is ready
+            xTaskNotify(otaTask, OTA_EVT_BEGIN, eSetBits);
+            break;
+        }
+        case OTA_OP_END:
+            xTaskNotify(otaTask, OTA_EVT_END, eSetBits);
+            break;
+        case OTA_OP_ABORT:
+            xTaskNotify(otaTask, OTA_EVT_ABORT, eSetBits);
+            break;
+        default:
+            reply(conn_id, op, OTA_ERR_STATE, 0);
+            break;
+    }
+}
+
+void ble_ota_data(uint16_t conn_id, const uint8_t *data, uint16_t length)
+{
+    taskENTER_CRITICAL(&ota_lock);
+    bool accepted = state == otaReceiving && session_conn == conn_id;
+    uint8_t status = OTA_OK;
+    if (accepted) {
+        if (received + length > payload_size) {
+            status = OTA_ERR_SIZE;
+        } else if (received + length - acked > OTA_WINDOW) {
+            status = OTA_ERR_OVERFLOW;
+        } else {
+            received += length;
+        }
+    }
+    taskEXIT_CRITICAL(&ota_lock);
+    if (!accepted) {
+        return;
+    }
+
+    // Only copied here, the OTA task writes to flash. The window keeps this from blocking.
+    if (status == OTA_OK && xStreamBufferSend(stream, data, length, 0) != length) {
+        status = OTA_ERR_OVERFLOW;
+    }
+    if (status != OTA_OK) {
+        ESP_LOGE(TAG, "Data rejected, status %d", status);
+        reply(conn_id, OTA_OP_ACK, status, acked);
+        xTaskNotify(otaTask, OTA_EVT_ABORT, eSetBits);
+    }
+}
+
+void ble_ota_disconnected(uint16_t conn_id)
+{
+    taskENTER_CRITICAL(&ota_lock);
+    bool ours = state != otaIdle && session_conn == conn_id;
+    taskEXIT_CRITICAL(&ota_lock);
+    if (ours) {
+        xTaskNotify(otaTask, OTA_EVT_ABORT, eSetBits);
+    }
+}
+
+// Decoded image bytes, straight to the inactive slot
+static bool write_image(void *ctx, const uint8_t *data, size_t length)
+{
+    if (image_written + length > image_size) {
+        return false;
+    }
+    esp_err_t err = esp_ota_write(handle, data, length);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_write failed: %s", esp_err_to_name(err));
+        flash_failed = true;
+        return false;
+    }
+    mbedtls_sha256_update(&sha, data, length);
+    image_written += length;
+    return true;
+}
+
+// Delta payloads patch the image in the running slot
+static bool read_base(void *ctx, uint32_t offset, uint8_t *data, size_t length)
+{
+    return esp_partition_read(esp_ota_get_running_partition(), offset, data, length) == ESP_OK;
+}
+
+static void cancel_image(void)
+{
+    esp_ota_abort(handle);
+    mbedtls_sha256_free(&sha);
+    ota_decoder_end(&decoder);
+}
+
+static bool finish_image(void)
+{
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    ota_decoder_end(&decoder);
+    if (memcmp(digest, image_sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "SHA-256 mismatch");
+        esp_ota_abort(handle);
+        reply(session_conn, OTA_OP_END, OTA_ERR_HASH, 0);
+        return false;
+    }
+    // Also checks the image header, the checksum appended by the build and the signature
+    // against the public key built into this image (CONFIG_SECURE_SIGNED_ON_UPDATE)
+    esp_err_t err = esp_ota_end(handle);
+    if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+        ESP_LOGE(TAG, "Image signature or header rejected");
+        reply(session_conn, OTA_OP_END, OTA_ERR_SIGNATURE, 0);
+        return false;
+    }
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(esp_ota_get_next_update_partition(NULL));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Image not accepted: %s", esp_err_to_name(err));
+        reply(session_conn, OTA_OP_END, OTA_ERR_FLASH, 0);
+        return false;
+    }
+    reply(session_conn, OTA_OP_END, OTA_OK, 0);
+    return true;
+}
+
+static uint8_t start_image(void)
+{
+    const esp_partition_t *slot = esp_ota_get_next_update_partition(NULL);
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (!ota_decoder_begin(&decoder, payload_format, write_image, read_base, running->size, NULL)) {
+        return OTA_ERR_NO_MEM;
+    }
+    esp_err_t err = esp_ota_begin(slot, image_size, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        ota_decoder_end(&decoder);
+        return OTA_ERR_FLASH;
+    }
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    image_written = 0;
+    flash_failed = false;
+    ESP_LOGI(TAG, "Receiving %u bytes, format %d, into %s as %u bytes", payload_size, payload_format,
+             slot->label, image_size);
+    return OTA_OK;
+}
+
+static void ota_task(void *pvParameters)
+{
+    uint32_t consumed = 0;
+    uint32_t last_ack = 0;
+    bool end_requested = false;
+    int64_t started = 0;
+    int64_t last_data = 0;
+
+    for (;;) {
+        uint32_t events = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &events, state == otaReceiving ? 0 : portMAX_DELAY);
+
+        if ((events & OTA_EVT_ABORT) && state != otaIdle) {
+            ESP_LOGW(TAG, "Update aborted after %u bytes", consumed);
+            if (state == otaReceiving) {
+                cancel_image();
+            }
+            reply(session_conn, OTA_OP_ABORT, OTA_OK, consumed);
+            end_session();
+            continue;
+        }
+
+        if (events & OTA_EVT_BEGIN) {
+            uint8_t status = start_image();
+            if (status != OTA_OK) {
+                reply(session_conn, OTA_OP_BEGIN, status, 0);
+                end_session();
+                continue;
+            }
+            xStreamBufferReset(stream);
+            consumed = 0;
+            last_ack = 0;
+            end_requested = false;
+            started = esp_timer_get_time();
+            last_data = started;
+            taskENTER_CRITICAL(&ota_lock);
+            acked = 0;
+            received = 0;
+            state = otaReceiving;
+            taskEXIT_CRITICAL(&ota_lock);
+            reply(session_conn, OTA_OP_BEGIN, OTA_OK, OTA_WINDOW);
+        }
+
+        if (state != otaReceiving) {
+            continue;
+        }
+        if (events & OTA_EVT_END) {
+            end_requested = true;
+        }
+
+        size_t length = xStreamBufferReceive(stream, chunk, sizeof(chunk), pdMS_TO_TICKS(100));
+        if (length > 0) {
+            if (!ota_decoder_feed(&decoder, chunk, length)) {
+                ESP_LOGE(TAG, "Payload rejected after %u bytes", consumed);
+                cancel_image();
+                reply(session_conn, OTA_OP_ACK, flash_failed ? OTA_ERR_FLASH : OTA_ERR_FORMAT, consumed);
+                end_session();
+                continue;
+            }
+            consumed += length;
+            last_data = esp_timer_get_time();
+            if (consumed - last_ack >= OTA_ACK_INTERVAL || consumed == payload_size) {
+                taskENTER_CRITICAL(&ota_lock);
+                acked = consumed;
+                taskEXIT_CRITICAL(&ota_lock);
+                last_ack = consumed;
+                reply(session_conn, OTA_OP_ACK, OTA_OK, consumed);
+            }
+        } else if (esp_timer_get_time() - last_data > (int64_t)OTA_IDLE_TIMEOUT_MS * 1000) {
+            ESP_LOGW(TAG, "No data for %d s, aborting", OTA_IDLE_TIMEOUT_MS / 1000);
+            cancel_image();
+            reply(session_conn, OTA_OP_ABORT, OTA_ERR_STATE, consumed);
+            end_session();
+            continue;
+        }
+
+        bool complete = consumed == payload_size && ota_decoder_finished(&decoder) && image_written == image_size;
+        if (end_requested && complete) {
+            int64_t elapsed_ms = (esp_timer_get_time() - started) / 1000;
+            ESP_LOGI(TAG, "Received %u bytes for a %u byte image in %lld ms, %lld B/s", consumed, image_written,
+                     elapsed_ms, elapsed_ms > 0 ? (int64_t)consumed * 1000 / elapsed_ms : 0);
+            bool ok = finish_image();
+            end_session();
+            if (ok) {
+                ESP_LOGI(TAG, "Update complete, restarting");
+                vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY_MS));
+                esp_restart();
+            }
+        } else if (end_requested && length == 0) {
+            // END before all data arrived or the payload decoded short, the client got out of step
+            ESP_LOGE(TAG, "END after %u of %u bytes, image %u of %u bytes", consumed, payload_size,
+                     image_written, image_size);
+            cancel_image();
+            reply(session_conn, OTA_OP_END, OTA_ERR_SIZE, consumed);
+            end_session();
+        }
+    }
+}
+
+void ble_ota_ready(uint32_t part)
+{
+    static portMUX_TYPE ready_lock = portMUX_INITIALIZER_UNLOCKED;
+    static uint32_t ready = 0;
+    static bool confirmed = false;
+    bool confirm = false;
+    taskENTER_CRITICAL(&ready_lock);
+    ready |= part;
+    if (ready == OTA_READY_ALL && !confirmed) {
+        confirmed = true;
+        confirm = true;
+    }
+    taskEXIT_CRITICAL(&ready_lock);
+    if (!confirm) {
+        return;
+    }
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t img_state;
+    if (esp_ota_get_state_partition(running, &img_state) == ESP_OK && img_state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGI(TAG, "New image in %s started, cancelling rollback", running->label);
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+}
+
+void ble_ota_init(void)
+{
+    stream = xStreamBufferCreate(OTA_WINDOW, 1);
+    xTaskCreate(ota_task, "BLE OTA", OTA_TASK_STACK_SIZE, NULL, OTA_TASK_PRIORITY, &otaTask);
+}
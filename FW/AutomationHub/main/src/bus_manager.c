@@ -1,134 +1,410 @@
-/* Uart Events Example
-
-   This example code is in the Public Domain (or CC0 licensed, at your option.)
+#include "sdkconfig.h"
+#if CONFIG_BUS_ROLE_SLAVE
 
-   Unless required by applicable law or agreed to in writing, this
-   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
-   CONDITIONS OF ANY KIND, either express or implied.
-*/
 #include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "esp_system.h"
-#include "nvs_flash.h"
-#include "driver/uart.h"
-#include "freertos/queue.h"
 #include "esp_log.h"
-#include "sdkconfig.h"
-
-/**
- * This is a example which echos any data it receives on UART back to the sender using RS485 interface in half duplex mode.
-*/
-#define TAG "RS485_ECHO_APP"
+#include "inc/bus_manager.h"
+#include "inc/input_filter.h"
+#include "inc/modbus_crc.h"
+#include "inc/modbus_rtu.h"
+#include "inc/output_manager.h"
+#include "inc/spa_state.h"
+#include "inc/state_handler.h"
+#if CONFIG_BUS_SLAVE_NATIVE
+#include "driver/uart.h"
+#include "inc/rs485_bus.h"
+#include "inc/rs485_uart.h"
+#else
+#include "mbcontroller.h"
+#endif
 
-// Note: Some pins on target chip cannot be assigned for UART communication.
-// Please refer to documentation for selected board and target to configure pins using Kconfig.
-#define ECHO_TEST_TXD   (1)
-#define ECHO_TEST_RXD   (3)
+#define TAG "RS485_MODBUS"
 
+#define MB_UART_PORT            (0)
+#define MB_TXD                  (1)
+#define MB_RXD                  (3)
 // RTS for RS485 Half-Duplex Mode manages DE/~RE
-#define ECHO_TEST_RTS   (22)
-
+#define MB_RTS                  (22)
 // CTS is not used in RS485 Half-Duplex Mode
-#define ECHO_TEST_CTS   (UART_PIN_NO_CHANGE)
+#define MB_CTS                  (UART_PIN_NO_CHANGE)
 
-#define BUF_SIZE        (127)
-#define BAUD_RATE       (115200)
+#define BUS_TASK_STACK_SIZE     (3072)
+#define BUS_TASK_PRIORITY       (10)
 
-// Read packet timeout
-#define PACKET_READ_TICS        (100 / portTICK_PERIOD_MS)
-#define ECHO_TASK_STACK_SIZE    (2048)
-#define ECHO_TASK_PRIO          (10)
-#define ECHO_UART_PORT          (0)
+// Only touched by the Modbus task
+static uint32_t polls = 0;
+#if CONFIG_BUS_SLAVE_NATIVE
+static rs485_port_t port;
+static rs485_bus_t bus;
+#endif
 
-// Timeout threshold for UART = number of symbols (~10 tics) with unchanged state on receive pin
-#define ECHO_READ_TOUT          (3) // 3.5T * 8 = 28 ticks, TOUT=3 -> ~24..33 ticks
-
-static void echo_send(const int port, const char* str, uint8_t length)
+static uint16_t input_register(const spa_state_t *state, bool valid, int reg)
 {
-    if (uart_write_bytes(port, str, length) != length) {
-        ESP_LOGE(TAG, "Send data critical failure.");
-        // add your code to handle sending failure here
-        abort();
+    if (!valid) {
+        return 0;
+    }
+    switch (reg) {
+        case MB_IR_STATE_VERSION:   return state->version;
+        case MB_IR_MODE:            return state->mode;
+        case MB_IR_SETPOINT:        return state->setpoint;
+        case MB_IR_OUTPUTS:         return state->outputs;
+        case MB_IR_TEMP_1:
+        case MB_IR_TEMP_2:
+        case MB_IR_TEMP_3:
+        case MB_IR_TEMP_4:          return (uint16_t)state->temps[reg - MB_IR_TEMP_1];
+        case MB_IR_FAULTS:          return state->faults;
+        case MB_IR_CIRC_REMAINING:  return state->circRemaining;
+        case MB_IR_JETS_REMAINING:  return state->jetsRemaining;
+        case MB_IR_HEATER_DUTY:     return state->heaterDuty;
+        case MB_IR_UPTIME_HI:       return state->uptime >> 16;
+        case MB_IR_UPTIME_LO:       return state->uptime & 0xFFFF;
+        default:                    return 0;
     }
 }
 
-// An example of echo test with hardware flow control on UART
-static void bus_task(void *arg)
+static uint16_t saturate(uint32_t value)
 {
-    const int uart_num = ECHO_UART_PORT;
-    uart_config_t uart_config = {
-        .baud_rate = BAUD_RATE,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .rx_flow_ctrl_thresh = 122,
-        .source_clk = UART_SCLK_DEFAULT,
-    };
+    return value > UINT16_MAX ? UINT16_MAX : value;
+}
 
-    // Set UART log level
-    esp_log_level_set(TAG, ESP_LOG_INFO);
+// Counters of the bus itself, only kept by the built in stack
+static uint16_t bus_register(int reg)
+{
+#if CONFIG_BUS_SLAVE_NATIVE
+    rs485_stats_t stats;
+    rs485_get_stats(&bus, &stats);
+    switch (reg) {
+        case MB_IR_FRAME_ERRORS:        return saturate(stats.errors);
+        case MB_IR_FRAME_CPU_AVG:       return saturate(stats.cpu_avg_us);
+        case MB_IR_FRAME_CPU_MAX:       return saturate(stats.cpu_max_us);
+        case MB_IR_TURNAROUND_AVG:      return saturate(stats.turnaround_avg_us);
+        case MB_IR_TURNAROUND_MAX:      return saturate(stats.turnaround_max_us);
+        default:                        return 0;
+    }
+#else
+    return 0;
+#endif
+}
 
-    ESP_LOGI(TAG, "Start RS485 application test and configure UART.");
+static void put_register(uint8_t **buffer, uint16_t value)
+{
+    *(*buffer)++ = value >> 8;
+    *(*buffer)++ = value & 0xFF;
+}
 
-    // Install UART driver (we don't need an event queue here)
-    // In this example we don't even use a buffer for sending data.
-    ESP_ERROR_CHECK(uart_driver_install(uart_num, BUF_SIZE * 2, 0, 0, NULL, 0));
+static uint8_t read_input_registers(uint8_t *out, uint16_t first, uint16_t count)
+{
+    if (first + count > MB_IR_COUNT) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+    spa_state_t state;
+    bool valid = spa_state_read(&state);
+    polls++;
+    for (int reg = first; reg < first + count; reg++) {
+        uint16_t value;
+        if (reg == MB_IR_POLLS_HI) {
+            value = polls >> 16;
+        } else if (reg == MB_IR_POLLS_LO) {
+            value = polls & 0xFFFF;
+        } else if (reg >= MB_IR_FRAME_ERRORS) {
+            value = bus_register(reg);
+        } else {
+            value = input_register(&state, valid, reg);
+        }
+        put_register(&out, value);
+    }
+    return MODBUS_EX_NONE;
+}
 
-    // Configure UART parameters
-    ESP_ERROR_CHECK(uart_param_config(uart_num, &uart_config));
+// Times are kept in ms, the registers carry seconds
+static uint16_t heater_register(const heater_pid_params_t *params, int reg)
+{
+    switch (reg) {
+        case MB_HR_HEATER_KP:       return params->kp;
+        case MB_HR_HEATER_KI:       return params->ki;
+        case MB_HR_HEATER_KD:       return params->kd;
+        case MB_HR_HEATER_WINDOW:   return saturate(params->window_ms / 1000);
+        case MB_HR_HEATER_MIN_ON:   return saturate(params->min_on_ms / 1000);
+        case MB_HR_HEATER_MIN_OFF:  return saturate(params->min_off_ms / 1000);
+        default:                    return 0;
+    }
+}
 
-    ESP_LOGI(TAG, "UART set pins, mode and install driver.");
+static void set_heater_register(heater_pid_params_t *params, int reg, uint16_t value)
+{
+    switch (reg) {
+        case MB_HR_HEATER_KP:       params->kp = value; break;
+        case MB_HR_HEATER_KI:       params->ki = value; break;
+        case MB_HR_HEATER_KD:       params->kd = value; break;
+        case MB_HR_HEATER_WINDOW:   params->window_ms = value * 1000u; break;
+        case MB_HR_HEATER_MIN_ON:   params->min_on_ms = value * 1000u; break;
+        case MB_HR_HEATER_MIN_OFF:  params->min_off_ms = value * 1000u; break;
+    }
+}
 
-    // Set UART pins as per KConfig settings
-    ESP_ERROR_CHECK(uart_set_pin(uart_num, ECHO_TEST_TXD, ECHO_TEST_RXD, ECHO_TEST_RTS, ECHO_TEST_CTS));
+static bool is_heater_register(int reg)
+{
+    return reg >= MB_HR_HEATER_KP && reg <= MB_HR_HEATER_MIN_OFF;
+}
 
-    // Set RS485 half duplex mode
-    ESP_ERROR_CHECK(uart_set_mode(uart_num, UART_MODE_RS485_HALF_DUPLEX));
+static bool is_schedule_register(int reg)
+{
+    return reg == MB_HR_CIRC_PERIOD || reg == MB_HR_JETS_TIME;
+}
 
-    // Set read timeout of UART TOUT feature
-    ESP_ERROR_CHECK(uart_set_rx_timeout(uart_num, ECHO_READ_TOUT));
+static bool is_calibration_register(int reg)
+{
+    return reg >= MB_HR_TEMP_OFFSET_1 && reg <= MB_HR_TEMP_OFFSET_4;
+}
 
-    // Allocate buffers for UART
-    uint8_t* data = (uint8_t*) malloc(BUF_SIZE);
+static uint16_t filter_register(const input_filter_params_t *params, int reg)
+{
+    if (reg >= MB_HR_FILTER_SLEW_1) {
+        return params->slew_limit[reg - MB_HR_FILTER_SLEW_1];
+    }
+    if (reg >= MB_HR_FILTER_EMA_1) {
+        return params->ema_shift[reg - MB_HR_FILTER_EMA_1];
+    }
+    return params->median_len[reg - MB_HR_FILTER_MEDIAN_1];
+}
+
+// Out of range values are kept out of the uint8_t fields by saturating, and then rejected
+// with the rest of the group
+static void set_filter_register(input_filter_params_t *params, int reg, uint16_t value)
+{
+    if (reg >= MB_HR_FILTER_SLEW_1) {
+        params->slew_limit[reg - MB_HR_FILTER_SLEW_1] = value;
+    } else if (reg >= MB_HR_FILTER_EMA_1) {
+        params->ema_shift[reg - MB_HR_FILTER_EMA_1] = value > UINT8_MAX ? UINT8_MAX : value;
+    } else {
+        params->median_len[reg - MB_HR_FILTER_MEDIAN_1] = value > UINT8_MAX ? UINT8_MAX : value;
+    }
+}
 
-    ESP_LOGI(TAG, "UART start recieve loop.\r\n");
-    echo_send(uart_num, "Start RS485 UART test.\r\n", 24);
+static bool is_filter_register(int reg)
+{
+    return reg >= MB_HR_FILTER_MEDIAN_1 && reg <= MB_HR_FILTER_SLEW_4;
+}
 
-    while(1) {
-        //Read data from UART
-        int len = uart_read_bytes(uart_num, data, BUF_SIZE, PACKET_READ_TICS);
+static uint8_t read_holding_registers(uint8_t *out, uint16_t first, uint16_t count)
+{
+    if (first + count > MB_HR_COUNT) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+    spa_state_t state;
+    bool valid = spa_state_read(&state);
+    heater_pid_params_t heater;
+    getHeaterParams(&heater);
+    spa_config_t config;
+    config_get(&config);
+    input_filter_params_t filter;
+    input_get_filter_params(&filter);
+    polls++;
+    for (int reg = first; reg < first + count; reg++) {
+        uint16_t value;
+        if (is_heater_register(reg)) {
+            value = heater_register(&heater, reg);
+        } else if (is_filter_register(reg)) {
+            value = filter_register(&filter, reg);
+        } else if (reg == MB_HR_CIRC_PERIOD) {
+            value = saturate(config.schedule.circ_period_s);
+        } else if (reg == MB_HR_JETS_TIME) {
+            value = saturate(config.schedule.jets_time_s);
+        } else if (is_calibration_register(reg)) {
+            value = (uint16_t)config.calibration.temp_offset[reg - MB_HR_TEMP_OFFSET_1];
+        } else if (reg == MB_HR_AUX_OUTPUT) {
+            value = valid && (state.outputs & OUTPUT_BIT(eOutput4)) ? 1 : 0;
+        } else {
+            value = input_register(&state, valid, reg == MB_HR_MODE ? MB_IR_MODE : MB_IR_SETPOINT);
+        }
+        put_register(&out, value);
+    }
+    return MODBUS_EX_NONE;
+}
 
-        //Write data back to UART
-        if (len > 0) {
-            echo_send(uart_num, "\r\n", 2);
-            char prefix[] = "RS485 Received: [";
-            echo_send(uart_num, prefix, (sizeof(prefix) - 1));
-            ESP_LOGI(TAG, "Received %u bytes:", len);
-            printf("[ ");
-            for (int i = 0; i < len; i++) {
-                printf("0x%.2X ", (uint8_t)data[i]);
-                echo_send(uart_num, (const char*)&data[i], 1);
-                // Add a Newline character if you get a return charater from paste (Paste tests multibyte receipt/buffer)
-                if (data[i] == '\r') {
-                    echo_send(uart_num, "\n", 1);
-                }
+// Only validated here and handed to the state handler, like the BLE writes
+static uint8_t write_holding_registers(const uint8_t *in, uint16_t first, uint16_t count)
+{
+    if (first + count > MB_HR_COUNT) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+    polls++;
+    uint8_t status = MODBUS_EX_NONE;
+    heater_pid_params_t heater;
+    bool heater_written = false;
+    getHeaterParams(&heater);
+    spa_config_t config;
+    bool schedule_written = false;
+    bool calibration_written = false;
+    config_get(&config);
+    input_filter_params_t filter;
+    bool filter_written = false;
+    input_get_filter_params(&filter);
+    for (int reg = first; reg < first + count; reg++) {
+        uint16_t value = in[0] << 8 | in[1];
+        in += 2;
+        if (is_heater_register(reg)) {
+            set_heater_register(&heater, reg, value);
+            heater_written = true;
+            continue;
+        }
+        if (is_schedule_register(reg)) {
+            if (reg == MB_HR_CIRC_PERIOD) {
+                config.schedule.circ_period_s = value;
+            } else {
+                config.schedule.jets_time_s = value;
             }
-            printf("] \n");
-            echo_send(uart_num, "]\r\n", 3);
+            schedule_written = true;
+            continue;
+        }
+        if (is_calibration_register(reg)) {
+            config.calibration.temp_offset[reg - MB_HR_TEMP_OFFSET_1] = (int16_t)value;
+            calibration_written = true;
+            continue;
+        }
+        if (is_filter_register(reg)) {
+            set_filter_register(&filter, reg, value);
+            filter_written = true;
+            continue;
+        }
+        bool accepted = false;
+        if (value <= UINT8_MAX) {
+            switch (reg) {
+                case MB_HR_MODE:        accepted = setMode(value); break;
+                case MB_HR_AUX_OUTPUT:  accepted = setAuxOutput(value); break;
+                default:                accepted = updateSetTemp(value); break;
+            }
+        }
+        if (!accepted) {
+            status = MODBUS_EX_ILLEGAL_VALUE;
+        }
+    }
+    // The whole group at once, a window shorter than the minimum times is only rejected here
+    if (heater_written && !setHeaterParams(&heater)) {
+        status = MODBUS_EX_ILLEGAL_VALUE;
+    }
+    if (schedule_written && !setSchedule(&config.schedule)) {
+        status = MODBUS_EX_ILLEGAL_VALUE;
+    }
+    if (calibration_written && !setCalibration(&config.calibration)) {
+        status = MODBUS_EX_ILLEGAL_VALUE;
+    }
+    if (filter_written && !input_set_filter_params(&filter)) {
+        status = MODBUS_EX_ILLEGAL_VALUE;
+    }
+    return status;
+}
+
+#if CONFIG_BUS_SLAVE_NATIVE
+
+static const modbus_rtu_slave_t slave = {
+    .address = CONFIG_MODBUS_SLAVE_ADDRESS,
+    .read_input = read_input_registers,
+    .read_holding = read_holding_registers,
+    .write_holding = write_holding_registers,
+};
+
+// Requests are answered one at a time from the frame they arrived in, the response goes
+// out of a second pool frame in one write. The next request cannot arrive before the
+// master has the response, so nothing waits for the transmission to finish.
+static void bus_task(void *arg)
+{
+    for (;;) {
+        rs485_frame_t *request = rs485_receive(&bus, RS485_WAIT_FOREVER);
+        if (request == NULL) {
+            continue;
+        }
+        rs485_frame_t *response = rs485_frame_alloc(&bus);
+        if (response == NULL) {
+            rs485_frame_free(&bus, request);
+            continue;
+        }
+        response->length = modbus_rtu_slave_handle(&slave, request->data, request->length, response->data);
+        rs485_frame_free(&bus, request);
+        if (response->length > 0) {
+            rs485_send(&bus, response, false);
         } else {
-            // Echo a "." to show we are alive while we wait for input
-            //echo_send(uart_num, ".", 1);
-            //ESP_ERROR_CHECK(uart_wait_tx_done(uart_num, 10));
+            rs485_frame_free(&bus, response);
         }
     }
-    vTaskDelete(NULL);
 }
 
 void init_bus_task(void)
 {
-    xTaskCreate(bus_task, "bus_task", ECHO_TASK_STACK_SIZE, NULL, ECHO_TASK_PRIO, NULL);
-}
\ No newline at end of file
+    modbus_crc_init();
+    if (!rs485_uart_init(&port, MB_UART_PORT, CONFIG_MODBUS_BAUD_RATE, MB_TXD, MB_RXD, MB_RTS)) {
+        return;
+    }
+    rs485_bus_init(&bus, &port);
+    xTaskCreate(bus_task, "bus_task", BUS_TASK_STACK_SIZE, NULL, BUS_TASK_PRIORITY, NULL);
+
+    ESP_LOGI(TAG, "Modbus RTU slave %d at %d baud", CONFIG_MODBUS_SLAVE_ADDRESS, CONFIG_MODBUS_BAUD_RATE);
+}
+
+#else
+
+// The stack calls eMBRegInputCB/eMBRegHoldingCB from its own task for every request. They are
+// wrapped at link time (see CMakeLists.txt) so polls are encoded straight from the snapshot
+// into the response frame, instead of from a register area the application has to keep
+// updated. Nothing here waits on, or is waited on by, the state handler.
+// mb.h is private to esp-modbus, these mirror its types.
+typedef unsigned char UCHAR;
+typedef unsigned short USHORT;
+typedef enum { MB_REG_READ, MB_REG_WRITE } eMBRegisterMode;
+typedef enum { MB_ENOERR, MB_ENOREG, MB_EINVAL } eMBErrorCode;
+
+eMBErrorCode __wrap_eMBRegInputCB(UCHAR *pucRegBuffer, USHORT usAddress, USHORT usNRegs);
+eMBErrorCode __wrap_eMBRegHoldingCB(UCHAR *pucRegBuffer, USHORT usAddress, USHORT usNRegs, eMBRegisterMode eMode);
+
+static eMBErrorCode to_mb_error(uint8_t exception)
+{
+    switch (exception) {
+        case MODBUS_EX_NONE:            return MB_ENOERR;
+        case MODBUS_EX_ILLEGAL_ADDRESS: return MB_ENOREG;
+        default:                        return MB_EINVAL;
+    }
+}
+
+eMBErrorCode __wrap_eMBRegInputCB(UCHAR *pucRegBuffer, USHORT usAddress, USHORT usNRegs)
+{
+    // The stack passes the address + 1
+    return to_mb_error(read_input_registers(pucRegBuffer, usAddress - 1, usNRegs));
+}
+
+eMBErrorCode __wrap_eMBRegHoldingCB(UCHAR *pucRegBuffer, USHORT usAddress, USHORT usNRegs, eMBRegisterMode eMode)
+{
+    if (eMode == MB_REG_READ) {
+        return to_mb_error(read_holding_registers(pucRegBuffer, usAddress - 1, usNRegs));
+    }
+    return to_mb_error(write_holding_registers(pucRegBuffer, usAddress - 1, usNRegs));
+}
+
+void init_bus_task(void)
+{
+    void *handler = NULL;
+    mb_communication_info_t comm = {
+        .mode = MB_MODE_RTU,
+        .slave_addr = CONFIG_MODBUS_SLAVE_ADDRESS,
+        .port = MB_UART_PORT,
+        .baudrate = CONFIG_MODBUS_BAUD_RATE,
+        .parity = UART_PARITY_DISABLE,
+    };
+
+    modbus_crc_init();
+    ESP_ERROR_CHECK(mbc_slave_init(MB_PORT_SERIAL_SLAVE, &handler));
+    ESP_ERROR_CHECK(mbc_slave_setup((void *)&comm));
+    ESP_ERROR_CHECK(mbc_slave_start());
+
+    // Pins and half duplex mode are set on the UART the stack installed
+    ESP_ERROR_CHECK(uart_set_pin(MB_UART_PORT, MB_TXD, MB_RXD, MB_RTS, MB_CTS));
+    ESP_ERROR_CHECK(uart_set_mode(MB_UART_PORT, UART_MODE_RS485_HALF_DUPLEX));
+
+    ESP_LOGI(TAG, "Modbus RTU slave %d at %d baud", CONFIG_MODBUS_SLAVE_ADDRESS, CONFIG_MODBUS_BAUD_RATE);
+}
+
+#endif // CONFIG_BUS_SLAVE_NATIVE
+
+#endif // CONFIG_BUS_ROLE_SLAVE
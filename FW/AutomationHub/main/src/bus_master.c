@@ -0,0 +1,238 @@
+#include "sdkconfig.h"
+#if CONFIG_BUS_ROLE_MASTER
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbcontroller.h"
+#include "inc/bus_manager.h"
+#include "inc/bus_schedule.h"
+#include "inc/modbus_crc.h"
+#include "inc/snapshot.h"
+#include "inc/state_handler.h"
+
+#define TAG "RS485_MASTER"
+
+#define MB_UART_PORT            (0)
+#define MB_TXD                  (1)
+#define MB_RXD                  (3)
+// RTS for RS485 Half-Duplex Mode manages DE/~RE
+#define MB_RTS                  (22)
+// CTS is not used in RS485 Half-Duplex Mode
+#define MB_CTS                  (UART_PIN_NO_CHANGE)
+
+#define BUS_TASK_STACK_SIZE     (3072)
+#define BUS_TASK_PRIORITY       (5)
+#define BUS_OFFLINE_AFTER       (3)         // Consecutive failed reads before a device counts as offline
+#define BUS_REPORT_PERIOD_US    ((int64_t)CONFIG_BUS_REPORT_PERIOD_S * 1000000)
+
+typedef struct {
+    const char *name;
+    uint8_t address;
+} bus_device_t;
+
+static const bus_device_t devices[BUS_DEVICE_COUNT] = {
+    [BUS_DEVICE_FLOW]   = { "flow meter",   CONFIG_BUS_FLOW_METER_ADDRESS },
+    [BUS_DEVICE_PUMP]   = { "pump drive",   CONFIG_BUS_PUMP_ADDRESS },
+    [BUS_DEVICE_WATER]  = { "ORP/pH",       CONFIG_BUS_WATER_SENSOR_ADDRESS },
+};
+
+// Register maps of the devices fitted so far. Adjacent registers of one device are read
+// together, so keep values a device has side by side next to each other here as well.
+static const bus_param_t params[BUS_VALUE_COUNT] = {
+    [BUS_FLOW_RATE]     = { .device = BUS_DEVICE_FLOW,  .reg_type = BUS_REG_INPUT,   .reg = 0, .size = 1, .deadband = 2 },
+    [BUS_FLOW_TOTAL]    = { .device = BUS_DEVICE_FLOW,  .reg_type = BUS_REG_INPUT,   .reg = 1, .size = 2, .deadband = 10 },
+    [BUS_PUMP_SPEED]    = { .device = BUS_DEVICE_PUMP,  .reg_type = BUS_REG_HOLDING, .reg = 0, .size = 1, .deadband = 5 },
+    [BUS_PUMP_CURRENT]  = { .device = BUS_DEVICE_PUMP,  .reg_type = BUS_REG_HOLDING, .reg = 1, .size = 1, .deadband = 2 },
+    [BUS_PUMP_FAULT]    = { .device = BUS_DEVICE_PUMP,  .reg_type = BUS_REG_HOLDING, .reg = 2, .size = 1, .deadband = 0 },
+    [BUS_WATER_PH]      = { .device = BUS_DEVICE_WATER, .reg_type = BUS_REG_INPUT,   .reg = 0, .size = 1, .deadband = 5 },
+    [BUS_WATER_ORP]     = { .device = BUS_DEVICE_WATER, .reg_type = BUS_REG_INPUT,   .reg = 1, .size = 1, .is_signed = true, .deadband = 10 },
+};
+
+static const bus_schedule_params_t schedule = {
+    .fast_ms = CONFIG_BUS_POLL_FAST_MS,
+    .slow_ms = CONFIG_BUS_POLL_SLOW_MS,
+    .backoff_max_ms = CONFIG_BUS_BACKOFF_MAX_MS,
+};
+
+// One descriptor per block, the stack looks them up by name
+static uint8_t order[BUS_VALUE_COUNT];
+static bus_block_t blocks[BUS_VALUE_COUNT];
+static mb_parameter_descriptor_t descriptors[BUS_VALUE_COUNT];
+static char names[BUS_VALUE_COUNT][8];
+static int block_count = 0;
+
+static snapshot_t values_snapshot;
+static bus_values_t values_copies[2];
+
+// Only touched by the bus task
+static bus_values_t values;
+static bool valid[BUS_VALUE_COUNT];
+static uint8_t failures[BUS_DEVICE_COUNT];
+
+typedef struct {
+    int64_t started;
+    int64_t busy_us;
+    int64_t rtt_sum_us;
+    int64_t rtt_max_us;
+    uint32_t polls;
+    uint32_t timeouts;
+    uint32_t errors;
+} bus_stats_t;
+
+static bus_stats_t stats;
+
+bool bus_read_values(bus_values_t *out)
+{
+    return snapshot_read(&values_snapshot, out) != 0;
+}
+
+static void build_descriptors(void)
+{
+    block_count = bus_schedule_build(params, BUS_VALUE_COUNT, order, blocks, BUS_VALUE_COUNT, &schedule);
+    for (int i = 0; i < block_count; i++) {
+        snprintf(names[i], sizeof(names[i]), "blk%d", i);
+        descriptors[i] = (mb_parameter_descriptor_t) {
+            .cid = i,
+            .param_key = names[i],
+            .param_units = "",
+            .mb_slave_addr = devices[blocks[i].device].address,
+            .mb_param_type = blocks[i].reg_type == BUS_REG_INPUT ? MB_PARAM_INPUT : MB_PARAM_HOLDING,
+            .mb_reg_start = blocks[i].reg_start,
+            .mb_size = blocks[i].reg_count,
+            .param_offset = 0,
+            .param_type = PARAM_TYPE_U16,
+            .param_size = PARAM_SIZE_U16,
+            .access = PAR_PERMS_READ,
+        };
+        ESP_LOGI(TAG, "Block %d: %s, %s registers %d-%d, %d values", i, devices[blocks[i].device].name,
+                 blocks[i].reg_type == BUS_REG_INPUT ? "input" : "holding", blocks[i].reg_start,
+                 blocks[i].reg_start + blocks[i].reg_count - 1, blocks[i].count);
+    }
+}
+
+// Returns true when a value of the block moved by more than its deadband
+static bool store_block(const bus_block_t *block, const uint16_t *regs)
+{
+    bool changed = false;
+    for (int i = block->first; i < block->first + block->count; i++) {
+        int index = order[i];
+        int32_t value = bus_param_decode(&params[index], block, regs);
+        if (!valid[index] || abs(value - values.values[index]) > params[index].deadband) {
+            changed = true;
+        }
+        values.values[index] = value;
+        valid[index] = true;
+    }
+    return changed;
+}
+
+static void report(int64_t now)
+{
+    int64_t elapsed = now - stats.started;
+    uint32_t answered = stats.polls - stats.timeouts - stats.errors;
+    values.utilisation = elapsed > 0 ? stats.busy_us * 1000 / elapsed : 0;
+    values.rtt_avg_ms = answered > 0 ? stats.rtt_sum_us / answered / 1000 : 0;
+    values.rtt_max_ms = stats.rtt_max_us / 1000;
+    ESP_LOGI(TAG, "%"PRIu32" polls, %"PRIu32" timeouts, %"PRIu32" errors, bus busy %d.%d%%, round trip avg %d ms max %d ms, online 0x%x",
+             stats.polls, stats.timeouts, stats.errors, values.utilisation / 10, values.utilisation % 10,
+             values.rtt_avg_ms, values.rtt_max_ms, values.online);
+    memset(&stats, 0, sizeof(stats));
+    stats.started = now;
+}
+
+static void bus_task(void *arg)
+{
+    uint16_t regs[BUS_BLOCK_MAX_REGS];
+    stats.started = esp_timer_get_time();
+
+    for (;;) {
+        int64_t now = esp_timer_get_time();
+        int64_t wait_us;
+        int index = bus_schedule_next(blocks, block_count, now, &wait_us);
+        if (index < 0) {
+            vTaskDelay(pdMS_TO_TICKS(wait_us / 1000) + 1);
+            continue;
+        }
+
+        bus_block_t *block = &blocks[index];
+        uint8_t type = 0;
+        int64_t started = esp_timer_get_time();
+        esp_err_t err = mbc_master_get_parameter(index, names[index], (uint8_t *)regs, &type);
+        now = esp_timer_get_time();
+
+        // A timeout holds the bus as well, for the whole response timeout
+        int64_t rtt = now - started;
+        stats.busy_us += rtt;
+        stats.polls++;
+
+        uint8_t device = block->device;
+        uint8_t online = values.online;
+        bool changed = false;
+        if (err == ESP_OK) {
+            stats.rtt_sum_us += rtt;
+            if (rtt > stats.rtt_max_us) {
+                stats.rtt_max_us = rtt;
+            }
+            changed = store_block(block, regs);
+            failures[device] = 0;
+            values.online |= 1 << device;
+        } else {
+            if (err == ESP_ERR_TIMEOUT) {
+                stats.timeouts++;
+            } else {
+                stats.errors++;
+            }
+            if (failures[device] < UINT8_MAX) {
+                failures[device]++;
+            }
+            if (failures[device] == BUS_OFFLINE_AFTER) {
+                ESP_LOGW(TAG, "%s at %d not answering (%s)", devices[device].name, devices[device].address,
+                         esp_err_to_name(err));
+                values.online &= ~(1 << device);
+            }
+        }
+        bus_schedule_done(block, err == ESP_OK, changed, failures[device], now, &schedule);
+
+        if (now - stats.started >= BUS_REPORT_PERIOD_US) {
+            report(now);
+        }
+        snapshot_publish(&values_snapshot, &values);
+        if (changed || values.online != online) {
+            busValuesChanged();
+        }
+    }
+}
+
+void init_bus_task(void)
+{
+    void *handler = NULL;
+    mb_communication_info_t comm = {
+        .mode = MB_MODE_RTU,
+        .port = MB_UART_PORT,
+        .baudrate = CONFIG_MODBUS_BAUD_RATE,
+        .parity = UART_PARITY_DISABLE,
+    };
+
+    modbus_crc_init();
+    snapshot_init(&values_snapshot, &values_copies[0], &values_copies[1], sizeof(bus_values_t));
+    build_descriptors();
+
+    ESP_ERROR_CHECK(mbc_master_init(MB_PORT_SERIAL_MASTER, &handler));
+    ESP_ERROR_CHECK(mbc_master_setup((void *)&comm));
+    ESP_ERROR_CHECK(uart_set_pin(MB_UART_PORT, MB_TXD, MB_RXD, MB_RTS, MB_CTS));
+    ESP_ERROR_CHECK(mbc_master_start());
+    ESP_ERROR_CHECK(uart_set_mode(MB_UART_PORT, UART_MODE_RS485_HALF_DUPLEX));
+    ESP_ERROR_CHECK(mbc_master_set_descriptor(descriptors, block_count));
+
+    ESP_LOGI(TAG, "Modbus RTU master at %d baud, %d values in %d requests", CONFIG_MODBUS_BAUD_RATE,
+             BUS_VALUE_COUNT, block_count);
+    xTaskCreate(bus_task, "bus_task", BUS_TASK_STACK_SIZE, NULL, BUS_TASK_PRIORITY, NULL);
+}
+
+#endif // CONFIG_BUS_ROLE_MASTER
@@ -0,0 +1,108 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "inc/bus_schedule.h"
+
+static int compare(const bus_param_t *a, const bus_param_t *b)
+{
+    if (a->device != b->device) {
+        return a->device - b->device;
+    }
+    if (a->reg_type != b->reg_type) {
+        return a->reg_type - b->reg_type;
+    }
+    return a->reg - b->reg;
+}
+
+int bus_schedule_build(const bus_param_t *params, int count, uint8_t *order,
+                       bus_block_t *blocks, int max_blocks, const bus_schedule_params_t *schedule)
+{
+    // Insertion sort, the tables are a handful of entries
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        while (j > 0 && compare(&params[order[j - 1]], &params[i]) > 0) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const bus_param_t *p = &params[order[i]];
+        bus_block_t *last = n > 0 ? &blocks[n - 1] : NULL;
+        if (last != NULL && last->device == p->device && last->reg_type == p->reg_type &&
+            p->reg == last->reg_start + last->reg_count &&
+            last->reg_count + p->size <= BUS_BLOCK_MAX_REGS) {
+            last->reg_count += p->size;
+            last->count++;
+            continue;
+        }
+        if (n == max_blocks) {
+            return -1;
+        }
+        blocks[n] = (bus_block_t) {
+            .device = p->device,
+            .reg_type = p->reg_type,
+            .reg_start = p->reg,
+            .reg_count = p->size,
+            .first = i,
+            .count = 1,
+            .interval_ms = schedule->fast_ms,
+            .due_us = 0,
+        };
+        n++;
+    }
+    return n;
+}
+
+int bus_schedule_next(const bus_block_t *blocks, int count, int64_t now_us, int64_t *wait_us)
+{
+    int next = -1;
+    for (int i = 0; i < count; i++) {
+        if (next < 0 || blocks[i].due_us < blocks[next].due_us) {
+            next = i;
+        }
+    }
+    if (next < 0) {
+        *wait_us = INT64_MAX;
+        return -1;
+    }
+    if (blocks[next].due_us > now_us) {
+        *wait_us = blocks[next].due_us - now_us;
+        return -1;
+    }
+    *wait_us = 0;
+    return next;
+}
+
+void bus_schedule_done(bus_block_t *block, bool ok, bool changed, uint8_t failures,
+                       int64_t now_us, const bus_schedule_params_t *schedule)
+{
+    uint32_t interval;
+    if (!ok) {
+        // Fast interval doubled per consecutive failure, so a dead device costs little bus time
+        uint8_t shift = failures > 16 ? 16 : failures;
+        uint64_t backoff = (uint64_t)schedule->fast_ms << shift;
+        interval = backoff > schedule->backoff_max_ms ? schedule->backoff_max_ms : backoff;
+    } else if (changed) {
+        interval = schedule->fast_ms;
+    } else {
+        // Steady, stretch by half each time up to the slow interval
+        interval = block->interval_ms + block->interval_ms / 2;
+        if (interval > schedule->slow_ms) {
+            interval = schedule->slow_ms;
+        }
+    }
+    block->interval_ms = interval;
+    block->due_us = now_us + (int64_t)interval * 1000;
+}
+
+int32_t bus_param_decode(const bus_param_t *param, const bus_block_t *block, const uint16_t *regs)
+{
+    const uint16_t *reg = &regs[param->reg - block->reg_start];
+    if (param->size == 2) {
+        uint32_t value = (uint32_t)reg[0] << 16 | reg[1];
+        return (int32_t)value;
+    }
+    return param->is_signed ? (int16_t)reg[0] : reg[0];
+}
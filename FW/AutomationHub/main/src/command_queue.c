@@ -0,0 +1,53 @@
+#include "inc/command_queue.h"
+
+#define COMMAND_QUEUE_MASK      (COMMAND_QUEUE_SIZE - 1)
+
+_Static_assert((COMMAND_QUEUE_SIZE & COMMAND_QUEUE_MASK) == 0, "COMMAND_QUEUE_SIZE must be a power of two");
+
+void command_queue_init(command_queue_t *queue){
+    for(uint32_t i = 0; i < COMMAND_QUEUE_SIZE; i++){
+        queue->slots[i].sequence = i;
+    }
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+bool command_queue_push(command_queue_t *queue, const spa_command_t *command){
+    uint32_t position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    command_slot_t *slot;
+    for(;;){
+        slot = &queue->slots[position & COMMAND_QUEUE_MASK];
+        uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int32_t difference = (int32_t)(sequence - position);
+        if(difference == 0){
+            // Slot is free, claim the position. On failure position is reloaded with the current head
+            if(__atomic_compare_exchange_n(&queue->head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }else if(difference < 0){
+            // The consumer has not freed this slot yet, the ring is full
+            return false;
+        }else{
+            // Another producer claimed it first
+            position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->command = *command;
+    // Publish the command to the consumer
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool command_queue_pop(command_queue_t *queue, spa_command_t *command){
+    command_slot_t *slot = &queue->slots[queue->tail & COMMAND_QUEUE_MASK];
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if((int32_t)(sequence - (queue->tail + 1)) < 0){
+        // Empty, or the producer that claimed this slot is still writing it
+        return false;
+    }
+    *command = slot->command;
+    // Hand the slot back to producers one lap later
+    __atomic_store_n(&slot->sequence, queue->tail + COMMAND_QUEUE_SIZE, __ATOMIC_RELEASE);
+    queue->tail++;
+    return true;
+}
@@ -1,22 +1,112 @@
+#include <stddef.h>
+#include <string.h>
 #include "config.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "inc/snapshot.h"
 
-bool init_nvm(void){
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        err = nvs_flash_init();
+#define CONFIG_TASK_STACK_SIZE          (3072)
+#define CONFIG_TASK_PRIORITY            (1)
+#define CONFIG_KEY                      "config"
+
+// Layout of the NVS blob
+typedef struct {
+    uint16_t version;
+    uint16_t size;
+    spa_config_t config;
+    uint32_t crc;                       // CRC32 of everything above
+} config_blob_t;
+
+static snapshot_t config_snapshot;
+static spa_config_t config_copies[2];
+// Writers update this under the lock and publish it, readers only use the snapshot
+static spa_config_t config_current;
+static bool config_dirty = false;
+static portMUX_TYPE config_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t configTask = NULL;
+static uint32_t commits = 0;
+
+static void config_defaults(spa_config_t *config){
+    memset(config, 0, sizeof(*config));
+    config->setTemp = 37;
+    input_filter_default_params(&config->filter);
+    heater_pid_default_params(&config->heater);
+    config->schedule.circ_period_s = 3 * 60 * 60;
+    config->schedule.jets_time_s = 30 * 60;
+}
+
+static uint32_t config_crc(const config_blob_t *blob){
+    return esp_rom_crc32_le(0, (const uint8_t *)blob, offsetof(config_blob_t, crc));
+}
+
+// Settings saved by firmware that stored each value under its own key
+static bool migrate_legacy(nvs_handle_t handle, spa_config_t *config){
+    bool found = false;
+    int32_t temp = 0;
+    if(nvs_get_i32(handle, "setTemp", &temp) == ESP_OK && temp != 0){
+        config->setTemp = temp;
+        found = true;
     }
-    if(err != ESP_OK){
-        printf("Error (%s) initializing NVS!\n", esp_err_to_name(err));
+    input_filter_params_t filter;
+    size_t length = sizeof(filter);
+    if(nvs_get_blob(handle, "filter", &filter, &length) == ESP_OK && length == sizeof(filter)
+       && input_filter_params_valid(&filter)){
+        config->filter = filter;
+        found = true;
+    }
+    heater_pid_params_t heater;
+    length = sizeof(heater);
+    if(nvs_get_blob(handle, "heater", &heater, &length) == ESP_OK && length == sizeof(heater)
+       && heater_pid_params_valid(&heater)){
+        config->heater = heater;
+        found = true;
+    }
+    return found;
+}
+
+// Returns true when the loaded configuration differs from what is in flash
+static bool config_load(spa_config_t *config){
+    config_defaults(config);
+
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) {
+        printf("Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+        return false;
+    }
+    config_blob_t blob;
+    size_t length = sizeof(blob);
+    err = nvs_get_blob(my_handle, CONFIG_KEY, &blob, &length);
+    if(err == ESP_OK && length == sizeof(blob) && blob.version == SPA_CONFIG_VERSION
+       && blob.size == sizeof(spa_config_t) && blob.crc == config_crc(&blob)){
+        *config = blob.config;
+        nvs_close(my_handle);
         return false;
     }
+
+    if(err == ESP_ERR_NVS_NOT_FOUND){
+        bool migrated = migrate_legacy(my_handle, config);
+        printf("No stored config, %s\n", migrated ? "migrated old settings" : "using defaults");
+    }else{
+        printf("Stored config unusable (%s, version %d), using defaults\n", esp_err_to_name(err), blob.version);
+    }
+    nvs_close(my_handle);
     return true;
 }
 
-bool storeSetTemp(uint8_t temp){
+static bool config_commit(const spa_config_t *config){
+    config_blob_t blob;
+    memset(&blob, 0, sizeof(blob));
+    blob.version = SPA_CONFIG_VERSION;
+    blob.size = sizeof(spa_config_t);
+    blob.config = *config;
+    blob.crc = config_crc(&blob);
+
     esp_err_t err;
     nvs_handle_t my_handle;
     err = nvs_open("storage", NVS_READWRITE, &my_handle);
@@ -24,37 +114,124 @@ bool storeSetTemp(uint8_t temp){
         printf("Error (%s) opening NVS handle!\n", esp_err_to_name(err));
         return false;
     }
-    err = nvs_set_i32(my_handle, "setTemp", temp);
+    err = nvs_set_blob(my_handle, CONFIG_KEY, &blob, sizeof(blob));
     if(err != ESP_OK){
-        printf("Error (%s) setting setTemp in NVS!\n", esp_err_to_name(err));
+        printf("Error (%s) setting config in NVS!\n", esp_err_to_name(err));
         nvs_close(my_handle);
         return false;
     }
     err = nvs_commit(my_handle);
     if(err != ESP_OK){
-        printf("Error (%s) committing setTemp in NVS!\n", esp_err_to_name(err));
+        printf("Error (%s) committing config in NVS!\n", esp_err_to_name(err));
         nvs_close(my_handle);
         return false;
     }
     nvs_close(my_handle);
+    commits++;
     return true;
 }
 
-uint8_t fetchSetTemp(void){
-    esp_err_t err;
-    nvs_handle_t my_handle;
-    err = nvs_open("storage", NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        printf("Error (%s) opening NVS handle!\n", esp_err_to_name(err));
-        return 0;
+bool config_flush(void){
+    spa_config_t config;
+    taskENTER_CRITICAL(&config_lock);
+    bool dirty = config_dirty;
+    config_dirty = false;
+    config = config_current;
+    taskEXIT_CRITICAL(&config_lock);
+    if(!dirty){
+        return true;
+    }
+    if(!config_commit(&config)){
+        // Try again on the next change or flush
+        taskENTER_CRITICAL(&config_lock);
+        config_dirty = true;
+        taskEXIT_CRITICAL(&config_lock);
+        return false;
+    }
+    return true;
+}
+
+static void config_shutdown_handler(void){
+    config_flush();
+}
+
+// Copies a changed field into the RAM config, publishes it and restarts the commit delay
+static void config_modify(size_t offset, const void *value, size_t size){
+    taskENTER_CRITICAL(&config_lock);
+    bool changed = memcmp((uint8_t *)&config_current + offset, value, size) != 0;
+    if(changed){
+        memcpy((uint8_t *)&config_current + offset, value, size);
+        snapshot_publish(&config_snapshot, &config_current);
+        config_dirty = true;
+    }
+    taskEXIT_CRITICAL(&config_lock);
+    if(changed && configTask != NULL){
+        xTaskNotifyGive(configTask);
+    }
+}
+
+void config_get(spa_config_t *config){
+    snapshot_read(&config_snapshot, config);
+}
+
+uint8_t config_get_set_temp(void){
+    spa_config_t config;
+    config_get(&config);
+    return config.setTemp;
+}
+
+void config_set_set_temp(uint8_t temp){
+    config_modify(offsetof(spa_config_t, setTemp), &temp, sizeof(temp));
+}
+
+void config_set_filter_params(const input_filter_params_t *params){
+    config_modify(offsetof(spa_config_t, filter), params, sizeof(*params));
+}
+
+void config_set_heater_params(const heater_pid_params_t *params){
+    config_modify(offsetof(spa_config_t, heater), params, sizeof(*params));
+}
+
+void config_set_schedule(const spa_schedule_t *schedule){
+    config_modify(offsetof(spa_config_t, schedule), schedule, sizeof(*schedule));
+}
+
+void config_set_calibration(const spa_calibration_t *calibration){
+    config_modify(offsetof(spa_config_t, calibration), calibration, sizeof(*calibration));
+}
+
+// Flash writes can stall for tens of milliseconds, keep them away from BLE and control.
+// A burst of changes is written once, after the settings have been quiet for the commit delay.
+static void config_task(void *pvParameters){
+    for(;;){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_SPA_CONFIG_COMMIT_DELAY_MS)) != 0){
+            // Changed again, wait for it to settle
+        }
+        if(config_flush()){
+            ESP_LOGI("CONFIG", "Config committed, %u commits since boot", commits);
+        }
+    }
+}
+
+void init_config_task(void){
+    xTaskCreate(config_task, "Config", CONFIG_TASK_STACK_SIZE, NULL, CONFIG_TASK_PRIORITY, &configTask);
+    ESP_ERROR_CHECK(esp_register_shutdown_handler(config_shutdown_handler));
+}
+
+bool init_nvm(void){
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
     }
-    int32_t temp = 0;
-    err = nvs_get_i32(my_handle, "setTemp", &temp);
     if(err != ESP_OK){
-        printf("Error (%s) getting setTemp in NVS!\n", esp_err_to_name(err));
-        nvs_close(my_handle);
-        return 0;
+        printf("Error (%s) initializing NVS!\n", esp_err_to_name(err));
+        return false;
     }
-    nvs_close(my_handle);
-    return (uint8_t)temp;
+    snapshot_init(&config_snapshot, &config_copies[0], &config_copies[1], sizeof(spa_config_t));
+    // Written back by the config task once it is running
+    config_dirty = config_load(&config_current);
+    snapshot_publish(&config_snapshot, &config_current);
+    return true;
 }
@@ -0,0 +1,336 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "inc/gatt_conn.h"
+#include "inc/spa_state.h"
+
+static const char *TAG = "GATT_CONN";
+
+// Client configuration and notification rate limiting are kept per connection,
+// not in the attribute table of either host
+typedef struct {
+    bool in_use;
+    uint16_t conn_id;
+    uint16_t mtu;
+    uint16_t cccd[NUMBER_OF_NOTIFY];
+    uint32_t pending;                       // Values changed since they were last sent, bit per value
+    int64_t last_sent[NUMBER_OF_NOTIFY];
+    uint8_t addr[GATT_ADDR_LEN];
+    int64_t connected_at;                   // Reconnect timing, cleared once the first value went out
+} gatt_connection_t;
+
+static const gatt_conn_host_t *host = NULL;
+
+static gatt_connection_t connections[GATT_MAX_CONNECTIONS];
+static uint8_t values[NUMBER_OF_NOTIFY];    // Not used by telemetry, which is read from the spa state snapshot
+static uint32_t values_valid = 0;           // Bit per value, set once it has been set
+static portMUX_TYPE notify_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t notify_timer = NULL;
+
+static adv_status_t adv_status;             // What the advertising data carries now
+static int64_t adv_last_update = 0;
+static portMUX_TYPE adv_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t adv_timer = NULL;
+
+static void notify_timer_callback(void *arg)
+{
+    gatt_conn_flush();
+}
+
+static void adv_timer_callback(void *arg)
+{
+    gatt_conn_update_adv_status();
+}
+
+bool gatt_conn_init(const gatt_conn_host_t *gatt_host)
+{
+    host = gatt_host;
+
+    const esp_timer_create_args_t notify_timer_args = {
+        .callback = notify_timer_callback,
+        .name = "gatt_notify",
+    };
+    esp_err_t ret = esp_timer_create(&notify_timer_args, &notify_timer);
+    if (ret) {
+        ESP_LOGE(TAG, "notify timer create error, error code = %x", ret);
+        return false;
+    }
+
+    const esp_timer_create_args_t adv_timer_args = {
+        .callback = adv_timer_callback,
+        .name = "adv_update",
+    };
+    ret = esp_timer_create(&adv_timer_args, &adv_timer);
+    if (ret) {
+        ESP_LOGE(TAG, "adv timer create error, error code = %x", ret);
+        return false;
+    }
+    return true;
+}
+
+// Called with notify_lock held
+static gatt_connection_t *find_connection(uint16_t conn_id)
+{
+    for (int i = 0; i < GATT_MAX_CONNECTIONS; i++) {
+        if (connections[i].in_use && connections[i].conn_id == conn_id) {
+            return &connections[i];
+        }
+    }
+    return NULL;
+}
+
+int gatt_conn_add(uint16_t conn_id, const uint8_t addr[GATT_ADDR_LEN])
+{
+    int free_slots = 0;
+    bool added = false;
+    taskENTER_CRITICAL(&notify_lock);
+    for (int i = 0; i < GATT_MAX_CONNECTIONS; i++) {
+        if (connections[i].in_use) {
+            continue;
+        }
+        if (added) {
+            free_slots++;
+            continue;
+        }
+        memset(&connections[i], 0, sizeof(connections[i]));
+        connections[i].in_use = true;
+        connections[i].conn_id = conn_id;
+        connections[i].mtu = GATT_DEFAULT_MTU;
+        connections[i].connected_at = esp_timer_get_time();
+        memcpy(connections[i].addr, addr, GATT_ADDR_LEN);
+        added = true;
+    }
+    taskEXIT_CRITICAL(&notify_lock);
+    return added ? free_slots : -1;
+}
+
+void gatt_conn_remove(uint16_t conn_id)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    gatt_connection_t *conn = find_connection(conn_id);
+    if (conn != NULL) {
+        conn->in_use = false;
+    }
+    taskEXIT_CRITICAL(&notify_lock);
+}
+
+void gatt_conn_set_mtu(uint16_t conn_id, uint16_t mtu)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    gatt_connection_t *conn = find_connection(conn_id);
+    if (conn != NULL) {
+        conn->mtu = mtu;
+    }
+    taskEXIT_CRITICAL(&notify_lock);
+}
+
+bool gatt_conn_find_addr(const uint8_t addr[GATT_ADDR_LEN], uint16_t *conn_id)
+{
+    bool found = false;
+    taskENTER_CRITICAL(&notify_lock);
+    for (int i = 0; i < GATT_MAX_CONNECTIONS; i++) {
+        if (connections[i].in_use && memcmp(connections[i].addr, addr, GATT_ADDR_LEN) == 0) {
+            *conn_id = connections[i].conn_id;
+            found = true;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&notify_lock);
+    return found;
+}
+
+int64_t gatt_conn_connected_at(uint16_t conn_id)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    gatt_connection_t *conn = find_connection(conn_id);
+    int64_t connected_at = conn != NULL ? conn->connected_at : 0;
+    taskEXIT_CRITICAL(&notify_lock);
+    return connected_at;
+}
+
+uint16_t gatt_conn_cccd(uint16_t conn_id, int index)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    gatt_connection_t *conn = find_connection(conn_id);
+    uint16_t cccd = conn != NULL ? conn->cccd[index] : 0;
+    taskEXIT_CRITICAL(&notify_lock);
+    return cccd;
+}
+
+uint16_t gatt_conn_current_value(int index, uint8_t *buffer)
+{
+    if (index == NOTIFY_TELEMETRY) {
+        return spa_state_read((spa_state_t *)buffer) ? sizeof(spa_state_t) : 0;
+    }
+    taskENTER_CRITICAL(&notify_lock);
+    bool valid = values_valid & (1 << index);
+    buffer[0] = values[index];
+    taskEXIT_CRITICAL(&notify_lock);
+    return valid ? 1 : 0;
+}
+
+void gatt_conn_first_value(uint16_t conn_id)
+{
+    int64_t connected_at = 0;
+    taskENTER_CRITICAL(&notify_lock);
+    gatt_connection_t *conn = find_connection(conn_id);
+    if (conn != NULL) {
+        connected_at = conn->connected_at;
+        conn->connected_at = 0;
+    }
+    taskEXIT_CRITICAL(&notify_lock);
+    if (connected_at != 0) {
+        ESP_LOGI(TAG, "conn %d first value %lld ms after connect", conn_id,
+                 (esp_timer_get_time() - connected_at) / 1000);
+    }
+}
+
+// conn is a copy taken under notify_lock, the host is called without it
+static void send_value(const gatt_connection_t *conn, int index, const uint8_t *value, uint16_t length)
+{
+    uint16_t cccd = conn->cccd[index];
+    if (host == NULL || !(cccd & (GATT_CCCD_NOTIFY | GATT_CCCD_INDICATE))) {
+        return;
+    }
+    // Values that do not fit the negotiated MTU are left for the client to read
+    if (length > conn->mtu - 3) {
+        return;
+    }
+    host->send(conn->conn_id, index, value, length, (cccd & GATT_CCCD_INDICATE) != 0);
+    if (conn->connected_at != 0) {
+        gatt_conn_first_value(conn->conn_id);
+    }
+}
+
+void gatt_conn_subscribe(uint16_t conn_id, int index, uint16_t cccd)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    gatt_connection_t *conn = find_connection(conn_id);
+    if (conn != NULL) {
+        conn->cccd[index] = cccd;
+        conn->pending &= ~(1 << index);
+        conn->last_sent[index] = esp_timer_get_time();
+    }
+    gatt_connection_t subscriber = conn != NULL ? *conn : (gatt_connection_t){0};
+    taskEXIT_CRITICAL(&notify_lock);
+
+    // Give the new subscriber the current value straight away
+    uint8_t value[sizeof(spa_state_t)];
+    uint16_t length = gatt_conn_current_value(index, value);
+    if (subscriber.in_use && length != 0) {
+        send_value(&subscriber, index, value, length);
+    }
+}
+
+// Marks a value as changed for every subscribed connection, called with notify_lock held
+static void mark_pending(int index)
+{
+    for (int i = 0; i < GATT_MAX_CONNECTIONS; i++) {
+        if (connections[i].in_use && connections[i].cccd[index] != 0) {
+            connections[i].pending |= 1 << index;
+        }
+    }
+}
+
+bool gatt_conn_set_value(int index, uint8_t value)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    bool changed = !(values_valid & (1 << index)) || values[index] != value;
+    values[index] = value;
+    values_valid |= 1 << index;
+    if (changed) {
+        mark_pending(index);
+    }
+    taskEXIT_CRITICAL(&notify_lock);
+    return changed;
+}
+
+void gatt_conn_telemetry_changed(void)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    values_valid |= 1 << NOTIFY_TELEMETRY;
+    mark_pending(NOTIFY_TELEMETRY);
+    taskEXIT_CRITICAL(&notify_lock);
+    gatt_conn_flush();
+    gatt_conn_update_adv_status();
+}
+
+// Each value is read once and the same buffer goes to every connection
+void gatt_conn_flush(void)
+{
+    const int64_t interval = (int64_t)CONFIG_GATT_NOTIFY_MIN_INTERVAL_MS * 1000;
+    int64_t now = esp_timer_get_time();
+    int64_t next = INT64_MAX;
+    gatt_connection_t subscribers[GATT_MAX_CONNECTIONS];
+    uint32_t due[GATT_MAX_CONNECTIONS] = {0};
+    uint32_t any_due = 0;
+
+    taskENTER_CRITICAL(&notify_lock);
+    for (int j = 0; j < GATT_MAX_CONNECTIONS; j++) {
+        gatt_connection_t *conn = &connections[j];
+        for (int i = 0; conn->in_use && i < NUMBER_OF_NOTIFY; i++) {
+            if (!(conn->pending & (1 << i))) {
+                continue;
+            }
+            if (now - conn->last_sent[i] >= interval) {
+                conn->pending &= ~(1 << i);
+                conn->last_sent[i] = now;
+                due[j] |= 1 << i;
+            } else if (conn->last_sent[i] + interval < next) {
+                next = conn->last_sent[i] + interval;
+            }
+        }
+        any_due |= due[j];
+    }
+    memcpy(subscribers, connections, sizeof(subscribers));
+    taskEXIT_CRITICAL(&notify_lock);
+
+    for (int i = 0; i < NUMBER_OF_NOTIFY; i++) {
+        uint8_t value[sizeof(spa_state_t)];
+        uint16_t length;
+        if (!(any_due & (1 << i)) || (length = gatt_conn_current_value(i, value)) == 0) {
+            continue;
+        }
+        for (int j = 0; j < GATT_MAX_CONNECTIONS; j++) {
+            if (subscribers[j].in_use && (due[j] & (1 << i))) {
+                send_value(&subscribers[j], i, value, length);
+            }
+        }
+    }
+
+    if (next != INT64_MAX && notify_timer != NULL) {
+        esp_timer_stop(notify_timer);
+        esp_timer_start_once(notify_timer, next - now);
+    }
+}
+
+// The controller swaps the data in while advertising continues
+void gatt_conn_update_adv_status(void)
+{
+    const int64_t interval = (int64_t)CONFIG_BLE_ADV_UPDATE_MIN_INTERVAL_MS * 1000;
+    int64_t now = esp_timer_get_time();
+    spa_state_t state;
+    if (host == NULL || !spa_state_read(&state)) {
+        return;
+    }
+
+    adv_status_t status;
+    adv_status_from_state(&state, &status);
+
+    taskENTER_CRITICAL(&adv_lock);
+    bool changed = memcmp(&adv_status, &status, sizeof(status)) != 0;
+    bool due = changed && now - adv_last_update >= interval;
+    if (due) {
+        adv_status = status;
+        adv_last_update = now;
+    }
+    taskEXIT_CRITICAL(&adv_lock);
+
+    if (due) {
+        host->set_adv_status(&status);
+    } else if (changed && adv_timer != NULL && !esp_timer_is_active(adv_timer)) {
+        esp_timer_start_once(adv_timer, adv_last_update + interval - now);
+    }
+}
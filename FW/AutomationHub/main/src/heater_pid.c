@@ -0,0 +1,153 @@
+#include "inc/heater_pid.h"
+
+#define INTEGRATOR_SHIFT    (16)
+#define INTEGRATOR_MAX      ((int64_t)HEATER_DUTY_MAX << INTEGRATOR_SHIFT)
+#define MS_PER_MINUTE       (60000)
+// Longest gap between samples that is integrated, keeps the fixed point step in range
+#define MAX_DT_MS           (60000)
+
+void heater_pid_default_params(heater_pid_params_t *params){
+    // Full power 2 degrees below the set point, holding power builds up over tens of minutes
+    params->kp = 500;
+    params->ki = 10;
+    params->kd = 0;
+    // Spa water moves slowly, a 30 minute window keeps the relay to about two cycles an hour.
+    // Longer windows cut the cycles but overshoot by degrees once a full power window ends
+    // past the set point, fewer cycles than the hysteresis control would need a swing as wide.
+    params->window_ms = 1800000;
+    params->min_on_ms = 180000;
+    params->min_off_ms = 180000;
+}
+
+bool heater_pid_params_valid(const heater_pid_params_t *params){
+    if(params->window_ms == 0 || params->window_ms > 3600000){
+        return false;
+    }
+    if(params->min_on_ms + params->min_off_ms > params->window_ms){
+        return false;
+    }
+    return true;
+}
+
+void heater_pid_configure(heater_pid_t *pid, const heater_pid_params_t *params){
+    pid->params = *params;
+    // Picks up the new window length straight away
+    pid->windowActive = false;
+}
+
+int32_t heater_pid_update(heater_pid_t *pid, int32_t setpoint_centi, int32_t temp_centi, uint32_t now_ms, bool enabled){
+    const heater_pid_params_t *params = &pid->params;
+    uint32_t dt = pid->updated ? now_ms - pid->lastUpdate : 0;
+    if(dt > MAX_DT_MS){
+        dt = MAX_DT_MS;
+    }
+
+    if(setpoint_centi != pid->setpoint){
+        pid->setpoint = setpoint_centi;
+        pid->setpointTime = now_ms;
+        pid->reached = false;
+        pid->stats.overshoot = 0;
+        pid->stats.reach_ms = 0;
+    }
+    if(!pid->reached && temp_centi >= setpoint_centi){
+        pid->reached = true;
+        pid->stats.reach_ms = now_ms - pid->setpointTime;
+    }
+    if(pid->reached && temp_centi - setpoint_centi > pid->stats.overshoot){
+        pid->stats.overshoot = temp_centi - setpoint_centi;
+    }
+
+    // Idle, circulation and jets would otherwise wind the integrator up to full duty
+    // while the water cools with the heater off
+    if(!enabled){
+        pid->duty = 0;
+        pid->lastTemp = temp_centi;
+        pid->lastUpdate = now_ms;
+        pid->updated = true;
+        return 0;
+    }
+
+    int32_t error = setpoint_centi - temp_centi;
+    int32_t p = (int32_t)params->kp * error / 100;
+    int32_t d = 0;
+    if(dt > 0 && params->kd != 0){
+        // On the measurement so a set point change does not kick the output
+        int64_t slope = (int64_t)(temp_centi - pid->lastTemp) * MS_PER_MINUTE / dt;
+        d = (int32_t)(-(int64_t)params->kd * slope / 100);
+    }
+
+    // Anti-windup, only integrate while the output is not pinned in the direction of the error
+    int32_t output = p + (pid->integrator >> INTEGRATOR_SHIFT) + d;
+    bool pinned = (output >= HEATER_DUTY_MAX && error > 0) || (output <= 0 && error < 0);
+    if(dt > 0 && !pinned){
+        int64_t integrator = pid->integrator;
+        integrator += (int64_t)params->ki * error * dt * (1 << INTEGRATOR_SHIFT) / (100LL * MS_PER_MINUTE);
+        // The heater can only add heat, so the integrator never goes negative
+        if(integrator < 0){
+            integrator = 0;
+        }else if(integrator > INTEGRATOR_MAX){
+            integrator = INTEGRATOR_MAX;
+        }
+        pid->integrator = (int32_t)integrator;
+        output = p + (pid->integrator >> INTEGRATOR_SHIFT) + d;
+    }
+
+    if(output < 0){
+        output = 0;
+    }else if(output > HEATER_DUTY_MAX){
+        output = HEATER_DUTY_MAX;
+    }
+    pid->duty = output;
+    pid->lastTemp = temp_centi;
+    pid->lastUpdate = now_ms;
+    pid->updated = true;
+    return output;
+}
+
+static void switchRelay(heater_pid_t *pid, bool on, uint32_t now_ms){
+    if(on && !pid->relayOn){
+        pid->stats.cycles++;
+    }
+    pid->relayOn = on;
+    pid->lastSwitch = now_ms;
+    pid->switched = true;
+}
+
+bool heater_pid_relay(heater_pid_t *pid, uint32_t now_ms, bool enabled){
+    const heater_pid_params_t *params = &pid->params;
+
+    if(!enabled){
+        if(pid->relayOn){
+            switchRelay(pid, false, now_ms);
+        }
+        pid->windowActive = false;
+        return false;
+    }
+
+    if(!pid->windowActive || now_ms - pid->windowStart >= params->window_ms){
+        pid->windowStart = now_ms;
+        pid->windowActive = true;
+        uint32_t onTime = (uint32_t)pid->duty * params->window_ms / HEATER_DUTY_MAX;
+        // Pulses too short to respect the minimum times are rounded to fully off or fully on
+        if(onTime < params->min_on_ms){
+            onTime = 0;
+        }else if(params->window_ms - onTime < params->min_off_ms){
+            onTime = params->window_ms;
+        }
+        pid->onTime = onTime;
+    }
+
+    bool want = now_ms - pid->windowStart < pid->onTime;
+    if(want != pid->relayOn){
+        // The minimum times also hold across window boundaries
+        uint32_t minimum = pid->relayOn ? params->min_on_ms : params->min_off_ms;
+        if(!pid->switched || now_ms - pid->lastSwitch >= minimum){
+            switchRelay(pid, want, now_ms);
+        }
+    }
+    return pid->relayOn;
+}
+
+void heater_pid_get_stats(const heater_pid_t *pid, heater_pid_stats_t *stats){
+    *stats = pid->stats;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "inc/input_manager.h"
+
+#if CONFIG_INPUT_BACKEND_AD7091R5
+#include "driver/i2c.h"
+#include "driver/gpio.h"
+#include "inc/ad7091r5.h"
+
+const static char *TAG = "AD7091R5";
+
+#define AD7091R5_I2C_PORT           I2C_NUM_0
+#define AD7091R5_I2C_TIMEOUT_MS     (10)
+#define AD7091R5_VREF_MV            (2500)
+#define AD7091R5_HYSTERESIS_MV      (50)
+#define AD7091R5_BURST_CONVERSIONS  (CONFIG_AD7091R5_OVERSAMPLE * AD7091R5_NUM_CHANNELS)
+
+#define MV_TO_CODE(mv)              ((uint16_t)(((mv) * (AD7091R5_MAX_CODE + 1)) / AD7091R5_VREF_MV))
+#define CODE_TO_MV(code)            (((code) * AD7091R5_VREF_MV) / (AD7091R5_MAX_CODE + 1))
+
+static TaskHandle_t ad7091r5_task_handle = NULL;
+
+static bool i2c_bus_write(void *ctx, uint8_t address, const uint8_t *data, size_t length)
+{
+    return i2c_master_write_to_device(AD7091R5_I2C_PORT, address, data, length,
+                                      pdMS_TO_TICKS(AD7091R5_I2C_TIMEOUT_MS)) == ESP_OK;
+}
+
+static bool i2c_bus_write_read(void *ctx, uint8_t address, const uint8_t *write_data, size_t write_length,
+                               uint8_t *read_data, size_t read_length)
+{
+    return i2c_master_write_read_device(AD7091R5_I2C_PORT, address, write_data, write_length, read_data, read_length,
+                                        pdMS_TO_TICKS(AD7091R5_I2C_TIMEOUT_MS)) == ESP_OK;
+}
+
+static const ad7091r5_bus_t i2c_bus = {
+    .write = i2c_bus_write,
+    .write_read = i2c_bus_write_read,
+    .ctx = NULL,
+};
+
+static void IRAM_ATTR alert_isr_handler(void *arg)
+{
+    BaseType_t mustYield = pdFALSE;
+    vTaskNotifyGiveFromISR(ad7091r5_task_handle, &mustYield);
+    if (mustYield == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static void init_i2c(void)
+{
+    i2c_config_t conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = CONFIG_AD7091R5_I2C_SDA_GPIO,
+        .scl_io_num = CONFIG_AD7091R5_I2C_SCL_GPIO,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = CONFIG_AD7091R5_I2C_FREQ_HZ,
+    };
+    ESP_ERROR_CHECK(i2c_param_config(AD7091R5_I2C_PORT, &conf));
+    ESP_ERROR_CHECK(i2c_driver_install(AD7091R5_I2C_PORT, conf.mode, 0, 0, 0));
+}
+
+static void init_alert_pin(void)
+{
+    // ALERT is active low, a falling edge means a channel crossed its limits
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_NEGEDGE,
+        .mode = GPIO_MODE_INPUT,
+        .pin_bit_mask = (1ULL << CONFIG_AD7091R5_ALERT_GPIO),
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&io_conf));
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(CONFIG_AD7091R5_ALERT_GPIO, alert_isr_handler, NULL));
+}
+
+void ad7091r5_input_task(void *pvParameters)
+{
+    static uint8_t burst[AD7091R5_BURST_CONVERSIONS * 2];
+    int raw[NUMBER_OF_INPUTS] = {0};
+    int voltage[NUMBER_OF_INPUTS] = {0};
+    ad7091r5_t adc;
+
+    ad7091r5_task_handle = xTaskGetCurrentTaskHandle();
+    init_i2c();
+
+    if (!ad7091r5_init(&adc, &i2c_bus, CONFIG_AD7091R5_I2C_ADDRESS, (1 << NUMBER_OF_INPUTS) - 1)) {
+        ESP_LOGE(TAG, "AD7091R-5 not responding at 0x%02x", CONFIG_AD7091R5_I2C_ADDRESS);
+        vTaskDelete(NULL);
+    }
+    for (int i = 0; i < NUMBER_OF_INPUTS; i++) {
+        ad7091r5_set_limits(&adc, i, MV_TO_CODE(CONFIG_AD7091R5_ALERT_LOW_MV), MV_TO_CODE(CONFIG_AD7091R5_ALERT_HIGH_MV),
+                            MV_TO_CODE(AD7091R5_HYSTERESIS_MV));
+    }
+    init_alert_pin();
+
+    uint16_t alerts = 0;
+    while (1) {
+        // Sleeps for the publish period unless the ALERT pin fires first
+        bool alerted = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_INPUT_PUBLISH_PERIOD_MS)) != 0;
+
+        uint32_t sum[AD7091R5_NUM_CHANNELS] = {0};
+        uint32_t count[AD7091R5_NUM_CHANNELS] = {0};
+        if (!ad7091r5_read_burst(&adc, burst, AD7091R5_BURST_CONVERSIONS, sum, count)) {
+            ESP_LOGW(TAG, "Burst read failed");
+            continue;
+        }
+        for (int i = 0; i < NUMBER_OF_INPUTS; i++) {
+            if (count[i] == 0) {
+                continue;
+            }
+            raw[i] = (sum[i] + count[i] / 2) / count[i];
+            voltage[i] = CODE_TO_MV(raw[i]);
+        }
+
+        // The alert register is only read after an interrupt, and then each cycle until the limits clear
+        if (alerted || alerts != 0) {
+            if (!ad7091r5_read_alerts(&adc, &alerts)) {
+                ESP_LOGW(TAG, "Alert register read failed");
+            }
+        }
+        set_state(voltage, raw, alerts);
+    }
+}
+
+#endif // CONFIG_INPUT_BACKEND_AD7091R5
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "inc/input_filter.h"
+
+#define NOISE_SHIFT     (4)
+
+void input_filter_default_params(input_filter_params_t *params){
+    for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+        params->median_len[i] = 5;
+        params->ema_shift[i] = 2;
+        params->slew_limit[i] = 0;
+    }
+}
+
+bool input_filter_params_valid(const input_filter_params_t *params){
+    for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+        if(params->median_len[i] == 0 || params->median_len[i] > INPUT_FILTER_MEDIAN_MAX || !(params->median_len[i] & 1)){
+            return false;
+        }
+        if(params->ema_shift[i] > INPUT_FILTER_EMA_SHIFT_MAX){
+            return false;
+        }
+    }
+    return true;
+}
+
+void input_filter_configure(input_filter_t *filter, const input_filter_params_t *params){
+    memset(filter, 0, sizeof(*filter));
+    filter->params = *params;
+}
+
+// Median of the newest length samples, pos is the slot the next sample will be written to
+static int32_t median(const int32_t window[INPUT_FILTER_MEDIAN_MAX][NUMBER_OF_INPUTS], int pos, int channel, int length){
+    int32_t sorted[INPUT_FILTER_MEDIAN_MAX];
+    // Insertion sort, the window is at most 7 long
+    for(int i = 0; i < length; i++){
+        int slot = (pos + INPUT_FILTER_MEDIAN_MAX - 1 - i) % INPUT_FILTER_MEDIAN_MAX;
+        int32_t value = window[slot][channel];
+        int j = i;
+        while(j > 0 && sorted[j - 1] > value){
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+    return sorted[length / 2];
+}
+
+void input_filter_process(input_filter_t *filter, const int *input, int *output, int *noise){
+    const input_filter_params_t *params = &filter->params;
+    int32_t stage[NUMBER_OF_INPUTS];
+
+    // Spike rejection, the window is shared by every channel
+    for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+        filter->window[filter->window_pos][i] = input[i];
+    }
+    filter->window_pos = (filter->window_pos + 1) % INPUT_FILTER_MEDIAN_MAX;
+    if(filter->window_fill < INPUT_FILTER_MEDIAN_MAX){
+        filter->window_fill++;
+    }
+    for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+        int length = params->median_len[i];
+        if(length > filter->window_fill){
+            // Not enough history yet, use the widest odd window available
+            length = (filter->window_fill - 1) | 1;
+        }
+        stage[i] = (length <= 1) ? input[i] : median(filter->window, filter->window_pos, i, length);
+    }
+
+    if(!filter->primed){
+        for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+            filter->ema[i] = stage[i] * 256;
+            filter->output[i] = stage[i];
+            filter->noise[i] = 0;
+        }
+        filter->primed = true;
+    }
+
+    for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+        // Fixed point EMA
+        filter->ema[i] += ((stage[i] * 256) - filter->ema[i]) >> params->ema_shift[i];
+        int32_t smoothed = (filter->ema[i] + 128) >> 8;
+
+        // Noise estimate: smoothed mean absolute deviation of the de-spiked input from the EMA
+        int32_t deviation = (stage[i] * 256) - filter->ema[i];
+        if(deviation < 0){
+            deviation = -deviation;
+        }
+        filter->noise[i] += (deviation - filter->noise[i]) >> NOISE_SHIFT;
+
+        // Rate of change limit
+        int32_t limit = params->slew_limit[i];
+        if(limit != 0){
+            int32_t step = smoothed - filter->output[i];
+            if(step > limit){
+                smoothed = filter->output[i] + limit;
+            }else if(step < -limit){
+                smoothed = filter->output[i] - limit;
+            }
+        }
+        filter->output[i] = smoothed;
+
+        output[i] = smoothed;
+        noise[i] = (filter->noise[i] + 128) >> 8;
+    }
+}
@@ -10,17 +10,136 @@
 #include "freertos/task.h"
 #include "soc/soc_caps.h"
 #include "esp_log.h"
-#include "esp_adc/adc_oneshot.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#if CONFIG_INPUT_BACKEND_ESP32_ADC
+#include "esp_adc/adc_continuous.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
-#include "freertos/queue.h"
+#endif
 #include "inc/input_manager.h"
-
-const static char *TAG = "EXAMPLE";
+#include "inc/snapshot.h"
+#include "inc/input_filter.h"
+#include "inc/config.h"
 
 #define INPUT_TASK_STACK_SIZE    (2048)
 #define INPUT_TASK_PRIORITY      (10)
 
+static input_state_t input_state_copies[2];
+static snapshot_t input_state_snapshot;
+
+typedef struct {
+    TaskHandle_t task;
+    uint32_t notify_bits;
+    int deadband;
+    int last[NUMBER_OF_INPUTS];
+    uint16_t last_alerts;
+    bool primed;
+} input_subscriber_t;
+
+static input_subscriber_t subscribers[INPUT_MAX_SUBSCRIBERS];
+static volatile uint32_t subscriber_count = 0;
+static portMUX_TYPE subscribe_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static input_filter_t input_filter;
+// New filter parameters are handed to the input task rather than applied mid sample
+static input_filter_params_t pending_filter_params;
+static bool filter_params_pending = false;
+static portMUX_TYPE filter_params_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool input_set_filter_params(const input_filter_params_t *params)
+{
+    if (!input_filter_params_valid(params)) {
+        return false;
+    }
+    taskENTER_CRITICAL(&filter_params_lock);
+    pending_filter_params = *params;
+    filter_params_pending = true;
+    taskEXIT_CRITICAL(&filter_params_lock);
+    config_set_filter_params(params);
+    return true;
+}
+
+void input_get_filter_params(input_filter_params_t *params)
+{
+    taskENTER_CRITICAL(&filter_params_lock);
+    *params = filter_params_pending ? pending_filter_params : input_filter.params;
+    taskEXIT_CRITICAL(&filter_params_lock);
+}
+
+bool input_subscribe(TaskHandle_t task, uint32_t notify_bits, int deadband_mV)
+{
+    bool added = false;
+    taskENTER_CRITICAL(&subscribe_lock);
+    uint32_t index = subscriber_count;
+    if (index < INPUT_MAX_SUBSCRIBERS) {
+        subscribers[index].task = task;
+        subscribers[index].notify_bits = notify_bits;
+        subscribers[index].deadband = deadband_mV;
+        subscribers[index].last_alerts = 0;
+        // Always notified on the first sample
+        subscribers[index].primed = false;
+        // The input task only looks at entries below the count, publish the entry first
+        __atomic_store_n(&subscriber_count, index + 1, __ATOMIC_RELEASE);
+        added = true;
+    }
+    taskEXIT_CRITICAL(&subscribe_lock);
+    return added;
+}
+
+static void notify_subscribers(const input_state_t *state)
+{
+    uint32_t count = __atomic_load_n(&subscriber_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        input_subscriber_t *subscriber = &subscribers[i];
+        bool changed = !subscriber->primed || state->alerts != subscriber->last_alerts;
+        for (int j = 0; j < NUMBER_OF_INPUTS && !changed; j++) {
+            changed = abs(state->filtered[j] - subscriber->last[j]) >= subscriber->deadband;
+        }
+        if (!changed) {
+            continue;
+        }
+        memcpy(subscriber->last, state->filtered, sizeof(subscriber->last));
+        subscriber->last_alerts = state->alerts;
+        subscriber->primed = true;
+        xTaskNotify(subscriber->task, subscriber->notify_bits, eSetBits);
+    }
+}
+
+void set_state(int * voltage, int * raw, uint16_t alerts)
+{
+    static uint32_t sequence = 0;
+    input_state_t state;
+
+    if (filter_params_pending) {
+        input_filter_params_t params;
+        taskENTER_CRITICAL(&filter_params_lock);
+        params = pending_filter_params;
+        filter_params_pending = false;
+        taskEXIT_CRITICAL(&filter_params_lock);
+        input_filter_configure(&input_filter, &params);
+    }
+
+    memcpy(state.voltage, voltage, sizeof(int) * NUMBER_OF_INPUTS);
+    memcpy(state.raw, raw, sizeof(int) * NUMBER_OF_INPUTS);
+    input_filter_process(&input_filter, voltage, state.filtered, state.noise);
+    state.alerts = alerts;
+    state.sequence = ++sequence;
+    state.timestamp_us = esp_timer_get_time();
+
+    snapshot_publish(&input_state_snapshot, &state);
+    notify_subscribers(&state);
+}
+
+// Copies the newest complete sample, never blocks. Returns false until the first sample is published.
+bool get_state(input_state_t * state)
+{
+    return snapshot_read(&input_state_snapshot, state) != 0;
+}
+
+#if CONFIG_INPUT_BACKEND_ESP32_ADC
+const static char *TAG = "EXAMPLE";
+
 /*---------------------------------------------------------------
         ADC General Macros
 ---------------------------------------------------------------*/
@@ -33,93 +152,155 @@ const static char *TAG = "EXAMPLE";
 
 #define EXAMPLE_ADC_ATTEN           ADC_ATTEN_DB_11
 
+#define INPUT_SAMPLE_FREQ_HZ        CONFIG_INPUT_SAMPLE_FREQ_HZ
+#define INPUT_FRAME_BYTES           (CONFIG_INPUT_FRAME_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES)
+#define INPUT_PUBLISH_PERIOD_MS     CONFIG_INPUT_PUBLISH_PERIOD_MS
+// Number of samples per channel that make up one published average
+#define INPUT_SAMPLES_PER_PUBLISH   ((INPUT_SAMPLE_FREQ_HZ / NUMBER_OF_INPUTS) * INPUT_PUBLISH_PERIOD_MS / 1000)
+
+static const adc_channel_t input_channels[NUMBER_OF_INPUTS] = {
+    [eInput1] = ADC_INPUT_1,
+    [eInput2] = ADC_INPUT_2,
+    [eInput3] = ADC_INPUT_3,
+    [eInput4] = ADC_INPUT_4,
+};
+
+// Maps an ADC1 channel number from the DMA result back to its input index, -1 if unused
+static int8_t channel_to_input[SOC_ADC_CHANNEL_NUM(ADC_UNIT_1)];
+
 static int adc_raw[4];
 static int voltage[4];
 static bool example_adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle);
 static void example_adc_calibration_deinit(adc_cali_handle_t handle);
-static QueueHandle_t input_state_queue = NULL;
+static TaskHandle_t input_task_handle = NULL;
 
-bool set_state(int * voltage, int * raw)
+static bool IRAM_ATTR adc_conv_done_cb(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
 {
-    if(input_state_queue == NULL) {
-        printf("Input state queue not initialized.\n");
-        return false;
-    }
-    input_state_t state;
-    memcpy(state.voltage, voltage, sizeof(int) * NUMBER_OF_INPUTS);
-    memcpy(state.raw, raw, sizeof(int) * NUMBER_OF_INPUTS);
-    
-    return xQueueSend(input_state_queue, &state, 0);
+    BaseType_t mustYield = pdFALSE;
+    // Wake the input task, the frame is decimated there rather than in the ISR
+    vTaskNotifyGiveFromISR(input_task_handle, &mustYield);
+    return (mustYield == pdTRUE);
 }
 
-bool get_state(input_state_t * state)
+static void continuous_adc_init(adc_continuous_handle_t *out_handle)
 {
-    if(xQueueReceive(input_state_queue, state, 0)) {
-        return true;
-    } else {
-        return false;
+    adc_continuous_handle_t handle = NULL;
+
+    adc_continuous_handle_cfg_t adc_config = {
+        .max_store_buf_size = INPUT_FRAME_BYTES * 4,
+        .conv_frame_size = INPUT_FRAME_BYTES,
+    };
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&adc_config, &handle));
+
+    // One pattern entry per input, the DMA engine cycles through them round robin
+    adc_digi_pattern_config_t adc_pattern[SOC_ADC_PATT_LEN_MAX] = {0};
+    memset(channel_to_input, -1, sizeof(channel_to_input));
+    for (int i = 0; i < NUMBER_OF_INPUTS; i++) {
+        adc_pattern[i].atten = EXAMPLE_ADC_ATTEN;
+        adc_pattern[i].channel = input_channels[i] & 0x7;
+        adc_pattern[i].unit = ADC_UNIT_1;
+        adc_pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        channel_to_input[input_channels[i]] = i;
     }
+
+    adc_continuous_config_t dig_cfg = {
+        .pattern_num = NUMBER_OF_INPUTS,
+        .adc_pattern = adc_pattern,
+        .sample_freq_hz = INPUT_SAMPLE_FREQ_HZ,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+    };
+    ESP_ERROR_CHECK(adc_continuous_config(handle, &dig_cfg));
+
+    adc_continuous_evt_cbs_t cbs = {
+        .on_conv_done = adc_conv_done_cb,
+    };
+    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(handle, &cbs, NULL));
+
+    *out_handle = handle;
 }
 
-void read_adc(adc_oneshot_unit_handle_t adc1_handle, adc_cali_handle_t adc1_cali_handle, int channel, uint8_t inputNumber, int * voltage, int * raw)
+// Accumulates every conversion of a DMA frame into the per channel sums in a single pass
+static void accumulate_frame(const uint8_t *frame, uint32_t length, uint32_t *sum, uint32_t *count)
 {
-    ESP_ERROR_CHECK(adc_oneshot_read(adc1_handle, channel, &raw[inputNumber]));
-    //ESP_LOGI(TAG, "ADC%d Channel[%d] Raw Data: %d", ADC_UNIT_1 + 1, channel, adc_raw[inputNumber]);
-    ESP_ERROR_CHECK(adc_cali_raw_to_voltage(adc1_cali_handle, adc_raw[inputNumber], &voltage[inputNumber]));
-    //ESP_LOGI(TAG, "ADC%d Channel[%d] Cali Voltage: %d mV", ADC_UNIT_1 + 1, channel, voltage[inputNumber]);
+    for (uint32_t i = 0; i < length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        const adc_digi_output_data_t *p = (const adc_digi_output_data_t *)&frame[i];
+        uint32_t channel = p->type1.channel;
+        if (channel >= SOC_ADC_CHANNEL_NUM(ADC_UNIT_1)) {
+            continue;
+        }
+        int8_t input = channel_to_input[channel];
+        if (input < 0) {
+            continue;
+        }
+        sum[input] += p->type1.data;
+        count[input]++;
+    }
 }
 
 void input_manager_task(void *pvParameters)
 {
-    // //-------------ADC1 Init---------------//
-    adc_oneshot_unit_handle_t adc1_handle;
-    adc_oneshot_unit_init_cfg_t init_config1 = {
-        .unit_id = ADC_UNIT_1,
-    };
-    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &adc1_handle));
+    static uint8_t frame[INPUT_FRAME_BYTES];
+    uint32_t sum[NUMBER_OF_INPUTS] = {0};
+    uint32_t count[NUMBER_OF_INPUTS] = {0};
 
-    // //-------------ADC1 Config---------------//
-    adc_oneshot_chan_cfg_t config = {
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-        .atten = EXAMPLE_ADC_ATTEN,
-    };
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, ADC_INPUT_1, &config));
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, ADC_INPUT_2, &config));
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, ADC_INPUT_3, &config));
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, ADC_INPUT_4, &config));
+    // Set before the ADC starts so the conversion callback always has a task to notify
+    input_task_handle = xTaskGetCurrentTaskHandle();
 
     //-------------ADC1 Calibration Init---------------//
-    adc_cali_handle_t adc1_cali_chan0_handle = NULL;
-    adc_cali_handle_t adc1_cali_chan1_handle = NULL;
-    adc_cali_handle_t adc1_cali_chan2_handle = NULL;
-    adc_cali_handle_t adc1_cali_chan3_handle = NULL;
-    bool do_calibration1_chan0 = example_adc_calibration_init(ADC_UNIT_1, ADC_INPUT_1, EXAMPLE_ADC_ATTEN, &adc1_cali_chan0_handle);
-    bool do_calibration1_chan1 = example_adc_calibration_init(ADC_UNIT_1, ADC_INPUT_2, EXAMPLE_ADC_ATTEN, &adc1_cali_chan1_handle);
-    bool do_calibration1_chan2 = example_adc_calibration_init(ADC_UNIT_1, ADC_INPUT_3, EXAMPLE_ADC_ATTEN, &adc1_cali_chan2_handle);
-    bool do_calibration1_chan3 = example_adc_calibration_init(ADC_UNIT_1, ADC_INPUT_4, EXAMPLE_ADC_ATTEN, &adc1_cali_chan3_handle);
+    adc_cali_handle_t adc1_cali_handle[NUMBER_OF_INPUTS] = {NULL};
+    bool do_calibration1[NUMBER_OF_INPUTS];
+    for (int i = 0; i < NUMBER_OF_INPUTS; i++) {
+        do_calibration1[i] = example_adc_calibration_init(ADC_UNIT_1, input_channels[i], EXAMPLE_ADC_ATTEN, &adc1_cali_handle[i]);
+    }
+
+    //-------------ADC1 Continuous Init---------------//
+    adc_continuous_handle_t adc1_handle = NULL;
+    continuous_adc_init(&adc1_handle);
+    ESP_ERROR_CHECK(adc_continuous_start(adc1_handle));
 
     while (1) {
-        read_adc(adc1_handle, adc1_cali_chan0_handle, ADC_INPUT_1, eInput1, voltage, adc_raw);
-        read_adc(adc1_handle, adc1_cali_chan1_handle, ADC_INPUT_2, eInput2, voltage, adc_raw);
-        read_adc(adc1_handle, adc1_cali_chan2_handle, ADC_INPUT_3, eInput3, voltage, adc_raw);
-        read_adc(adc1_handle, adc1_cali_chan3_handle, ADC_INPUT_4, eInput4, voltage, adc_raw);
-        set_state(voltage, adc_raw);
-        vTaskDelay(pdMS_TO_TICKS(1000));        
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Drain every frame that is ready, the notification may cover several
+        for (;;) {
+            uint32_t length = 0;
+            esp_err_t ret = adc_continuous_read(adc1_handle, frame, INPUT_FRAME_BYTES, &length, 0);
+            if (ret == ESP_ERR_TIMEOUT) {
+                break;
+            }
+            if (ret != ESP_OK) {
+                ESP_LOGW(TAG, "ADC read failed: %s", esp_err_to_name(ret));
+                break;
+            }
+            accumulate_frame(frame, length, sum, count);
+        }
+
+        // Decimate once enough samples have been collected for the publish period
+        if (count[eInput1] < INPUT_SAMPLES_PER_PUBLISH) {
+            continue;
+        }
+        for (int i = 0; i < NUMBER_OF_INPUTS; i++) {
+            if (count[i] == 0) {
+                continue;
+            }
+            adc_raw[i] = (sum[i] + count[i] / 2) / count[i];
+            if (do_calibration1[i]) {
+                ESP_ERROR_CHECK(adc_cali_raw_to_voltage(adc1_cali_handle[i], adc_raw[i], &voltage[i]));
+            }
+            sum[i] = 0;
+            count[i] = 0;
+        }
+        set_state(voltage, adc_raw, 0);
     }
 
     //Tear Down
-    ESP_ERROR_CHECK(adc_oneshot_del_unit(adc1_handle));
-    if (do_calibration1_chan0) {
-        example_adc_calibration_deinit(adc1_cali_chan0_handle);
-    }
-    if (do_calibration1_chan1) {
-        example_adc_calibration_deinit(adc1_cali_chan1_handle);
-    }
-    if (do_calibration1_chan2) {
-        example_adc_calibration_deinit(adc1_cali_chan2_handle);
-    }
-    if (do_calibration1_chan3) {
-        example_adc_calibration_deinit(adc1_cali_chan3_handle);
+    ESP_ERROR_CHECK(adc_continuous_stop(adc1_handle));
+    ESP_ERROR_CHECK(adc_continuous_deinit(adc1_handle));
+    for (int i = 0; i < NUMBER_OF_INPUTS; i++) {
+        if (do_calibration1[i]) {
+            example_adc_calibration_deinit(adc1_cali_handle[i]);
+        }
     }
 }
 
@@ -188,8 +369,20 @@ static void example_adc_calibration_deinit(adc_cali_handle_t handle)
 #endif
 }
 
+#endif // CONFIG_INPUT_BACKEND_ESP32_ADC
+
 void init_input_task(void)
 {
-    input_state_queue = xQueueCreate(1, sizeof(input_state_t));
+    spa_config_t config;
+    config_get(&config);
+    if (!input_filter_params_valid(&config.filter)) {
+        input_filter_default_params(&config.filter);
+    }
+    input_filter_configure(&input_filter, &config.filter);
+    snapshot_init(&input_state_snapshot, &input_state_copies[0], &input_state_copies[1], sizeof(input_state_t));
+#if CONFIG_INPUT_BACKEND_AD7091R5
+    xTaskCreate(ad7091r5_input_task, "input_manager_task", INPUT_TASK_STACK_SIZE, NULL, INPUT_TASK_PRIORITY, NULL);
+#else
     xTaskCreate(input_manager_task, "input_manager_task", INPUT_TASK_STACK_SIZE, NULL, INPUT_TASK_PRIORITY, NULL);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include <stdbool.h>
+#include "inc/modbus_crc.h"
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#endif
+
+// Hot path of every frame in and out, keep it out of flash when asked to
+#if CONFIG_MODBUS_CRC_IN_IRAM
+#define CRC_ATTR                IRAM_ATTR
+#else
+#define CRC_ATTR
+#endif
+
+#define CRC_POLY                (0xA001)    // 0x8005 reflected
+
+// Only the tables the picked implementation needs, all of them to compare them
+#if CONFIG_MODBUS_CRC_BENCHMARK || !(CONFIG_MODBUS_CRC_TABLE || CONFIG_MODBUS_CRC_SLICE4)
+#define CRC_TABLES              (8)
+#elif CONFIG_MODBUS_CRC_SLICE4
+#define CRC_TABLES              (4)
+#else
+#define CRC_TABLES              (1)
+#endif
+
+// tables[0] is the byte table, tables[k][i] the CRC of i followed by k zero bytes.
+// Built at startup so they sit in DRAM instead of behind the flash cache.
+static uint16_t tables[CRC_TABLES][256];
+static bool tables_ready = false;
+
+void modbus_crc_init(void)
+{
+    if (tables_ready) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        uint16_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+        tables[0][i] = crc;
+    }
+    for (int k = 1; k < CRC_TABLES; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = tables[k - 1][i];
+            tables[k][i] = (crc >> 8) ^ tables[0][crc & 0xFF];
+        }
+    }
+    tables_ready = true;
+}
+
+static inline uint16_t crc_bytes(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while (length--) {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if CRC_TABLES >= 4
+static inline uint16_t crc_slice4(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while (length >= 4) {
+        crc ^= data[0] | data[1] << 8;
+        crc = tables[3][crc & 0xFF] ^ tables[2][crc >> 8] ^ tables[1][data[2]] ^ tables[0][data[3]];
+        data += 4;
+        length -= 4;
+    }
+    return crc_bytes(crc, data, length);
+}
+#endif
+
+#if CRC_TABLES == 8
+static inline uint16_t crc_slice8(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while (length >= 8) {
+        crc ^= data[0] | data[1] << 8;
+        crc = tables[7][crc & 0xFF] ^ tables[6][crc >> 8] ^ tables[5][data[2]] ^ tables[4][data[3]] ^
+              tables[3][data[4]] ^ tables[2][data[5]] ^ tables[1][data[6]] ^ tables[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    return crc_slice4(crc, data, length);
+}
+#endif
+
+uint16_t modbus_crc16_bitwise(const uint8_t *data, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+    while (length--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+uint16_t CRC_ATTR modbus_crc16_table(const uint8_t *data, size_t length)
+{
+    return crc_bytes(0xFFFF, data, length);
+}
+
+#if CRC_TABLES >= 4
+uint16_t CRC_ATTR modbus_crc16_slice4(const uint8_t *data, size_t length)
+{
+    return crc_slice4(0xFFFF, data, length);
+}
+#endif
+
+#if CRC_TABLES == 8
+uint16_t CRC_ATTR modbus_crc16_slice8(const uint8_t *data, size_t length)
+{
+    return crc_slice8(0xFFFF, data, length);
+}
+#endif
+
+uint16_t CRC_ATTR modbus_crc16(const uint8_t *data, size_t length)
+{
+#if CONFIG_MODBUS_CRC_TABLE
+    return crc_bytes(0xFFFF, data, length);
+#elif CONFIG_MODBUS_CRC_SLICE4
+    return crc_slice4(0xFFFF, data, length);
+#else
+    return crc_slice8(0xFFFF, data, length);
+#endif
+}
+
+#if CONFIG_MODBUS_CRC_SLICE4 || CONFIG_MODBUS_CRC_SLICE8
+// See CMakeLists.txt, esp-modbus calls this for every RTU frame it sends or receives
+unsigned short __wrap_usMBCRC16(unsigned char *frame, unsigned short length);
+
+unsigned short CRC_ATTR __wrap_usMBCRC16(unsigned char *frame, unsigned short length)
+{
+    return modbus_crc16(frame, length);
+}
+#define REFERENCE_CRC           __real_usMBCRC16
+#else
+#define REFERENCE_CRC           usMBCRC16
+#endif
+
+#if CONFIG_MODBUS_CRC_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_cpu.h"
+#include "esp_log.h"
+
+#define TAG "MODBUS_CRC"
+#define BENCH_ROUNDS            (200)
+
+// The function esp-modbus ships with, checked against bit for bit
+unsigned short REFERENCE_CRC(unsigned char *frame, unsigned short length);
+
+static uint16_t reference_crc(const uint8_t *data, size_t length)
+{
+    return REFERENCE_CRC((unsigned char *)data, length);
+}
+
+typedef struct {
+    const char *name;
+    uint16_t (*crc)(const uint8_t *data, size_t length);
+} crc_impl_t;
+
+static const crc_impl_t impls[] = {
+    { "esp-modbus", reference_crc },
+    { "bitwise", modbus_crc16_bitwise },
+    { "table", modbus_crc16_table },
+    { "slice4", modbus_crc16_slice4 },
+    { "slice8", modbus_crc16_slice8 },
+};
+
+void modbus_crc_benchmark(void)
+{
+    static uint8_t buffer[256];
+    static const size_t sizes[] = { 8, 64, 256 };
+    volatile uint16_t sink = 0;
+
+    modbus_crc_init();
+    for (int i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = rand();
+    }
+
+    // Every length and a few offsets, so each tail of the sliced loops is covered
+    int mismatches = 0;
+    for (int length = 0; length <= 64; length++) {
+        for (int offset = 0; offset < 8; offset++) {
+            uint16_t expected = reference_crc(&buffer[offset], length);
+            for (int j = 1; j < sizeof(impls) / sizeof(impls[0]); j++) {
+                if (impls[j].crc(&buffer[offset], length) != expected) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    if (mismatches != 0) {
+        ESP_LOGE(TAG, "%d CRC mismatches against esp-modbus", mismatches);
+    }
+
+    for (int j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+        char line[64];
+        int used = 0;
+        for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            uint32_t started = esp_cpu_get_cycle_count();
+            for (int round = 0; round < BENCH_ROUNDS; round++) {
+                sink += impls[j].crc(buffer, sizes[s]);
+            }
+            uint32_t cycles = esp_cpu_get_cycle_count() - started;
+            uint32_t centi = cycles * 100 / (BENCH_ROUNDS * sizes[s]);
+            used += snprintf(&line[used], sizeof(line) - used, " %3d B %2d.%02d", sizes[s], centi / 100, centi % 100);
+        }
+        ESP_LOGI(TAG, "%-10s cycles/byte:%s", impls[j].name, line);
+    }
+    (void)sink;
+}
+#endif // CONFIG_MODBUS_CRC_BENCHMARK
@@ -0,0 +1,105 @@
+#include "inc/modbus_crc.h"
+#include "inc/modbus_rtu.h"
+
+#define READ_MAX_REGS           (125)
+#define WRITE_MAX_REGS          (123)
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+// Runs the PDU of a checked request, returns the response PDU length or an exception code
+// with the top bit set
+static int handle_pdu(const modbus_rtu_slave_t *slave, const uint8_t *pdu, size_t length, uint8_t *out)
+{
+    uint8_t function = pdu[0];
+    out[0] = function;
+    if (length < 5) {
+        return 0x100 | MODBUS_EX_ILLEGAL_VALUE;
+    }
+    uint16_t first = get_u16(&pdu[1]);
+    uint16_t count = get_u16(&pdu[3]);
+    uint8_t ex;
+
+    switch (function) {
+        case MODBUS_FC_READ_HOLDING:
+        case MODBUS_FC_READ_INPUT:
+            if (length != 5 || count == 0 || count > READ_MAX_REGS) {
+                return 0x100 | MODBUS_EX_ILLEGAL_VALUE;
+            }
+            ex = function == MODBUS_FC_READ_INPUT ? slave->read_input(&out[2], first, count)
+                                                  : slave->read_holding(&out[2], first, count);
+            if (ex != MODBUS_EX_NONE) {
+                return 0x100 | ex;
+            }
+            out[1] = count * 2;
+            return 2 + count * 2;
+
+        case MODBUS_FC_WRITE_SINGLE:
+            if (length != 5) {
+                return 0x100 | MODBUS_EX_ILLEGAL_VALUE;
+            }
+            ex = slave->write_holding(&pdu[3], first, 1);
+            if (ex != MODBUS_EX_NONE) {
+                return 0x100 | ex;
+            }
+            // Echoes the request
+            for (int i = 1; i < 5; i++) {
+                out[i] = pdu[i];
+            }
+            return 5;
+
+        case MODBUS_FC_WRITE_MULTIPLE:
+            if (length < 6 || count == 0 || count > WRITE_MAX_REGS || pdu[5] != count * 2 ||
+                length != 6 + (size_t)count * 2) {
+                return 0x100 | MODBUS_EX_ILLEGAL_VALUE;
+            }
+            ex = slave->write_holding(&pdu[6], first, count);
+            if (ex != MODBUS_EX_NONE) {
+                return 0x100 | ex;
+            }
+            for (int i = 1; i < 5; i++) {
+                out[i] = pdu[i];
+            }
+            return 5;
+
+        default:
+            return 0x100 | MODBUS_EX_ILLEGAL_FUNCTION;
+    }
+}
+
+size_t modbus_rtu_slave_handle(const modbus_rtu_slave_t *slave, const uint8_t *request, size_t length,
+                               uint8_t *response)
+{
+    // Address, function and CRC at least
+    if (length < 4 || length > MODBUS_RTU_FRAME_MAX) {
+        return 0;
+    }
+    uint8_t address = request[0];
+    if (address != slave->address && address != MODBUS_RTU_BROADCAST) {
+        return 0;
+    }
+    uint16_t crc = request[length - 2] | request[length - 1] << 8;
+    if (modbus_crc16(request, length - 2) != crc) {
+        return 0;
+    }
+
+    int result = handle_pdu(slave, &request[1], length - 3, &response[1]);
+    if (address == MODBUS_RTU_BROADCAST) {
+        return 0;
+    }
+    size_t size;
+    response[0] = address;
+    if (result & 0x100) {
+        response[1] |= 0x80;
+        response[2] = result & 0xFF;
+        size = 3;
+    } else {
+        size = 1 + result;
+    }
+    crc = modbus_crc16(response, size);
+    response[size++] = crc & 0xFF;
+    response[size++] = crc >> 8;
+    return size;
+}
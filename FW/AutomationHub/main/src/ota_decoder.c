@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rom/miniz.h"
+#include "inc/ota_decoder.h"
+
+#define DELTA_START_SIZE        8       // Magic and base size
+#define DELTA_RECORD_SIZE       12
+
+static uint8_t base_buffer[256];
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool apply_seek(ota_decoder_t *d)
+{
+    int64_t pos = (int64_t)d->base_pos + d->seek;
+    if (pos < 0 || pos > d->base_size) {
+        return false;
+    }
+    d->base_pos = pos;
+    return true;
+}
+
+static bool patch_feed(ota_decoder_t *d, const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        if (d->diff_left == 0 && d->extra_left == 0) {
+            size_t size = d->have_magic ? DELTA_RECORD_SIZE : DELTA_START_SIZE;
+            size_t n = size - d->header_length;
+            if (n > length) {
+                n = length;
+            }
+            memcpy(d->header + d->header_length, data, n);
+            d->header_length += n;
+            data += n;
+            length -= n;
+            if (d->header_length < size) {
+                continue;
+            }
+            d->header_length = 0;
+            if (!d->have_magic) {
+                d->base_size = read_u32(d->header + 4);
+                if (memcmp(d->header, OTA_DELTA_MAGIC, 4) != 0 || d->base_size > d->base_limit) {
+                    return false;
+                }
+                d->have_magic = true;
+                continue;
+            }
+            d->diff_left = read_u32(d->header);
+            d->extra_left = read_u32(d->header + 4);
+            d->seek = (int32_t)read_u32(d->header + 8);
+            if (d->diff_left == 0 && d->extra_left == 0 && !apply_seek(d)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (d->diff_left > 0) {
+            size_t n = length < d->diff_left ? length : d->diff_left;
+            if (n > sizeof(base_buffer)) {
+                n = sizeof(base_buffer);
+            }
+            if (d->base_pos + n > d->base_size || !d->read_base(d->ctx, d->base_pos, base_buffer, n)) {
+                return false;
+            }
+            for (size_t i = 0; i < n; i++) {
+                base_buffer[i] += data[i];
+            }
+            if (!d->output(d->ctx, base_buffer, n)) {
+                return false;
+            }
+            d->base_pos += n;
+            d->diff_left -= n;
+            data += n;
+            length -= n;
+        } else {
+            size_t n = length < d->extra_left ? length : d->extra_left;
+            if (!d->output(d->ctx, data, n)) {
+                return false;
+            }
+            d->extra_left -= n;
+            data += n;
+            length -= n;
+        }
+        if (d->diff_left == 0 && d->extra_left == 0 && !apply_seek(d)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool emit(ota_decoder_t *d, const uint8_t *data, size_t length)
+{
+    if (d->format == OTA_FORMAT_DELTA) {
+        return patch_feed(d, data, length);
+    }
+    return d->output(d->ctx, data, length);
+}
+
+bool ota_decoder_begin(ota_decoder_t *d, uint8_t format, ota_output_fn output,
+                       ota_base_fn read_base, uint32_t base_limit, void *ctx)
+{
+    memset(d, 0, sizeof(*d));
+    d->format = format;
+    d->output = output;
+    d->read_base = read_base;
+    d->base_limit = base_limit;
+    d->ctx = ctx;
+    switch (format) {
+        case OTA_FORMAT_RAW:
+            return true;
+        case OTA_FORMAT_DEFLATE:
+        case OTA_FORMAT_DELTA:
+            break;
+        default:
+            return false;
+    }
+    // The decompressor code is in ROM, only its state and the window take RAM
+    d->inflator = malloc(sizeof(tinfl_decompressor));
+    d->window = malloc(TINFL_LZ_DICT_SIZE);
+    if (d->inflator == NULL || d->window == NULL) {
+        ota_decoder_end(d);
+        return false;
+    }
+    tinfl_init((tinfl_decompressor *)d->inflator);
+    return true;
+}
+
+bool ota_decoder_feed(ota_decoder_t *d, const uint8_t *data, size_t length)
+{
+    if (d->format == OTA_FORMAT_RAW) {
+        return d->output(d->ctx, data, length);
+    }
+    if (d->inflated) {
+        return length == 0;
+    }
+    for (;;) {
+        size_t in_bytes = length;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - d->window_pos;
+        tinfl_status status = tinfl_decompress((tinfl_decompressor *)d->inflator, data, &in_bytes,
+                                               d->window, d->window + d->window_pos, &out_bytes,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_bytes;
+        length -= in_bytes;
+        if (out_bytes > 0) {
+            if (!emit(d, d->window + d->window_pos, out_bytes)) {
+                return false;
+            }
+            // The window wraps, earlier output stays available for back references
+            d->window_pos = (d->window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        if (status < TINFL_STATUS_DONE) {
+            return false;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            d->inflated = true;
+            // Anything after the end of the stream is garbage
+            return length == 0;
+        }
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT && length == 0) {
+            return true;
+        }
+    }
+}
+
+bool ota_decoder_finished(const ota_decoder_t *d)
+{
+    switch (d->format) {
+        case OTA_FORMAT_RAW:
+            return true;
+        case OTA_FORMAT_DEFLATE:
+            return d->inflated;
+        default:
+            return d->inflated && d->have_magic && d->header_length == 0 &&
+                   d->diff_left == 0 && d->extra_left == 0;
+    }
+}
+
+void ota_decoder_end(ota_decoder_t *d)
+{
+    free(d->inflator);
+    free(d->window);
+    d->inflator = NULL;
+    d->window = NULL;
+}
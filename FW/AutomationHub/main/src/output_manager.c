@@ -12,13 +12,12 @@
 #include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "soc/gpio_reg.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "inc/output_manager.h"
 
-#define OUTPUT_TASK_STACK_SIZE    (2048)
-#define OUTPUT_TASK_PRIORITY      (10)
-
 #define COMMON_ENABLE       12
 #define GPIO_OUTPUT_PIN_SEL  ((1ULL<<OUT_1) | (1ULL<<OUT_2) | (1ULL<<OUT_3) | (1ULL<<OUT_4) | (1ULL<<COMMON_ENABLE))
 /*
@@ -29,47 +28,179 @@
  * GPIO_OUTPUT_PIN_SEL                0000000000000000000011000000000000000000
  * */
 
-static QueueHandle_t output_evt_queue = NULL;
+// All outputs sit on GPIO0-31 so one W1TS/W1TC register pair switches them together
+_Static_assert(GPIO_OUTPUT_PIN_SEL < (1ULL << 32), "outputs must be on GPIO0-31");
+
+static const uint32_t output_gpio[NUMBER_OF_OUTPUTS] = {
+    [eOutput1] = OUT_1,
+    [eOutput2] = OUT_2,
+    [eOutput3] = OUT_3,
+    [eOutput4] = OUT_4,
+};
+
+// Shadow of the output register, only changed bits are written to the hardware
+static output_stats_t output_stats;
+static portMUX_TYPE output_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Timed and flash operations share one esp_timer armed for the earliest deadline. It is
+// rearmed under output_lock together with the deadline change, so a rearm based on a stale
+// deadline can never run after, and undo, one based on a newer deadline.
+static esp_timer_handle_t output_timer = NULL;
+static int64_t output_deadline[NUMBER_OF_OUTPUTS];
+static uint32_t output_period_us[NUMBER_OF_OUTPUTS];
 
 void init_gpio(void);
 
-void output_manager_task(void* arg)
+// Switches the outputs in mask to the matching bits of state, output_lock must be held
+static void apply_outputs_locked(uint32_t mask, uint32_t state)
 {
-    output_command_t command;
-    init_gpio();
-    for(;;) {
-        if(xQueueReceive(output_evt_queue, &command, portMAX_DELAY)) {
-            // printf("GPIO[%d]\n", command.ioNumber);
-            // printf("State %d\n", command.state);
-            if (command.ioNumber == OUT_1) {
-                gpio_set_level(OUT_1, command.state);
-            } else if (command.ioNumber == OUT_2) {
-                gpio_set_level(OUT_2, command.state);
-            } else if (command.ioNumber == OUT_3) {
-                gpio_set_level(OUT_3, command.state);
-            } else if (command.ioNumber == OUT_4) {
-                gpio_set_level(OUT_4, command.state);
-            } else if (command.ioNumber == COMMON_ENABLE) {
-                gpio_set_level(COMMON_ENABLE, command.state);
+    output_stats.commands++;
+    uint32_t changed = (output_stats.state ^ state) & mask;
+    if (changed == 0) {
+        output_stats.suppressed++;
+        return;
+    }
+    uint32_t set_bits = 0;
+    uint32_t clear_bits = 0;
+    for (int i = 0; i < NUMBER_OF_OUTPUTS; i++) {
+        if (!(changed & OUTPUT_BIT(i))) {
+            continue;
+        }
+        if (state & OUTPUT_BIT(i)) {
+            set_bits |= 1UL << output_gpio[i];
+        } else {
+            clear_bits |= 1UL << output_gpio[i];
+        }
+        output_stats.transitions[i]++;
+    }
+    output_stats.state ^= changed;
+    REG_WRITE(GPIO_OUT_W1TC_REG, clear_bits);
+    REG_WRITE(GPIO_OUT_W1TS_REG, set_bits);
+}
+
+// Earliest pending deadline, output_lock must be held. Returns 0 if nothing is scheduled.
+static int64_t next_deadline_locked(void)
+{
+    int64_t next = 0;
+    for (int i = 0; i < NUMBER_OF_OUTPUTS; i++) {
+        if ((output_stats.timed & OUTPUT_BIT(i)) && (next == 0 || output_deadline[i] < next)) {
+            next = output_deadline[i];
+        }
+    }
+    return next;
+}
+
+// Called after every change to the deadlines, output_lock must be held. esp_timer_stop and
+// esp_timer_start_once only take the esp_timer spinlock, they never block, so this is safe
+// from the timer callback and inside the critical section.
+static void rearm_output_timer_locked(void)
+{
+    int64_t next = next_deadline_locked();
+    esp_timer_stop(output_timer);
+    if (next != 0) {
+        int64_t delay = next - esp_timer_get_time();
+        esp_timer_start_once(output_timer, delay > 0 ? delay : 0);
+    }
+}
+
+// Runs every due timed/flash edge in one register write, then sleeps until the next one
+static void output_timer_callback(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t toggle = 0;
+
+    taskENTER_CRITICAL(&output_lock);
+    for (int i = 0; i < NUMBER_OF_OUTPUTS; i++) {
+        if (!(output_stats.timed & OUTPUT_BIT(i)) || output_deadline[i] > now) {
+            continue;
+        }
+        toggle |= OUTPUT_BIT(i);
+        if (output_period_us[i] != 0) {
+            output_deadline[i] += output_period_us[i];
+            if (output_deadline[i] <= now) {
+                // Fell behind, keep the cadence from now rather than bursting to catch up
+                output_deadline[i] = now + output_period_us[i];
             }
+        } else {
+            // Timed operation complete, the output returns to latched control
+            output_stats.timed &= ~OUTPUT_BIT(i);
         }
     }
+    apply_outputs_locked(toggle, output_stats.state ^ toggle);
+    rearm_output_timer_locked();
+    taskEXIT_CRITICAL(&output_lock);
+}
+
+static int output_index(uint32_t ioNumber)
+{
+    for (int i = 0; i < NUMBER_OF_OUTPUTS; i++) {
+        if (output_gpio[i] == ioNumber) {
+            return i;
+        }
+    }
+    printf("Output %"PRIu32" is not a switched output.\n", ioNumber);
+    return -1;
+}
+
+bool set_outputs(uint32_t state)
+{
+    taskENTER_CRITICAL(&output_lock);
+    apply_outputs_locked(ALL_OUTPUTS & ~output_stats.timed, state);
+    taskEXIT_CRITICAL(&output_lock);
+    return true;
 }
 
 // Latches output to the specified state
 bool set_output(uint32_t ioNumber, uint8_t state)
 {
-    if(output_evt_queue == NULL) {
-        printf("Output event queue not initialized.\n");
+    output_command_t command = {
+        .ioNumber = ioNumber,
+        .state = state,
+        .time = 0,
+        .mode = latch,
+    };
+    return output_command(&command);
+}
+
+bool output_command(const output_command_t *command)
+{
+    int index = output_index(command->ioNumber);
+    if (index < 0) {
+        return false;
+    }
+    if (command->mode != latch && command->time == 0) {
         return false;
     }
-    output_command_t command;
-    command.ioNumber = ioNumber;
-    command.mode = latch;
-    command.time = 0;
-    command.state = state;
-    // printf("Output command %d, %d.\n",command.ioNumber, command.state);
-    return xQueueSend(output_evt_queue, &command, 0);
+    uint32_t bit = OUTPUT_BIT(index);
+
+    taskENTER_CRITICAL(&output_lock);
+    if (command->mode == latch) {
+        output_stats.timed &= ~bit;
+    } else {
+        output_stats.timed |= bit;
+        output_deadline[index] = esp_timer_get_time() + (int64_t)command->time * 1000;
+        output_period_us[index] = (command->mode == flash) ? command->time * 1000 : 0;
+    }
+    apply_outputs_locked(bit, command->state ? bit : 0);
+    rearm_output_timer_locked();
+    taskEXIT_CRITICAL(&output_lock);
+    return true;
+}
+
+// Ends timed/flash operations, the outputs keep their current level until latched
+void cancel_timed_outputs(uint32_t mask)
+{
+    taskENTER_CRITICAL(&output_lock);
+    output_stats.timed &= ~mask;
+    rearm_output_timer_locked();
+    taskEXIT_CRITICAL(&output_lock);
+}
+
+void get_output_stats(output_stats_t *stats)
+{
+    taskENTER_CRITICAL(&output_lock);
+    *stats = output_stats;
+    taskEXIT_CRITICAL(&output_lock);
 }
 
 void init_gpio(void)
@@ -89,8 +220,8 @@ void init_gpio(void)
     //configure GPIO with the given settings
     gpio_config(&io_conf);
 
-    //create a queue to handle gpio event from isr
-    output_evt_queue = xQueueCreate(10, sizeof(output_command_t));
+    // Outputs start off, matching the zeroed shadow register
+    REG_WRITE(GPIO_OUT_W1TC_REG, (1UL << OUT_1) | (1UL << OUT_2) | (1UL << OUT_3) | (1UL << OUT_4));
 
     // Default common to enabled, this puts 12v on the Common terminal.
     gpio_set_level(COMMON_ENABLE, 1);
@@ -100,5 +231,12 @@ void init_gpio(void)
 
 void init_output_task(void)
 {
-    xTaskCreate(output_manager_task, "output_manager_task", OUTPUT_TASK_STACK_SIZE, NULL, OUTPUT_TASK_PRIORITY, NULL);
-}
\ No newline at end of file
+    // Outputs are written directly from the caller, no task or queue is needed
+    init_gpio();
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = output_timer_callback,
+        .name = "output_timer",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &output_timer));
+}
@@ -0,0 +1,155 @@
+#include <string.h>
+#include "inc/rs485_bus.h"
+
+void rs485_bus_init(rs485_bus_t *bus, const rs485_port_t *port)
+{
+    memset(bus, 0, sizeof(*bus));
+    bus->port = port;
+    bus->frames_free = (1 << RS485_FRAME_POOL) - 1;
+}
+
+rs485_frame_t *rs485_frame_alloc(rs485_bus_t *bus)
+{
+    if (bus->frames_free == 0) {
+        return NULL;
+    }
+    int index = __builtin_ctz(bus->frames_free);
+    bus->frames_free &= ~(1 << index);
+    bus->frames[index].length = 0;
+    return &bus->frames[index];
+}
+
+void rs485_frame_free(rs485_bus_t *bus, rs485_frame_t *frame)
+{
+    if (frame != NULL) {
+        bus->frames_free |= 1 << (frame - bus->frames);
+    }
+}
+
+// Moves what the port has buffered into the frame being received
+static void receive_data(rs485_bus_t *bus, size_t size)
+{
+    uint8_t discard[64];
+    if (size == 0) {
+        return;
+    }
+    if (bus->rx_frame == NULL && !bus->rx_bad) {
+        bus->rx_frame = rs485_frame_alloc(bus);
+        if (bus->rx_frame == NULL) {
+            bus->rx_bad = true;
+        }
+    }
+    rs485_frame_t *frame = bus->rx_frame;
+    if (frame != NULL && !bus->rx_bad && frame->length + size <= sizeof(frame->data)) {
+        int read = bus->port->read(bus->port->ctx, &frame->data[frame->length], size);
+        if (read > 0) {
+            frame->length += read;
+        }
+        return;
+    }
+    // Rest of a frame that is dropped anyway
+    bus->rx_bad = true;
+    while (size > 0) {
+        int read = bus->port->read(bus->port->ctx, discard, size < sizeof(discard) ? size : sizeof(discard));
+        if (read <= 0) {
+            break;
+        }
+        size -= read;
+    }
+}
+
+static void drop_frame(rs485_bus_t *bus)
+{
+    rs485_frame_free(bus, bus->rx_frame);
+    bus->rx_frame = NULL;
+    bus->rx_bad = false;
+    bus->errors++;
+}
+
+rs485_frame_t *rs485_receive(rs485_bus_t *bus, uint32_t wait_ms)
+{
+    rs485_event_t event;
+    while (bus->port->wait_event(bus->port->ctx, &event, wait_ms)) {
+        switch (event.type) {
+            case RS485_EVENT_DATA:
+                receive_data(bus, event.size);
+                if (!event.idle) {
+                    break;
+                }
+                // Line went idle, the frame is complete
+                if (bus->rx_bad) {
+                    drop_frame(bus);
+                    break;
+                }
+                if (bus->rx_frame != NULL) {
+                    rs485_frame_t *frame = bus->rx_frame;
+                    bus->rx_frame = NULL;
+                    bus->rx_end_us = bus->port->now_us();
+                    bus->received++;
+                    return frame;
+                }
+                break;
+
+            case RS485_EVENT_OVERRUN:
+                drop_frame(bus);
+                break;
+
+            case RS485_EVENT_LINE_ERROR:
+                bus->rx_bad = true;
+                break;
+
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+bool rs485_send(rs485_bus_t *bus, rs485_frame_t *frame, bool wait_done)
+{
+    const rs485_port_t *port = bus->port;
+    int64_t started = port->now_us();
+    bool ok = port->write(port->ctx, frame->data, frame->length) == frame->length;
+    if (ok && wait_done) {
+        ok = port->wait_tx_done(port->ctx, 100);
+    }
+    rs485_frame_free(bus, frame);
+
+    uint32_t cpu = started - bus->rx_end_us;
+    uint32_t turnaround = port->now_us() - bus->rx_end_us;
+    bus->sent++;
+    bus->cpu_sum_us += cpu;
+    bus->turnaround_sum_us += turnaround;
+    if (cpu > bus->cpu_max_us) {
+        bus->cpu_max_us = cpu;
+    }
+    if (turnaround > bus->turnaround_max_us) {
+        bus->turnaround_max_us = turnaround;
+    }
+    if (!ok) {
+        bus->errors++;
+    }
+    return ok;
+}
+
+void rs485_get_stats(const rs485_bus_t *bus, rs485_stats_t *stats)
+{
+    stats->frames = bus->received;
+    stats->errors = bus->errors;
+    stats->sent = bus->sent;
+    stats->cpu_avg_us = bus->sent > 0 ? bus->cpu_sum_us / bus->sent : 0;
+    stats->cpu_max_us = bus->cpu_max_us;
+    stats->turnaround_avg_us = bus->sent > 0 ? bus->turnaround_sum_us / bus->sent : 0;
+    stats->turnaround_max_us = bus->turnaround_max_us;
+}
+
+void rs485_reset_stats(rs485_bus_t *bus)
+{
+    bus->received = 0;
+    bus->errors = 0;
+    bus->sent = 0;
+    bus->cpu_sum_us = 0;
+    bus->cpu_max_us = 0;
+    bus->turnaround_sum_us = 0;
+    bus->turnaround_max_us = 0;
+}
@@ -0,0 +1,102 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "inc/rs485_uart.h"
+
+#define TAG "RS485_UART"
+
+#define RS485_RX_BUFFER         (2 * MODBUS_RTU_FRAME_MAX)
+#define RS485_TX_BUFFER         (2 * MODBUS_RTU_FRAME_MAX)
+#define RS485_EVENT_QUEUE_LEN   (16)
+
+// Timeout threshold for UART = number of symbols (~10 tics) with unchanged state on receive pin
+#define RS485_READ_TOUT         (3) // 3.5T * 8 = 28 ticks, TOUT=3 -> ~24..33 ticks
+
+static int uart_port = -1;
+static QueueHandle_t uart_queue = NULL;
+
+static TickType_t to_ticks(uint32_t wait_ms)
+{
+    return wait_ms == RS485_WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms);
+}
+
+static bool uart_wait_event(void *ctx, rs485_event_t *event, uint32_t wait_ms)
+{
+    uart_event_t uart_event;
+    while (xQueueReceive(uart_queue, &uart_event, to_ticks(wait_ms)) == pdTRUE) {
+        switch (uart_event.type) {
+            case UART_DATA:
+                event->type = RS485_EVENT_DATA;
+                event->size = uart_event.size;
+                event->idle = uart_event.timeout_flag;
+                return true;
+
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                // Counted by the frame layer, logging would go out on this same UART
+                uart_flush_input(uart_port);
+                xQueueReset(uart_queue);
+                event->type = RS485_EVENT_OVERRUN;
+                return true;
+
+            case UART_FRAME_ERR:
+            case UART_PARITY_ERR:
+                event->type = RS485_EVENT_LINE_ERROR;
+                return true;
+
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+static int uart_read(void *ctx, uint8_t *data, size_t size)
+{
+    return uart_read_bytes(uart_port, data, size, 0);
+}
+
+static int uart_write(void *ctx, const uint8_t *data, size_t size)
+{
+    return uart_write_bytes(uart_port, data, size);
+}
+
+static bool uart_tx_done(void *ctx, uint32_t wait_ms)
+{
+    return uart_wait_tx_done(uart_port, to_ticks(wait_ms)) == ESP_OK;
+}
+
+bool rs485_uart_init(rs485_port_t *port, int uart, int baud_rate, int tx_pin, int rx_pin, int rts_pin)
+{
+    const uart_config_t uart_config = {
+        .baud_rate = baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = 122,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+
+    uart_port = uart;
+    if (uart_driver_install(uart, RS485_RX_BUFFER, RS485_TX_BUFFER, RS485_EVENT_QUEUE_LEN, &uart_queue, 0) != ESP_OK ||
+        uart_param_config(uart, &uart_config) != ESP_OK ||
+        uart_set_pin(uart, tx_pin, rx_pin, rts_pin, UART_PIN_NO_CHANGE) != ESP_OK ||
+        uart_set_mode(uart, UART_MODE_RS485_HALF_DUPLEX) != ESP_OK ||
+        uart_set_rx_timeout(uart, RS485_READ_TOUT) != ESP_OK) {
+        ESP_LOGE(TAG, "UART %d setup failed", uart);
+        return false;
+    }
+
+    *port = (rs485_port_t) {
+        .ctx = NULL,
+        .wait_event = uart_wait_event,
+        .read = uart_read,
+        .write = uart_write,
+        .wait_tx_done = uart_tx_done,
+        .now_us = esp_timer_get_time,
+    };
+    return true;
+}
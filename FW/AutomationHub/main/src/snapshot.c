@@ -0,0 +1,40 @@
+#include <string.h>
+#include "inc/snapshot.h"
+
+void snapshot_init(snapshot_t *snapshot, void *copy0, void *copy1, size_t size){
+    snapshot->sequence = 0;
+    snapshot->copies[0] = copy0;
+    snapshot->copies[1] = copy1;
+    snapshot->size = size;
+}
+
+static void snapshot_flip(snapshot_t *snapshot){
+    // Order the previous copy writes before the flip, and the flip before the next copy writes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void snapshot_publish(snapshot_t *snapshot, const void *value){
+    // Odd sequence: readers use copies[1] while copies[0] is rewritten
+    snapshot_flip(snapshot);
+    memcpy(snapshot->copies[0], value, snapshot->size);
+    // Even sequence: readers use copies[0] while copies[1] is rewritten
+    snapshot_flip(snapshot);
+    memcpy(snapshot->copies[1], value, snapshot->size);
+}
+
+uint32_t snapshot_read(const snapshot_t *snapshot, void *value){
+    uint32_t sequence;
+    do {
+        sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence < 2) {
+            // First publish has not completed yet
+            return 0;
+        }
+        memcpy(value, snapshot->copies[sequence & 1], snapshot->size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // Only retry when the writer flipped underneath us, never spin on a writer in progress
+    } while (__atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED) != sequence);
+    return sequence / 2;
+}
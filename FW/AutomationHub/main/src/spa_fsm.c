@@ -0,0 +1,109 @@
+#include <stddef.h>
+#include "inc/spa_fsm.h"
+#include "inc/output_manager.h"
+
+#define CIRC_PUMP       OUTPUT_BIT(eOutput1)
+#define HEATER          OUTPUT_BIT(eOutput2)
+#define JETS_PUMP       OUTPUT_BIT(eOutput3)
+
+#define ENTER_HEATING   (FSM_ACT_START_CIRC_TIMER | FSM_ACT_STOP_JETS_TIMER)
+#define ENTER_JETS      (FSM_ACT_START_JETS_TIMER | FSM_ACT_STOP_CIRC_TIMER)
+#define ENTER_FAULT     (FSM_ACT_STOP_CIRC_TIMER | FSM_ACT_STOP_JETS_TIMER | FSM_ACT_CANCEL_TIMED_OUTPUTS)
+
+typedef struct {
+    uint8_t valid;
+    uint8_t next;
+    uint8_t actions;
+} transition_t;
+
+typedef struct {
+    uint32_t outputs;           // Always on in this state
+    uint32_t demandOutputs;     // Only on while heatDemand is set
+} state_outputs_t;
+
+static const state_outputs_t stateOutputs[NUMBER_OF_STATES] = {
+    [startup]   = { 0, 0 },
+    [idle]      = { 0, 0 },
+    // Circ and heater, the heater follows the set point
+    [heating]   = { CIRC_PUMP, HEATER },
+    // High speed on, circ and heater off
+    [jets]      = { JETS_PUMP, 0 },
+    [fault]     = { 0, 0 },
+};
+
+#define GOTO(state, act)    { 1, (state), (act) }
+
+// Indexed by [state][event], a missing entry means the event is ignored in that state.
+// The transition states never appear as a current state, requests map straight to events.
+static const transition_t transitions[NUMBER_OF_STATES][NUMBER_OF_EVENTS] = {
+    [startup] = {
+        [evStart]       = GOTO(heating, ENTER_HEATING),
+        [evFault]       = GOTO(fault, ENTER_FAULT),
+    },
+    [idle] = {
+        [evHeatRequest] = GOTO(heating, ENTER_HEATING),
+        [evJetsRequest] = GOTO(jets, ENTER_JETS),
+        // Circ on for 3hrs then off for 3 hrs
+        [evCircTimer]   = GOTO(heating, ENTER_HEATING),
+        [evFault]       = GOTO(fault, ENTER_FAULT),
+    },
+    [heating] = {
+        // Restarts the circulation period
+        [evHeatRequest] = GOTO(heating, ENTER_HEATING),
+        [evJetsRequest] = GOTO(jets, ENTER_JETS),
+        [evCircTimer]   = GOTO(idle, 0),
+        [evFault]       = GOTO(fault, ENTER_FAULT),
+    },
+    [jets] = {
+        [evHeatRequest] = GOTO(heating, ENTER_HEATING),
+        [evJetsRequest] = GOTO(jets, ENTER_JETS),
+        [evJetsTimer]   = GOTO(heating, ENTER_HEATING),
+        [evFault]       = GOTO(fault, ENTER_FAULT),
+    },
+    // fault has no entries, it is latched until reset
+};
+
+static uint32_t outputsFor(const spa_fsm_t *fsm){
+    const state_outputs_t *desc = &stateOutputs[fsm->state];
+    return desc->outputs | (fsm->heatDemand ? desc->demandOutputs : 0);
+}
+
+void spa_fsm_init(spa_fsm_t *fsm){
+    fsm->state = startup;
+    fsm->heatDemand = false;
+    fsm->outputs = 0;
+}
+
+void spa_fsm_set_heat_demand(spa_fsm_t *fsm, bool demand){
+    fsm->heatDemand = demand;
+}
+
+bool spa_fsm_is_request(uint8_t mode){
+    return mode == transitionToHeating || mode == transitionToJets;
+}
+
+spa_fsm_event_t spa_fsm_request_event(uint8_t mode){
+    return mode == transitionToJets ? evJetsRequest : evHeatRequest;
+}
+
+bool spa_fsm_dispatch(spa_fsm_t *fsm, spa_fsm_event_t event, spa_fsm_result_t *result){
+    const transition_t *t = NULL;
+    if(event < NUMBER_OF_EVENTS){
+        t = &transitions[fsm->state][event];
+    }
+
+    result->from = fsm->state;
+    result->transitioned = t != NULL && t->valid;
+    result->actions = result->transitioned ? t->actions : 0;
+    if(result->transitioned){
+        fsm->state = t->next;
+    }
+    result->to = fsm->state;
+
+    uint32_t outputs = outputsFor(fsm);
+    result->outputs = outputs;
+    result->outputsChanged = outputs != fsm->outputs;
+    fsm->outputs = outputs;
+
+    return result->transitioned || result->outputsChanged;
+}
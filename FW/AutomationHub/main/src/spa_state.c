@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <string.h>
+#include "inc/spa_state.h"
+#include "inc/snapshot.h"
+
+// Leading fields that count as a change, and the bus readings appended after the drifting ones
+#define SPA_STATE_CHANGE_SIZE   offsetof(spa_state_t, circRemaining)
+#define SPA_STATE_BUS_OFFSET    offsetof(spa_state_t, flowRate)
+#define SPA_STATE_BUS_SIZE      (sizeof(spa_state_t) - SPA_STATE_BUS_OFFSET)
+
+static snapshot_t spa_state_snapshot;
+static spa_state_t spa_state_copies[2];
+static spa_state_t last_published;
+static bool published = false;
+
+void spa_state_init(void){
+    snapshot_init(&spa_state_snapshot, &spa_state_copies[0], &spa_state_copies[1], sizeof(spa_state_t));
+}
+
+bool spa_state_publish(const spa_state_t *state){
+    bool changed = !published || memcmp(&last_published, state, SPA_STATE_CHANGE_SIZE) != 0 ||
+                   memcmp((const uint8_t *)&last_published + SPA_STATE_BUS_OFFSET,
+                          (const uint8_t *)state + SPA_STATE_BUS_OFFSET, SPA_STATE_BUS_SIZE) != 0;
+    snapshot_publish(&spa_state_snapshot, state);
+    last_published = *state;
+    published = true;
+    return changed;
+}
+
+bool spa_state_read(spa_state_t *state){
+    return snapshot_read(&spa_state_snapshot, state) != 0;
+}
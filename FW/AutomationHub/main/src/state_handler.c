@@ -6,78 +6,185 @@
 #include "freertos/task.h"
 #include "soc/soc_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "inc/output_manager.h"
 #include "inc/input_manager.h"
 #include "gatts_table_creat_demo.h"
-#include <math.h>
 #include "inc/config.h"
+#include "inc/thermistor.h"
+#include "inc/spa_fsm.h"
+#include "inc/heater_pid.h"
+#include "inc/state_handler.h"
+#include "inc/spa_state.h"
+#include "inc/command_queue.h"
+#include "inc/bus_manager.h"
 
-#define STATE_HANDLER_STACK_SIZE        (2048)
+// publishState runs the GATT notifications and their logging on this task, with spa_state_t
+// copies and printf frames several levels deep
+#define STATE_HANDLER_STACK_SIZE        (4096)
+// Free stack below this is logged as a warning
+#define STATE_HANDLER_STACK_MARGIN      (512)
 #define STATE_HANDLER_TASK_PRIORITY     (9)
 #define HYSTERESIS_VALUE                (1) // 1 degree hysteresis
 const static char *TAG = "TEST";
 
-#define DELAY_TIME 1000
-enum systemState {
-    startup,
-    transitionToHeating,
-    idle,
-    heating,
-    transitionToJets,
-    jets,
-    fault
-};
-
-static uint8_t state = startup;
+// Task notification bits that wake the state handler
+#define EVT_INPUT                       (1 << 0)
+#define EVT_COMMAND                     (1 << 1)
+#define EVT_CIRC_TIMER                  (1 << 2)
+#define EVT_JETS_TIMER                  (1 << 3)
+#define EVT_HEATER_TIMER                (1 << 4)
+#define EVT_BUS                         (1 << 5)
+#define EVT_COUNT                       (6)
+// Filtered input change that counts as a new sample, ~0.1 degree at spa temperatures
+#define INPUT_DEADBAND_MV               (2)
+#define SET_TEMP_MIN                    (10)
+#define SET_TEMP_MAX                    (40)
+#define SCHEDULE_MIN_S                  (60)
+#define SCHEDULE_MAX_S                  (24 * 3600)
+// Larger corrections point at a broken or misplaced sensor rather than its tolerance
+#define CALIBRATION_MAX_CENTI           (500)
+// Not switched by the state machine, see CONFIG_FAULT_BLINK_AUX_OUTPUT
+#define AUX_OUTPUT                      (OUT_4)
+#define FAULT_BLINK_MS                  (500)       // Half period, once a second
+
+// Only touched by the state handler task, other tasks post events
+static spa_fsm_t fsm;
 static uint8_t setTemp = 37;
 static uint8_t currentTemp = 0;
+static int32_t currentTempCenti = 0;
+static bool tempValid = false;
+static int16_t inputTemps[NUMBER_OF_INPUTS];
+static uint16_t inputAlerts = 0;
+#if CONFIG_HEATER_CONTROL_HYSTERESIS
+static uint8_t hysteresis = HYSTERESIS_VALUE;
+#endif
+static heater_pid_t heaterPid;
+// Written by setHeaterParams from other tasks, applied by the state handler
+static heater_pid_params_t pendingHeaterParams;
+static bool heaterParamsPending = false;
+static portMUX_TYPE heaterParamsLock = portMUX_INITIALIZER_UNLOCKED;
+// Commands from BLE and other tasks, only popped by the state handler
+static command_queue_t commandQueue;
+
+static TaskHandle_t stateHandlerTask = NULL;
+static TimerHandle_t circ_timer = NULL;
+static TimerHandle_t jets_timer = NULL;
+#if CONFIG_HEATER_CONTROL_PI
+static TimerHandle_t heater_timer = NULL;
+#endif
+// Time each pending event was raised, used to report event to transition latency
+static int64_t eventTime[EVT_COUNT];
+static int64_t wakeTime = 0;
 
-void changeState(uint8_t newState){
-    gattUpdateMode(newState);
-    state = newState;
+static void postEvent(uint32_t event){
+    int index = __builtin_ctz(event);
+    if(eventTime[index] == 0){
+        eventTime[index] = esp_timer_get_time();
+    }
+    if(stateHandlerTask != NULL){
+        xTaskNotify(stateHandlerTask, event, eSetBits);
+    }
 }
 
 void circ_timer_callback(TimerHandle_t xTimer){
-    printf("Circulation timer expired\n");
-    if(state == idle){
-        changeState(transitionToHeating);
-    }else if(state == heating){
-        changeState(idle);
-    }
+    postEvent(EVT_CIRC_TIMER);
 }
 
 void jets_timer_callback(TimerHandle_t xTimer){
-    printf("Jets timer expired\n");
-    if(state == jets){
-        changeState(transitionToHeating);
-    }
+    postEvent(EVT_JETS_TIMER);
+}
+
+void heater_timer_callback(TimerHandle_t xTimer){
+    postEvent(EVT_HEATER_TIMER);
+}
+
+// Nothing to handle, the wake up publishes the state with the new readings
+void busValuesChanged(void){
+    postEvent(EVT_BUS);
 }
 
 uint8_t getMode(void){
-    return state;
+    return fsm.state;
+}
+
+static bool queueCommand(uint8_t type, uint8_t value){
+    spa_command_t command = { .type = type, .value = value };
+    if(!command_queue_push(&commandQueue, &command)){
+        ESP_LOGW(TAG, "Command queue full, dropped command %d", type);
+        return false;
+    }
+    postEvent(EVT_COMMAND);
+    return true;
 }
 
-void setMode(uint8_t mode){
+bool setMode(uint8_t mode){
     // safety to only allow supported modes
-    if(mode == transitionToHeating || mode == transitionToJets){
-        changeState(mode);
+    if(!spa_fsm_is_request(mode)){
+        return false;
     }
+    return queueCommand(cmdSetMode, mode);
 }
 
 uint8_t getTemp(){
     return currentTemp;
 }
 
-void updateSetTemp(uint8_t temp){
-    setTemp = temp;
-    storeSetTemp(setTemp);
-    changeState(transitionToHeating);
+bool updateSetTemp(uint8_t temp){
+    if(temp < SET_TEMP_MIN || temp > SET_TEMP_MAX){
+        return false;
+    }
+    return queueCommand(cmdSetTemp, temp);
 }
 
 uint8_t readSetTemp(){
     return setTemp;
 }
 
+bool setAuxOutput(uint8_t minutes){
+    return queueCommand(cmdAuxOutput, minutes);
+}
+
+bool setHeaterParams(const heater_pid_params_t *params){
+    if(!heater_pid_params_valid(params)){
+        return false;
+    }
+    taskENTER_CRITICAL(&heaterParamsLock);
+    pendingHeaterParams = *params;
+    heaterParamsPending = true;
+    taskEXIT_CRITICAL(&heaterParamsLock);
+    config_set_heater_params(params);
+    return true;
+}
+
+void getHeaterParams(heater_pid_params_t *params){
+    taskENTER_CRITICAL(&heaterParamsLock);
+    *params = heaterParamsPending ? pendingHeaterParams : heaterPid.params;
+    taskEXIT_CRITICAL(&heaterParamsLock);
+}
+
+// A running circulation or jets timer keeps its period, the next start uses the new one
+bool setSchedule(const spa_schedule_t *schedule){
+    if(schedule->circ_period_s < SCHEDULE_MIN_S || schedule->circ_period_s > SCHEDULE_MAX_S ||
+       schedule->jets_time_s < SCHEDULE_MIN_S || schedule->jets_time_s > SCHEDULE_MAX_S){
+        return false;
+    }
+    config_set_schedule(schedule);
+    return true;
+}
+
+// Used from the next input sample on
+bool setCalibration(const spa_calibration_t *calibration){
+    for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+        if(abs(calibration->temp_offset[i]) > CALIBRATION_MAX_CENTI){
+            return false;
+        }
+    }
+    config_set_calibration(calibration);
+    return true;
+}
+
+#if CONFIG_HEATER_CONTROL_HYSTERESIS
 bool isAboveSetTemp(uint8_t temp){
     // Check against the hysterisis
     static bool isAbove = false;
@@ -85,7 +192,7 @@ bool isAboveSetTemp(uint8_t temp){
         isAbove = true;
         return true;
     }else if (isAbove){
-        if (temp < (setTemp - HYSTERESIS_VALUE)){
+        if (temp < (setTemp - hysteresis)){
             isAbove = false;
             return false;
         }else{
@@ -97,27 +204,20 @@ bool isAboveSetTemp(uint8_t temp){
     }
 }
 
-uint8_t getTempFromVoltage(int voltage_mV){
-    // We know that the lower section of the resistor divider is 10K and the thermistor is 10K at 25C
-    // So we can use the voltage to calculate the resistance of the thermistor and then use a first order approximation to get the temperature
-    // With the voltage being 5V and the ADC being 12 bits we can calculate the voltage to resistance and then to temperature
-    // R1 = ( (vin - vout) * R2 ) / vout
-    float k = 3892;
-    float coefficent = -4.4;
-    // Convert mV to V
-    float voltage = (float)voltage_mV / 1000;
-    //ESP_LOGI(TAG, "Voltage: %f", voltage);
-
-    // Calculate the total resistance of the thermistor and the 10K resistor
-    float resistance = ((5 - voltage) * 10000) / voltage;
-    //ESP_LOGI(TAG, "Resistance: %f", resistance);
-    // Calculate the resistance of the thermistor
-    resistance = resistance - 11500;
-    //ESP_LOGI(TAG, "Resistance: %f", resistance);
-
-    // Calculate the temperature using the B-parameter equation
-    float temp = 1 / ((log(resistance / 10000) / k) + (1 / (25 + 273.15))) - 273.15;
-    //ESP_LOGI(TAG, "Temp: %f", temp);
+// Widens the heater hysteresis when the measured sensor noise spans more than the default band
+void updateHysteresis(int voltage_mV, int noise_mV){
+    int32_t noise = thermistor_mv_to_centi(voltage_mV + noise_mV) - thermistor_mv_to_centi(voltage_mV);
+    // Cover +/- 2 sigma of noise, rounded up to whole degrees
+    int32_t band = (2 * noise + 99) / 100;
+    hysteresis = band > HYSTERESIS_VALUE ? band : HYSTERESIS_VALUE;
+}
+#endif
+
+uint8_t getTempFromVoltage(int voltage_mV, int16_t offset_centi){
+    // Thermistor divider conversion is a precomputed table lookup, see thermistor.c
+    currentTempCenti = thermistor_mv_to_centi(voltage_mV) + offset_centi;
+    tempValid = true;
+    int32_t temp = currentTempCenti / 100;
     // clamp the temp to 0-50
     if(temp < 0){
         temp = 0;
@@ -129,99 +229,307 @@ uint8_t getTempFromVoltage(int voltage_mV){
     return currentTemp;
 }
 
-void state_handler(void *pvParameters){
-    input_state_t inputState;
-    printf("test_task startup\n");
+// Restarts a timer with the period from the stored schedule, picks up schedule changes
+static void startTimer(TimerHandle_t timer, uint32_t period_s){
+    // A zero period is not allowed for a FreeRTOS timer
+    if(period_s == 0){
+        period_s = 1;
+    }
+    xTimerChangePeriod( timer, pdMS_TO_TICKS(period_s * 1000), 0 );
+}
 
-    TimerHandle_t circ_timer = xTimerCreate("circulation_timer", 10800000 / portTICK_PERIOD_MS, pdTRUE, ( void * ) 0, circ_timer_callback);
-    TimerHandle_t jets_timer = xTimerCreate("jets_timer", 1800000 / portTICK_PERIOD_MS, pdTRUE, ( void * ) 0, jets_timer_callback);
-    for(;;){
-        if(get_state(&inputState)){
-            // printf("Input 1: %d\n", inputState.voltage[0]);
-            // printf("Input 2: %d\n", inputState.voltage[1]);
-            // printf("Input 3: %d\n", inputState.voltage[2]);
-            // printf("Input 4: %d\n", inputState.voltage[3]);
+// Runs one event through the state machine and performs the side effects it asks for
+static void dispatch(spa_fsm_event_t event){
+    spa_fsm_result_t result;
+    if(!spa_fsm_dispatch(&fsm, event, &result)){
+        return;
+    }
+
+    if(result.actions & FSM_ACT_STOP_CIRC_TIMER){
+        xTimerStop( circ_timer, 0 );
+    }
+    if(result.actions & FSM_ACT_STOP_JETS_TIMER){
+        xTimerStop( jets_timer, 0 );
+    }
+    if(result.actions & (FSM_ACT_START_CIRC_TIMER | FSM_ACT_START_JETS_TIMER)){
+        spa_config_t config;
+        config_get(&config);
+        if(result.actions & FSM_ACT_START_CIRC_TIMER){
+            startTimer(circ_timer, config.schedule.circ_period_s);
         }
-        getTempFromVoltage(inputState.voltage[eInput1]);
-        switch(state){
-            case startup:
-            // All off, initialize state from power on
-                set_output(OUT_1, off);
-                set_output(OUT_2, off);
-                set_output(OUT_3, off);
-                set_output(OUT_4, off);
-                changeState(transitionToHeating);
-                break;
+        if(result.actions & FSM_ACT_START_JETS_TIMER){
+            startTimer(jets_timer, config.schedule.jets_time_s);
+        }
+    }
+    if(result.actions & FSM_ACT_CANCEL_TIMED_OUTPUTS){
+        // Timed and flashing outputs are left where they were, force them off below
+        cancel_timed_outputs(ALL_OUTPUTS);
+    }
+    if(result.outputsChanged || (result.actions & FSM_ACT_CANCEL_TIMED_OUTPUTS)){
+        set_outputs(result.outputs);
+    }
+#if CONFIG_FAULT_BLINK_AUX_OUTPUT
+    if((result.actions & FSM_ACT_CANCEL_TIMED_OUTPUTS) && result.to == fault){
+        // Keeps blinking on the output timer, nothing leaves fault
+        output_command_t blink = { .ioNumber = AUX_OUTPUT, .state = on, .time = FAULT_BLINK_MS, .mode = flash };
+        output_command(&blink);
+    }
+#endif
 
-            case transitionToHeating:
-            {
-                ESP_LOGI(TAG, "Transition to heating state");
-                ESP_LOGI(TAG, "Set temp: %d", setTemp);
-                xTimerStart( circ_timer, 0 );
-                xTimerStop( jets_timer, 0 );
-                changeState(heating);
-                break;
-            }
+    if(result.transitioned && result.to != result.from){
+#if CONFIG_HEATER_CONTROL_PI
+        // The relay windows only need ticking while heating, elsewhere the heater is off
+        if(result.to == heating){
+            xTimerStart( heater_timer, 0 );
+        }else if(result.from == heating){
+            xTimerStop( heater_timer, 0 );
+            heater_pid_relay(&heaterPid, (uint32_t)(esp_timer_get_time() / 1000), false);
+        }
+#endif
+        if(wakeTime != 0){
+            ESP_LOGI(TAG, "State %d -> %d, %lld us after event", result.from, result.to, esp_timer_get_time() - wakeTime);
+        }
+        gattUpdateMode(result.to);
+    }
+}
 
-            case idle:
-            // All off, circ on for 3hrs then off for 3 hrs
-                set_output(OUT_1, off);
-                set_output(OUT_2, off);
-                set_output(OUT_3, off);
-                set_output(OUT_4, off);
-                // if jets pressed then go to jets state.
-                break;
+// Works out whether the heater should be on and passes it to the state machine,
+// which only applies it while heating
+static void updateHeater(void){
+    if(heaterParamsPending){
+        // Under the lock so getHeaterParams never sees the parameters half copied
+        taskENTER_CRITICAL(&heaterParamsLock);
+        heater_pid_configure(&heaterPid, &pendingHeaterParams);
+        heaterParamsPending = false;
+        taskEXIT_CRITICAL(&heaterParamsLock);
+    }
+    if(!tempValid){
+        return;
+    }
+#if CONFIG_HEATER_CONTROL_PI
+    uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+    bool wasOn = heaterPid.relayOn;
+    bool enabled = fsm.state == heating;
+    heater_pid_update(&heaterPid, setTemp * 100, currentTempCenti, now, enabled);
+    bool on = heater_pid_relay(&heaterPid, now, enabled);
+    if(on != wasOn){
+        heater_pid_stats_t stats;
+        heater_pid_get_stats(&heaterPid, &stats);
+        ESP_LOGI(TAG, "Heater %s, duty %d, cycles %u, overshoot %d, time to set point %u s", on ? "on" : "off",
+                 heaterPid.duty, stats.cycles, stats.overshoot, stats.reach_ms / 1000);
+    }
+    spa_fsm_set_heat_demand(&fsm, on);
+#else
+    spa_fsm_set_heat_demand(&fsm, !isAboveSetTemp(currentTemp));
+#endif
+    dispatch(evTempUpdate);
+}
+
+static uint16_t timerRemaining(TimerHandle_t timer){
+    if(timer == NULL || xTimerIsTimerActive(timer) == pdFALSE){
+        return 0;
+    }
+    TickType_t remaining = xTimerGetExpiryTime(timer) - xTaskGetTickCount();
+    return (uint32_t)remaining * portTICK_PERIOD_MS / 1000;
+}
 
-            case heating:
-            // Circ and Heater on for 3 hrs then off for 3 hrs
-                set_output(OUT_3, off);
-                set_output(OUT_4, off);
-                set_output(OUT_1, on);
-
-                
-                // If the temp is above the set point then turn heater off
-                if(isAboveSetTemp(getTempFromVoltage(inputState.voltage[eInput1]))){
-                    set_output(OUT_2, off);
-                }else{
-                    set_output(OUT_2, on);
-                }
+// Publishes the whole state for BLE telemetry and other readers
+static void publishState(void){
+    spa_state_t spaState;
+    output_stats_t outputStats;
+
+    get_output_stats(&outputStats);
+    spaState.version = SPA_STATE_VERSION;
+    spaState.mode = fsm.state;
+    spaState.setpoint = setTemp;
+    spaState.outputs = outputStats.state;
+    memcpy(spaState.temps, inputTemps, sizeof(spaState.temps));
+    spaState.faults = (inputAlerts & SPA_FAULT_INPUT_ALERTS) | (fsm.state == fault ? SPA_FAULT_LATCHED : 0);
+    spaState.circRemaining = timerRemaining(circ_timer);
+    spaState.jetsRemaining = timerRemaining(jets_timer);
+#if CONFIG_HEATER_CONTROL_PI
+    spaState.heaterDuty = heaterPid.duty;
+#else
+    spaState.heaterDuty = fsm.heatDemand ? HEATER_DUTY_MAX : 0;
+#endif
+    spaState.uptime = esp_timer_get_time() / 1000000;
+#if CONFIG_BUS_ROLE_MASTER
+    // The bus task only publishes its own snapshot, the state handler stays the one writer of the spa state
+    bus_values_t busValues;
+    if(bus_read_values(&busValues)){
+        spaState.flowRate = busValues.values[BUS_FLOW_RATE];
+        spaState.pumpSpeed = busValues.values[BUS_PUMP_SPEED];
+        spaState.waterPh = busValues.values[BUS_WATER_PH];
+        spaState.waterOrp = busValues.values[BUS_WATER_ORP];
+        spaState.busOnline = busValues.online;
+    }else{
+        spaState.flowRate = spaState.pumpSpeed = spaState.waterPh = spaState.waterOrp = spaState.busOnline = 0;
+    }
+#else
+    spaState.flowRate = spaState.pumpSpeed = spaState.waterPh = spaState.waterOrp = spaState.busOnline = 0;
+#endif
+
+    if(spa_state_publish(&spaState)){
+        gattUpdateTelemetry();
+    }
+}
+
+static void handleCommand(const spa_command_t *command){
+    switch(command->type){
+        case cmdSetMode:
+            ESP_LOGI(TAG, "Mode request %d", command->value);
+            dispatch(spa_fsm_request_event(command->value));
+            break;
+
+        case cmdSetTemp:
+            // A new set point also starts heating
+            ESP_LOGI(TAG, "Set temp: %d", command->value);
+            setTemp = command->value;
+            gattUpdateSetpoint(setTemp);
+            config_set_set_temp(setTemp);
+            dispatch(evHeatRequest);
+            break;
+
+        case cmdAuxOutput: {
+            // Left to the fault blink while in fault
+            if(fsm.state == fault){
                 break;
+            }
+            ESP_LOGI(TAG, "Aux output %d min", command->value);
+            output_command_t aux = {
+                .ioNumber = AUX_OUTPUT,
+                .state = command->value != 0 ? on : off,
+                .time = (uint32_t)command->value * 60000,
+                .mode = command->value != 0 ? timed : latch,
+            };
+            output_command(&aux);
+            break;
+        }
+    }
+}
 
-            case transitionToJets:
-            {
-                ESP_LOGI(TAG, "Transition to jets");
-                xTimerStart( jets_timer, 0 );
-                xTimerStop( circ_timer, 0 );
-                changeState(jets);
-                break; 
+static void handleEvents(uint32_t events){
+    input_state_t inputState;
+
+    // Latency is measured from the oldest event in this wake up
+    wakeTime = 0;
+    for(int i = 0; i < EVT_COUNT; i++){
+        if((events & (1 << i)) && eventTime[i] != 0){
+            if(wakeTime == 0 || eventTime[i] < wakeTime){
+                wakeTime = eventTime[i];
             }
+            eventTime[i] = 0;
+        }
+    }
 
-            case jets:
-            // High speed on, circ and pump off
-                set_output(OUT_1, off);
-                set_output(OUT_2, off);
-                set_output(OUT_3, on);
-                set_output(OUT_4, off);
-                break;
+    if((events & EVT_INPUT) && get_state(&inputState)){
+        // printf("Input 1: %d\n", inputState.voltage[0]);
+        // printf("Input 2: %d\n", inputState.voltage[1]);
+        // printf("Input 3: %d\n", inputState.voltage[2]);
+        // printf("Input 4: %d\n", inputState.voltage[3]);
+        spa_config_t config;
+        config_get(&config);
+        const int16_t *offsets = config.calibration.temp_offset;
+        getTempFromVoltage(inputState.filtered[eInput1], offsets[eInput1]);
+        for(int i = 0; i < NUMBER_OF_INPUTS; i++){
+            int32_t temp = thermistor_mv_to_centi(inputState.filtered[i]) + offsets[i];
+            inputTemps[i] = temp < INT16_MIN ? INT16_MIN : (temp > INT16_MAX ? INT16_MAX : temp);
+        }
+        inputAlerts = inputState.alerts;
+#if CONFIG_HEATER_CONTROL_HYSTERESIS
+        updateHysteresis(inputState.filtered[eInput1], inputState.noise[eInput1]);
+#endif
+        // Heater thermistor over temperature or open circuit, shut everything down
+        if(fsm.state != fault && (inputState.alerts & (INPUT_ALERT_HIGH(eInput1) | INPUT_ALERT_LOW(eInput1)))){
+            ESP_LOGE(TAG, "Input 1 out of limits, alerts 0x%x", inputState.alerts);
+            dispatch(evFault);
+        }
+    }
 
-            case fault:
-            // All off disabled
-                set_output(OUT_1, off);
-                set_output(OUT_2, off);
-                set_output(OUT_3, off);
-                set_output(OUT_4, off);
-                xTimerStop( circ_timer, 0 );
-                break;
+    if(events & (EVT_INPUT | EVT_HEATER_TIMER)){
+        updateHeater();
+    }
+    uint8_t heaterSetTemp = setTemp;
+    uint8_t heaterState = fsm.state;
+
+    if(events & EVT_CIRC_TIMER){
+        printf("Circulation timer expired\n");
+        dispatch(evCircTimer);
+    }
+
+    if(events & EVT_JETS_TIMER){
+        printf("Jets timer expired\n");
+        dispatch(evJetsTimer);
+    }
+
+    if(events & EVT_COMMAND){
+        spa_command_t command;
+        while(command_queue_pop(&commandQueue, &command)){
+            handleCommand(&command);
+        }
+    }
+
+    // A new set point or state changes the heat demand now, not at the next sample. Hysteresis
+    // has no tick, so a steady temperature would otherwise leave the old demand in place.
+    if(setTemp != heaterSetTemp || fsm.state != heaterState){
+        updateHeater();
+    }
+}
+
+void state_handler(void *pvParameters){
+    printf("test_task startup\n");
+    stateHandlerTask = xTaskGetCurrentTaskHandle();
+
+    // Periods are set from the schedule each time a timer is started
+    circ_timer = xTimerCreate("circulation_timer", 10800000 / portTICK_PERIOD_MS, pdTRUE, ( void * ) 0, circ_timer_callback);
+    jets_timer = xTimerCreate("jets_timer", 1800000 / portTICK_PERIOD_MS, pdTRUE, ( void * ) 0, jets_timer_callback);
+    input_subscribe(stateHandlerTask, EVT_INPUT, INPUT_DEADBAND_MV);
+#if CONFIG_HEATER_CONTROL_PI
+    // Only runs while heating, see dispatch
+    heater_timer = xTimerCreate("heater_timer", CONFIG_HEATER_CONTROL_PERIOD_MS / portTICK_PERIOD_MS, pdTRUE, ( void * ) 0, heater_timer_callback);
+#endif
+
+    // All off, initialize state from power on
+    set_outputs(0);
+    dispatch(evStart);
+    publishState();
+
+    uint32_t events = 0;
+    UBaseType_t stackLowest = STATE_HANDLER_STACK_SIZE;
+    for(;;){
+        // Sleep until a new sample, a command, a timer expiry or new bus readings
+        xTaskNotifyWait(0, UINT32_MAX, &events, portMAX_DELAY);
+        handleEvents(events);
+        publishState();
+
+        // Logs each new low of free stack, in bytes
+        UBaseType_t stackFree = uxTaskGetStackHighWaterMark(NULL);
+        if(stackFree < stackLowest){
+            stackLowest = stackFree;
+            if(stackFree < STATE_HANDLER_STACK_MARGIN){
+                ESP_LOGW(TAG, "Stack high water mark %u of %d bytes free", stackFree, STATE_HANDLER_STACK_SIZE);
+            }else{
+                ESP_LOGI(TAG, "Stack high water mark %u of %d bytes free", stackFree, STATE_HANDLER_STACK_SIZE);
+            }
         }
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
 }
 
 void init_state_handler(void)
 {
-    uint8_t storedTemp = fetchSetTemp();
-    if (storedTemp != 0){
-        setTemp = storedTemp;
+    thermistor_init();
+    spa_fsm_init(&fsm);
+    command_queue_init(&commandQueue);
+    spa_state_init();
+    spa_config_t config;
+    config_get(&config);
+    if(!heater_pid_params_valid(&config.heater)){
+        heater_pid_default_params(&config.heater);
+    }
+    heater_pid_configure(&heaterPid, &config.heater);
+    if (config.setTemp >= SET_TEMP_MIN && config.setTemp <= SET_TEMP_MAX){
+        setTemp = config.setTemp;
     }
+    gattUpdateSetpoint(setTemp);
     xTaskCreate(state_handler, "State Handler", STATE_HANDLER_STACK_SIZE, NULL, STATE_HANDLER_TASK_PRIORITY, NULL);
 }
\ No newline at end of file
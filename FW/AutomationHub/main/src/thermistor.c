@@ -0,0 +1,68 @@
+#include <math.h>
+#include "inc/thermistor.h"
+
+// Divider: 5V -> 11.5K series + thermistor -> ADC node -> 10K to ground
+#define DIVIDER_SUPPLY_MV       (5000)
+#define DIVIDER_LOWER_OHMS      (10000.0f)
+#define DIVIDER_SERIES_OHMS     (11500.0f)
+// 10K NTC at 25C with B = 3892
+#define THERMISTOR_R25_OHMS     (10000.0f)
+#define THERMISTOR_B            (3892.0f)
+#define KELVIN_OFFSET           (273.15f)
+
+// The table spans the full 12 bit millivolt range in 16mV steps
+#define TABLE_SHIFT             (4)
+#define TABLE_STEP_MV           (1 << TABLE_SHIFT)
+#define TABLE_MAX_MV            (4095)
+#define TABLE_SIZE              ((TABLE_MAX_MV >> TABLE_SHIFT) + 2)
+
+static int16_t temp_table[TABLE_SIZE];
+
+static int16_t clamp_centi(float temp){
+    if(temp < THERMISTOR_TEMP_MIN_CENTI / 100.0f){
+        return THERMISTOR_TEMP_MIN_CENTI;
+    }else if(temp > THERMISTOR_TEMP_MAX_CENTI / 100.0f){
+        return THERMISTOR_TEMP_MAX_CENTI;
+    }
+    return (int16_t)lroundf(temp * 100.0f);
+}
+
+// Same B-parameter math the controller used per sample, now run once per table entry at boot
+static int16_t compute_centi(int voltage_mV){
+    if(voltage_mV <= 0){
+        // Open thermistor, reads as coldest
+        return THERMISTOR_TEMP_MIN_CENTI;
+    }
+    if(voltage_mV >= DIVIDER_SUPPLY_MV){
+        return THERMISTOR_TEMP_MAX_CENTI;
+    }
+    float voltage = (float)voltage_mV / 1000;
+    float resistance = ((DIVIDER_SUPPLY_MV / 1000.0f - voltage) * DIVIDER_LOWER_OHMS) / voltage;
+    resistance = resistance - DIVIDER_SERIES_OHMS;
+    if(resistance <= 0){
+        // Shorted thermistor, reads as hottest
+        return THERMISTOR_TEMP_MAX_CENTI;
+    }
+    float temp = 1 / ((logf(resistance / THERMISTOR_R25_OHMS) / THERMISTOR_B) + (1 / (25 + KELVIN_OFFSET))) - KELVIN_OFFSET;
+    return clamp_centi(temp);
+}
+
+void thermistor_init(void){
+    for(int i = 0; i < TABLE_SIZE; i++){
+        temp_table[i] = compute_centi(i * TABLE_STEP_MV);
+    }
+}
+
+int32_t thermistor_mv_to_centi(int voltage_mV){
+    if(voltage_mV < 0){
+        voltage_mV = 0;
+    }else if(voltage_mV > TABLE_MAX_MV){
+        voltage_mV = TABLE_MAX_MV;
+    }
+    int index = voltage_mV >> TABLE_SHIFT;
+    int32_t frac = voltage_mV & (TABLE_STEP_MV - 1);
+    int32_t low = temp_table[index];
+    int32_t high = temp_table[index + 1];
+    // Linear interpolation between neighbouring entries, integer only
+    return low + (((high - low) * frac) >> TABLE_SHIFT);
+}
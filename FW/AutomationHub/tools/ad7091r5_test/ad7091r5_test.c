@@ -0,0 +1,172 @@
+/* AD7091R-5 driver check against a mock I2C bus.
+
+   Runs main/src/ad7091r5.c on the ad7091r5_bus_t in mock_i2c.c, which behaves like the part
+   as far as the driver uses it, and checks:
+
+     setup          command mode, alerts and internal reference in the configuration
+                    register, the channel sequence, and the conversion flushed so the new
+                    sequence is in effect
+     bursts         conversions tagged with the alert flag and their channel id, summed and
+                    counted per channel, channels outside the mask ignored
+     limits         low, high and hysteresis registers of each channel, clipped to 12 bits
+     alerts         latched by out of limit conversions, cleared by reading them
+     errors         a bus that does not answer fails every call
+
+   make check
+*/
+#include <stdio.h>
+#include <string.h>
+#include "inc/ad7091r5.h"
+#include "mock_i2c.h"
+
+#define ADDRESS                 (AD7091R5_DEFAULT_ADDRESS)
+#define REG_CHANNEL             (0x01)
+#define REG_CONF                (0x02)
+#define REG(reg, value)         ((uint32_t)(reg) << 16 | (value))
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        checks++;                                               \
+        if (!(cond)) {                                          \
+            failures++;                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
+
+static mock_i2c_t mock;
+static ad7091r5_bus_t bus;
+static ad7091r5_t adc;
+
+static void check_setup(void)
+{
+    mock_i2c_init(&mock, &bus, ADDRESS);
+    CHECK(ad7091r5_init(&adc, &bus, ADDRESS, 0xFF), "init failed");
+    CHECK(adc.channel_mask == 0x0F, "mask 0x%x, only 4 channels", adc.channel_mask);
+    CHECK(mock.write_count == 2, "%d register writes", mock.write_count);
+    // Command mode, alert pin enabled, internal reference
+    CHECK(mock.writes[0] == REG(REG_CONF, 0x0411), "configuration write 0x%06x", mock.writes[0]);
+    CHECK(mock.writes[1] == REG(REG_CHANNEL, 0x0F), "sequence write 0x%06x", mock.writes[1]);
+    CHECK(mock.result_reads == 1, "%d flush conversions", mock.result_reads);
+    CHECK(!mock.sequence_pending && mock.sequence == 0x0F, "sequence 0x%x not in effect", mock.sequence);
+}
+
+static void check_burst(void)
+{
+    static const uint16_t codes[AD7091R5_NUM_CHANNELS] = { 0x123, 0x456, 0x789, 0xABC };
+    uint8_t buffer[2 * 16];
+    uint32_t sum[AD7091R5_NUM_CHANNELS] = { 0 }, count[AD7091R5_NUM_CHANNELS] = { 0 };
+
+    // Channel 0 is what the part converts before the sequence takes effect, leave it out
+    mock_i2c_init(&mock, &bus, ADDRESS);
+    memcpy(mock.codes, codes, sizeof(codes));
+    CHECK(ad7091r5_init(&adc, &bus, ADDRESS, 0x0A), "init failed");
+    CHECK(ad7091r5_read_burst(&adc, buffer, 16, sum, count), "burst failed");
+    CHECK(mock.result_reads == 2, "%d result transactions, the burst is one", mock.result_reads);
+    for (int ch = 0; ch < AD7091R5_NUM_CHANNELS; ch++) {
+        uint32_t want = (0x0A & (1 << ch)) ? 8 : 0;
+        CHECK(count[ch] == want, "channel %d: %u conversions, expected %u", ch, count[ch], want);
+        CHECK(sum[ch] == want * codes[ch], "channel %d: sum 0x%x", ch, sum[ch]);
+    }
+
+    // Accumulates, and the alert flag in a result is not part of the code
+    mock.regs[0x05 + 3 * 3] = 0x800;
+    CHECK(ad7091r5_read_burst(&adc, buffer, 4, sum, count), "burst failed");
+    CHECK(count[1] == 10 && count[3] == 10, "counts %u %u after a second burst", count[1], count[3]);
+    CHECK(sum[3] == 10 * codes[3], "channel 3 sum 0x%x with alert flags set", sum[3]);
+
+    // A mask the sequence does not match, results of other channels are dropped
+    memset(sum, 0, sizeof(sum));
+    memset(count, 0, sizeof(count));
+    adc.channel_mask = 0x02;
+    CHECK(ad7091r5_read_burst(&adc, buffer, 8, sum, count), "burst failed");
+    CHECK(count[1] == 4 && count[3] == 0 && sum[1] == 4 * codes[1], "channel 3 results not dropped");
+}
+
+static void check_limits(void)
+{
+    mock_i2c_init(&mock, &bus, ADDRESS);
+    CHECK(ad7091r5_init(&adc, &bus, ADDRESS, 0x0F), "init failed");
+    for (int ch = 0; ch < AD7091R5_NUM_CHANNELS; ch++) {
+        mock.write_count = 0;
+        CHECK(ad7091r5_set_limits(&adc, ch, 0x100 + ch, 0xE00 + ch, 0x20 + ch), "channel %d limits failed", ch);
+        CHECK(mock.write_count == 3, "channel %d: %d writes", ch, mock.write_count);
+        CHECK(mock.writes[0] == REG(0x04 + ch * 3, 0x100 + ch), "channel %d low 0x%06x", ch, mock.writes[0]);
+        CHECK(mock.writes[1] == REG(0x05 + ch * 3, 0xE00 + ch), "channel %d high 0x%06x", ch, mock.writes[1]);
+        CHECK(mock.writes[2] == REG(0x06 + ch * 3, 0x20 + ch), "channel %d hysteresis 0x%06x", ch, mock.writes[2]);
+    }
+
+    mock.write_count = 0;
+    CHECK(ad7091r5_set_limits(&adc, 2, 0x1234, 0xFFFF, 0xF020), "limits failed");
+    CHECK(mock.regs[0x0A] == 0x234 && mock.regs[0x0B] == 0xFFF && mock.regs[0x0C] == 0x020,
+          "not clipped to 12 bits: 0x%x 0x%x 0x%x", mock.regs[0x0A], mock.regs[0x0B], mock.regs[0x0C]);
+
+    mock.write_count = 0;
+    CHECK(!ad7091r5_set_limits(&adc, AD7091R5_NUM_CHANNELS, 0, 0, 0), "channel 4 accepted");
+    CHECK(mock.write_count == 0, "channel 4 written");
+}
+
+static void check_alerts(void)
+{
+    uint8_t buffer[2 * 4];
+    uint32_t sum[AD7091R5_NUM_CHANNELS] = { 0 }, count[AD7091R5_NUM_CHANNELS] = { 0 };
+    uint16_t alerts = 0xFFFF;
+
+    mock_i2c_init(&mock, &bus, ADDRESS);
+    mock.codes[0] = 0x800;
+    mock.codes[1] = 0xF00;
+    mock.codes[2] = 0x050;
+    mock.codes[3] = 0x800;
+    CHECK(ad7091r5_init(&adc, &bus, ADDRESS, 0x0F), "init failed");
+    for (int ch = 0; ch < AD7091R5_NUM_CHANNELS; ch++) {
+        CHECK(ad7091r5_set_limits(&adc, ch, 0x100, 0xE00, 0x20), "limits failed");
+    }
+    CHECK(ad7091r5_read_alerts(&adc, &alerts) && alerts == 0, "alerts 0x%x before converting", alerts);
+
+    CHECK(ad7091r5_read_burst(&adc, buffer, 4, sum, count), "burst failed");
+    uint16_t want = AD7091R5_ALERT_HIGH(1) | AD7091R5_ALERT_LOW(2);
+    CHECK(ad7091r5_read_alerts(&adc, &alerts) && alerts == want, "alerts 0x%x, expected 0x%x", alerts, want);
+    CHECK(ad7091r5_read_alerts(&adc, &alerts) && alerts == 0, "alerts 0x%x not cleared by the read", alerts);
+
+    // Latched until read, even once the channel is back within its limits
+    CHECK(ad7091r5_read_burst(&adc, buffer, 4, sum, count), "burst failed");
+    mock.codes[1] = 0x800;
+    mock.codes[2] = 0x800;
+    CHECK(ad7091r5_read_burst(&adc, buffer, 4, sum, count), "burst failed");
+    CHECK(ad7091r5_read_alerts(&adc, &alerts) && alerts == want, "alerts 0x%x not latched", alerts);
+    CHECK(ad7091r5_read_alerts(&adc, &alerts) && alerts == 0, "alerts 0x%x not cleared", alerts);
+}
+
+static void check_errors(void)
+{
+    uint8_t buffer[2 * 4];
+    uint32_t sum[AD7091R5_NUM_CHANNELS] = { 0 }, count[AD7091R5_NUM_CHANNELS] = { 0 };
+    uint16_t alerts;
+
+    // Nothing at the address
+    mock_i2c_init(&mock, &bus, ADDRESS);
+    CHECK(!ad7091r5_init(&adc, &bus, ADDRESS + 1, 0x0F), "init at an empty address succeeded");
+
+    mock_i2c_init(&mock, &bus, ADDRESS);
+    CHECK(ad7091r5_init(&adc, &bus, ADDRESS, 0x0F), "init failed");
+    mock.nack = true;
+    CHECK(!ad7091r5_set_limits(&adc, 0, 0, 0, 0), "limits succeeded without a bus");
+    CHECK(!ad7091r5_read_burst(&adc, buffer, 4, sum, count), "burst succeeded without a bus");
+    CHECK(count[0] == 0 && sum[0] == 0, "failed burst counted");
+    CHECK(!ad7091r5_read_alerts(&adc, &alerts), "alerts read without a bus");
+}
+
+int main(void)
+{
+    check_setup();
+    check_burst();
+    check_limits();
+    check_alerts();
+    check_errors();
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures != 0;
+}
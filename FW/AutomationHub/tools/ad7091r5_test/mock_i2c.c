@@ -0,0 +1,105 @@
+#include <string.h>
+#include "mock_i2c.h"
+
+// Register map and fields from the datasheet, independent of the driver's own
+#define REG_RESULT              (0x00)
+#define REG_CHANNEL             (0x01)
+#define REG_CONF                (0x02)
+#define REG_ALERT               (0x03)
+#define REG_LOW_LIMIT(ch)       (0x04 + (ch) * 3)
+#define REG_HIGH_LIMIT(ch)      (0x05 + (ch) * 3)
+#define CONF_CMD                (1 << 10)
+#define RESULT_ALERT            (1 << 12)
+
+static uint16_t convert(mock_i2c_t *mock)
+{
+    // An empty sequence converts channel 0
+    uint8_t channel = 0;
+    for (int i = 0; i < AD7091R5_NUM_CHANNELS; i++) {
+        uint8_t candidate = (mock->next_channel + i) % AD7091R5_NUM_CHANNELS;
+        if (mock->sequence & (1 << candidate)) {
+            channel = candidate;
+            break;
+        }
+    }
+    mock->next_channel = (channel + 1) % AD7091R5_NUM_CHANNELS;
+
+    uint16_t code = mock->codes[channel] & AD7091R5_MAX_CODE;
+    uint16_t alert = 0;
+    if (code > mock->regs[REG_HIGH_LIMIT(channel)]) {
+        alert = AD7091R5_ALERT_HIGH(channel);
+    } else if (code < mock->regs[REG_LOW_LIMIT(channel)]) {
+        alert = AD7091R5_ALERT_LOW(channel);
+    }
+    mock->regs[REG_ALERT] |= alert;
+
+    if (mock->sequence_pending) {
+        mock->sequence = mock->regs[REG_CHANNEL];
+        mock->sequence_pending = false;
+        mock->next_channel = 0;
+    }
+    return channel << 13 | (alert != 0 ? RESULT_ALERT : 0) | code;
+}
+
+static bool mock_write(void *ctx, uint8_t address, const uint8_t *data, size_t length)
+{
+    mock_i2c_t *mock = ctx;
+    if (mock->nack || address != mock->address || length == 0 || data[0] >= MOCK_REGS) {
+        return false;
+    }
+    uint8_t reg = data[0];
+    // A pointer byte alone only moves the pointer
+    for (size_t i = 1; i + 1 < length; i += 2) {
+        uint16_t value = data[i] << 8 | data[i + 1];
+        if (mock->write_count < MOCK_LOG_SIZE) {
+            mock->writes[mock->write_count++] = (uint32_t)reg << 16 | value;
+        }
+        if (reg == REG_RESULT || reg == REG_ALERT) {
+            continue;
+        }
+        mock->regs[reg] = value;
+        if (reg == REG_CHANNEL) {
+            mock->sequence_pending = true;
+        }
+    }
+    return true;
+}
+
+static bool mock_write_read(void *ctx, uint8_t address, const uint8_t *write_data, size_t write_length,
+                            uint8_t *read_data, size_t read_length)
+{
+    mock_i2c_t *mock = ctx;
+    if (mock->nack || address != mock->address || write_length != 1 || write_data[0] >= MOCK_REGS) {
+        return false;
+    }
+    uint8_t reg = write_data[0];
+    if (reg == REG_RESULT) {
+        mock->result_reads++;
+    }
+    for (size_t i = 0; i + 1 < read_length; i += 2) {
+        uint16_t value;
+        if (reg == REG_RESULT && (mock->regs[REG_CONF] & CONF_CMD)) {
+            value = convert(mock);
+        } else {
+            value = mock->regs[reg];
+        }
+        read_data[i] = value >> 8;
+        read_data[i + 1] = value & 0xFF;
+    }
+    if (reg == REG_ALERT) {
+        mock->regs[REG_ALERT] = 0;
+    }
+    return true;
+}
+
+void mock_i2c_init(mock_i2c_t *mock, ad7091r5_bus_t *bus, uint8_t address)
+{
+    memset(mock, 0, sizeof(*mock));
+    mock->address = address;
+    for (int ch = 0; ch < AD7091R5_NUM_CHANNELS; ch++) {
+        mock->regs[REG_HIGH_LIMIT(ch)] = AD7091R5_MAX_CODE;
+    }
+    bus->write = mock_write;
+    bus->write_read = mock_write_read;
+    bus->ctx = mock;
+}
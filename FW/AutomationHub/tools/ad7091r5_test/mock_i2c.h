@@ -0,0 +1,33 @@
+#ifndef _MOCK_I2C_H_
+#define _MOCK_I2C_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "inc/ad7091r5.h"
+
+#define MOCK_REGS               (16)
+#define MOCK_LOG_SIZE           (64)
+
+// An AD7091R-5 behind an ad7091r5_bus_t, as far as the driver uses it. Registers are 16 bit,
+// MSB first, addressed by a pointer byte. In command mode each 2 byte read of the result
+// register converts the next channel of the sequence, a new sequence only takes effect after
+// the conversion following the write. Conversions outside a channel's limits latch its bit
+// in the alert register, which clears when read.
+typedef struct {
+    uint8_t address;
+    uint16_t regs[MOCK_REGS];
+    uint16_t codes[AD7091R5_NUM_CHANNELS];  // What each channel converts to
+    uint8_t sequence;                       // Sequence in effect
+    bool sequence_pending;
+    uint8_t next_channel;
+    bool nack;                              // Fail every transaction
+    // Register writes in order, reg << 16 | value
+    uint32_t writes[MOCK_LOG_SIZE];
+    int write_count;
+    int result_reads;                       // Transactions reading the result register
+} mock_i2c_t;
+
+// Power on state, fills bus so it talks to mock
+void mock_i2c_init(mock_i2c_t *mock, ad7091r5_bus_t *bus, uint8_t address);
+
+#endif // _MOCK_I2C_H_
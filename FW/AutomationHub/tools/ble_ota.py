@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Upload a firmware image to the spa over BLE.
+
+Usage: ble_ota.py [--name OPEN_SPA | --address ADDR] [--base running.bin] build/AutomationHub.bin
+
+The image is sent compressed, or with --base as a delta against the image the spa is
+running. Needs bleak (pip install bleak). See main/inc/ble_ota.h for the protocol.
+
+The spa only accepts the update over a link paired with its passkey (BLE_PASSKEY),
+pair with it first, e.g. `pair` in bluetoothctl. The image has to be signed with the
+key the running firmware was built with, which the build does with the key set in
+SECURE_BOOT_SIGNING_KEY.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import struct
+import sys
+import time
+
+from bleak import BleakClient, BleakScanner
+
+import ota_patch
+
+OTA_CTRL_UUID = "0000ff05-0000-1000-8000-00805f9b34fb"
+OTA_DATA_UUID = "0000ff06-0000-1000-8000-00805f9b34fb"
+
+OP_BEGIN = 0x01
+OP_END = 0x02
+OP_ABORT = 0x03
+OP_ACK = 0x04
+REPLY = 0x80
+
+STATUS = ["ok", "bad state", "bad size", "flash error", "hash mismatch", "window overflow", "busy",
+          "bad payload", "spa runs a different image than --base", "out of memory",
+          "image not signed with the spa's key"]
+
+
+class Ota:
+    def __init__(self, client):
+        self.client = client
+        self.replies = asyncio.Queue()
+        self.acked = 0
+        self.acked_event = asyncio.Event()
+        self.error = None
+
+    def on_notify(self, _sender, data):
+        op, status, value = struct.unpack("<BBI", bytes(data[:6]))
+        op &= ~REPLY
+        if status != 0:
+            self.error = f"op {op}: {STATUS[status] if status < len(STATUS) else status}"
+            self.acked_event.set()
+        if op == OP_ACK:
+            self.acked = value
+            self.acked_event.set()
+        else:
+            self.replies.put_nowait((op, status, value))
+
+    async def expect(self, op, timeout):
+        got, status, value = await asyncio.wait_for(self.replies.get(), timeout)
+        if got != op or status != 0:
+            raise RuntimeError(self.error or f"unexpected reply to op {got}")
+        return value
+
+    async def upload(self, image, fmt, payload, base_id):
+        await self.client.start_notify(OTA_CTRL_UUID, self.on_notify)
+        begin = struct.pack("<BI32sBI8s", OP_BEGIN, len(image), hashlib.sha256(image).digest(),
+                            fmt, len(payload), base_id)
+        await self.client.write_gatt_char(OTA_CTRL_UUID, begin, response=True)
+        # Erasing the slot takes a few seconds
+        window = await self.expect(OP_BEGIN, 30)
+
+        # One ATT write per MTU, the spa acks every half window
+        chunk = self.client.mtu_size - 3
+        sent = 0
+        started = time.monotonic()
+        while sent < len(payload):
+            while sent - self.acked + chunk > window and self.error is None:
+                self.acked_event.clear()
+                await asyncio.wait_for(self.acked_event.wait(), 10)
+            if self.error is not None:
+                raise RuntimeError(self.error)
+            data = payload[sent:sent + chunk]
+            await self.client.write_gatt_char(OTA_DATA_UUID, data, response=False)
+            sent += len(data)
+            print(f"\r{sent}/{len(payload)} bytes", end="", flush=True)
+
+        while self.acked < len(payload) and self.error is None:
+            self.acked_event.clear()
+            await asyncio.wait_for(self.acked_event.wait(), 10)
+        elapsed = time.monotonic() - started
+        print(f"\n{len(payload)} bytes on air for a {len(image)} byte image in {elapsed:.1f} s, "
+              f"{len(payload) / elapsed / 1024:.1f} kB/s")
+
+        await self.client.write_gatt_char(OTA_CTRL_UUID, bytes([OP_END]), response=True)
+        await self.expect(OP_END, 30)
+        print("Image verified, the spa restarts into it")
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image")
+    parser.add_argument("--name", default="OPEN_SPA")
+    parser.add_argument("--address")
+    parser.add_argument("--base", help="image the spa is running, sends a delta against it")
+    parser.add_argument("--raw", action="store_true", help="send the image uncompressed")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    base = None
+    base_id = bytes(8)
+    if args.raw:
+        fmt = ota_patch.FORMAT_RAW
+    elif args.base:
+        fmt = ota_patch.FORMAT_DELTA
+        with open(args.base, "rb") as f:
+            base = f.read()
+        base_id = ota_patch.elf_sha256(base)[:8]
+    else:
+        fmt = ota_patch.FORMAT_DEFLATE
+    payload = ota_patch.make_payload(image, fmt, base)
+
+    if args.address:
+        device = args.address
+    else:
+        device = await BleakScanner.find_device_by_name(args.name)
+        if device is None:
+            sys.exit(f"{args.name} not found")
+
+    async with BleakClient(device) as client:
+        ota = Ota(client)
+        try:
+            await ota.upload(image, fmt, payload, base_id)
+        except (RuntimeError, asyncio.TimeoutError) as e:
+            print(f"\nUpdate failed: {e or 'timeout'}")
+            await client.write_gatt_char(OTA_CTRL_UUID, bytes([OP_ABORT]), response=True)
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
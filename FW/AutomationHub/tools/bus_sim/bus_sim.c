@@ -0,0 +1,556 @@
+/* RS485 / Modbus RTU bus simulator.
+
+   Runs the firmware's frame layer (main/src/rs485_bus.c) and RTU slave (main/src/modbus_rtu.c)
+   on Linux. Every endpoint sits on its own pseudo terminal and a hub thread carries bytes
+   between them like a multi drop RS485 line: whatever one endpoint sends reaches all others
+   after the time it takes on the wire at the simulated baud rate, with optional corruption
+   and loss.
+
+   Benchmark (default): simulated slaves at addresses 1..N and a master polling them
+   round robin, one run per baud rate. Reports exchanges/s, round trip p50/p99, and what a
+   corrupted frame costs: bus time the master loses, and slave CPU time to reject it.
+
+   --check runs the benchmark on a clean line, no corruption or loss, and fails if any
+   exchange times out or comes back wrong, or a slave rejects a frame.
+
+   --expose adds a pty for an outside program (mbpoll, pymodbus, a real master under test),
+   prints its path and serves the simulated slaves until interrupted.
+
+   make && ./bus_sim --slaves 3 --regs 16 --error-rate 0.01
+   make check
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "inc/modbus_crc.h"
+#include "inc/modbus_rtu.h"
+#include "inc/rs485_bus.h"
+#include "port_pty.h"
+
+#define MAX_ENDPOINTS           (16)
+#define SLAVE_REGS              (125)
+#define BITS_PER_CHAR           (10)        // 8N1
+#define GAP_FLOOR_US            (250)       // Below this the host scheduler makes idle detection unreliable
+
+static const uint32_t default_bauds[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+
+typedef struct {
+    uint32_t bauds[16];
+    int baud_count;
+    int slaves;
+    int poll;                       // Addresses the benchmark master polls, 1..poll
+    int regs;
+    double error_rate;
+    double drop_rate;
+    uint32_t turnaround_us;
+    uint32_t timeout_ms;
+    uint32_t gap_us;                // 0 picks 3.5 characters
+    double duration_s;
+    bool expose;
+    bool check;
+} sim_config_t;
+
+static sim_config_t config = {
+    .slaves = 3,
+    .regs = 10,
+    .timeout_ms = 100,
+    .duration_s = 2.0,
+};
+
+static _Atomic uint32_t baud = 115200;
+
+typedef struct {
+    int master_fd;
+    char path[64];
+    port_pty_t pty;
+    rs485_port_t port;
+} endpoint_t;
+
+static endpoint_t endpoints[MAX_ENDPOINTS];
+static int endpoint_count = 0;
+
+// Hub counters
+static atomic_uint_fast64_t hub_frames;
+static atomic_uint_fast64_t hub_corrupted;
+static atomic_uint_fast64_t hub_dropped;
+
+typedef struct {
+    uint8_t address;
+    endpoint_t *endpoint;
+    uint16_t regs[SLAVE_REGS];
+    atomic_uint_fast64_t answered;
+    atomic_uint_fast64_t answered_ns;
+    atomic_uint_fast64_t crc_rejected;
+    atomic_uint_fast64_t crc_rejected_ns;
+    atomic_uint_fast64_t ignored;
+} sim_slave_t;
+
+static sim_slave_t slaves[MAX_ENDPOINTS];
+static __thread sim_slave_t *current_slave;
+
+static void sleep_us(int64_t us)
+{
+    if (us <= 0) {
+        return;
+    }
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {
+    }
+}
+
+static int64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t wire_us(size_t bytes, uint32_t rate)
+{
+    return (int64_t)bytes * BITS_PER_CHAR * 1000000 / rate;
+}
+
+static uint32_t gap_for(uint32_t rate)
+{
+    if (config.gap_us != 0) {
+        return config.gap_us;
+    }
+    uint32_t gap = wire_us(7, rate) / 2;            // 3.5 characters
+    return gap < GAP_FLOOR_US ? GAP_FLOOR_US : gap;
+}
+
+static bool endpoint_open(endpoint_t *endpoint)
+{
+    endpoint->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (endpoint->master_fd < 0 || grantpt(endpoint->master_fd) != 0 || unlockpt(endpoint->master_fd) != 0 ||
+        ptsname_r(endpoint->master_fd, endpoint->path, sizeof(endpoint->path)) != 0) {
+        return false;
+    }
+    // Open the slave side here as well, the master side reads EIO while nothing holds it
+    return port_pty_open(&endpoint->pty, &endpoint->port, endpoint->path, gap_for(baud));
+}
+
+// The line: one chunk at a time, held for its time on the wire, then seen by every other endpoint
+static void *hub_task(void *arg)
+{
+    struct pollfd fds[MAX_ENDPOINTS];
+    uint8_t buffer[MODBUS_RTU_FRAME_MAX * 2];
+
+    for (int i = 0; i < endpoint_count; i++) {
+        fds[i] = (struct pollfd) { .fd = endpoints[i].master_fd, .events = POLLIN };
+    }
+    for (;;) {
+        if (poll(fds, endpoint_count, -1) < 0) {
+            continue;
+        }
+        for (int i = 0; i < endpoint_count; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            ssize_t length = read(fds[i].fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                continue;
+            }
+            sleep_us(wire_us(length, baud));
+            hub_frames++;
+            if (drand48() < config.drop_rate) {
+                hub_dropped++;
+                continue;
+            }
+            if (drand48() < config.error_rate) {
+                buffer[lrand48() % length] ^= 1 << (lrand48() % 8);
+                hub_corrupted++;
+            }
+            for (int j = 0; j < endpoint_count; j++) {
+                if (j != i && write(fds[j].fd, buffer, length) < 0) {
+                    perror("hub write");
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static uint8_t slave_read(uint8_t *out, uint16_t first, uint16_t count)
+{
+    if (first + count > SLAVE_REGS) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+    for (int reg = first; reg < first + count; reg++) {
+        uint16_t value = current_slave->regs[reg]++;
+        *out++ = value >> 8;
+        *out++ = value & 0xFF;
+    }
+    return MODBUS_EX_NONE;
+}
+
+static uint8_t slave_write(const uint8_t *in, uint16_t first, uint16_t count)
+{
+    if (first + count > SLAVE_REGS) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+    for (int reg = first; reg < first + count; reg++, in += 2) {
+        current_slave->regs[reg] = in[0] << 8 | in[1];
+    }
+    return MODBUS_EX_NONE;
+}
+
+// Same loop as the native slave in bus_manager.c, plus timing
+static void *slave_task(void *arg)
+{
+    sim_slave_t *sim = arg;
+    modbus_rtu_slave_t slave = {
+        .address = sim->address,
+        .read_input = slave_read,
+        .read_holding = slave_read,
+        .write_holding = slave_write,
+    };
+    rs485_bus_t bus;
+
+    current_slave = sim;
+    rs485_bus_init(&bus, &sim->endpoint->port);
+    for (;;) {
+        rs485_frame_t *request = rs485_receive(&bus, RS485_WAIT_FOREVER);
+        if (request == NULL) {
+            continue;
+        }
+        rs485_frame_t *response = rs485_frame_alloc(&bus);
+        int64_t started = thread_cpu_ns();
+        response->length = modbus_rtu_slave_handle(&slave, request->data, request->length, response->data);
+        int64_t spent = thread_cpu_ns() - started;
+
+        if (response->length > 0) {
+            sim->answered++;
+            sim->answered_ns += spent;
+        } else if (request->length >= 4 && modbus_crc16(request->data, request->length) != 0) {
+            sim->crc_rejected++;
+            sim->crc_rejected_ns += spent;
+        } else {
+            sim->ignored++;
+        }
+        rs485_frame_free(&bus, request);
+        if (response->length > 0) {
+            sleep_us(config.turnaround_us);
+            rs485_send(&bus, response, false);
+        } else {
+            rs485_frame_free(&bus, response);
+        }
+    }
+    return NULL;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        checks++;                                               \
+        if (!(cond)) {                                          \
+            failures++;                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
+
+typedef struct {
+    uint32_t exchanges;
+    uint32_t ok;
+    uint32_t timeouts;
+    uint32_t bad_crc;
+    uint32_t bad_response;
+    int64_t lost_us;                // Time spent on exchanges that failed
+    int64_t elapsed_us;
+    int64_t p50_us;
+    int64_t p99_us;
+} bench_result_t;
+
+enum { EXCHANGE_OK, EXCHANGE_TIMEOUT, EXCHANGE_CRC, EXCHANGE_BAD };
+
+// One read input registers request and its response
+static int exchange(rs485_bus_t *bus, uint8_t address, int64_t *rtt_us)
+{
+    rs485_frame_t *request = rs485_frame_alloc(bus);
+    uint8_t *p = request->data;
+    *p++ = address;
+    *p++ = MODBUS_FC_READ_INPUT;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = config.regs >> 8;
+    *p++ = config.regs & 0xFF;
+    uint16_t crc = modbus_crc16(request->data, 6);
+    *p++ = crc & 0xFF;
+    *p++ = crc >> 8;
+    request->length = 8;
+
+    int64_t started = port_pty_now_us();
+    int64_t deadline = started + (int64_t)config.timeout_ms * 1000;
+    rs485_send(bus, request, false);
+
+    for (;;) {
+        int64_t left = deadline - port_pty_now_us();
+        if (left <= 0) {
+            *rtt_us = port_pty_now_us() - started;
+            return EXCHANGE_TIMEOUT;
+        }
+        rs485_frame_t *response = rs485_receive(bus, (left + 999) / 1000);
+        if (response == NULL) {
+            continue;
+        }
+        int result;
+        if (response->length < 4 || modbus_crc16(response->data, response->length) != 0) {
+            result = EXCHANGE_CRC;
+        } else if (response->data[0] != address || response->data[1] != MODBUS_FC_READ_INPUT ||
+                   response->length != 5 + config.regs * 2) {
+            result = EXCHANGE_BAD;
+        } else {
+            result = EXCHANGE_OK;
+        }
+        rs485_frame_free(bus, response);
+        *rtt_us = port_pty_now_us() - started;
+        return result;
+    }
+}
+
+static void run_bench(endpoint_t *master, uint32_t rate, bench_result_t *result)
+{
+    size_t capacity = 1024;
+    int64_t *samples = malloc(capacity * sizeof(*samples));
+    rs485_bus_t bus;
+
+    baud = rate;
+    for (int i = 0; i < endpoint_count; i++) {
+        endpoints[i].pty.gap_us = gap_for(rate);
+    }
+    rs485_bus_init(&bus, &master->port);
+    memset(result, 0, sizeof(*result));
+
+    int64_t started = port_pty_now_us();
+    int64_t end = started + config.duration_s * 1000000;
+    while (port_pty_now_us() < end) {
+        int64_t rtt;
+        uint8_t address = 1 + result->exchanges % config.poll;
+        int status = exchange(&bus, address, &rtt);
+        result->exchanges++;
+        switch (status) {
+            case EXCHANGE_OK:
+                if (result->ok == capacity) {
+                    capacity *= 2;
+                    samples = realloc(samples, capacity * sizeof(*samples));
+                }
+                samples[result->ok++] = rtt;
+                break;
+            case EXCHANGE_TIMEOUT:  result->timeouts++;         result->lost_us += rtt; break;
+            case EXCHANGE_CRC:      result->bad_crc++;          result->lost_us += rtt; break;
+            default:                result->bad_response++;     result->lost_us += rtt; break;
+        }
+    }
+    result->elapsed_us = port_pty_now_us() - started;
+
+    if (result->ok > 0) {
+        qsort(samples, result->ok, sizeof(*samples), compare_us);
+        result->p50_us = samples[result->ok / 2];
+        result->p99_us = samples[(result->ok * 99) / 100];
+    }
+    free(samples);
+    // Let a late response clear the line before the next run
+    sleep_us(config.timeout_ms * 1000);
+}
+
+static void print_slave_costs(void)
+{
+    uint64_t answered = 0, answered_ns = 0, rejected = 0, rejected_ns = 0, ignored = 0;
+    for (int i = 0; i < config.slaves; i++) {
+        answered += slaves[i].answered;
+        answered_ns += slaves[i].answered_ns;
+        rejected += slaves[i].crc_rejected;
+        rejected_ns += slaves[i].crc_rejected_ns;
+        ignored += slaves[i].ignored;
+    }
+    printf("\nHub: %llu frames, %llu corrupted, %llu dropped\n", (unsigned long long)hub_frames,
+           (unsigned long long)hub_corrupted, (unsigned long long)hub_dropped);
+    printf("Slave CPU: %llu answered, %.2f us each; %llu rejected on CRC, %.2f us each; %llu for others\n",
+           (unsigned long long)answered, answered ? answered_ns / 1000.0 / answered : 0.0,
+           (unsigned long long)rejected, rejected ? rejected_ns / 1000.0 / rejected : 0.0,
+           (unsigned long long)ignored);
+}
+
+static void bench(endpoint_t *master)
+{
+    size_t request = 8;
+    size_t response = 5 + config.regs * 2;
+
+    printf("Reading %d input registers from %d slave(s), turnaround %u us, %.1f%% corrupted, %.1f%% lost\n\n",
+           config.regs, config.poll, config.turnaround_us, config.error_rate * 100, config.drop_rate * 100);
+    printf("%8s %9s %9s %9s %9s %9s %8s %8s %11s\n", "baud", "wire us", "frames/s", "rtt p50", "rtt p99",
+           "bus busy", "timeout", "bad crc", "lost/error");
+    for (int i = 0; i < config.baud_count; i++) {
+        uint32_t rate = config.bauds[i];
+        bench_result_t r;
+        run_bench(master, rate, &r);
+
+        uint32_t failed = r.timeouts + r.bad_crc + r.bad_response;
+        // Ideal exchange: both frames on the wire plus the idle gap that ends each of them
+        int64_t wire = wire_us(request + response, rate) + 2 * gap_for(rate);
+        double per_s = r.ok * 1e6 / r.elapsed_us;
+        double busy = 100.0 * (wire_us(request + response, rate) * r.ok) / r.elapsed_us;
+        printf("%8u %9lld %9.1f %7.2fms %7.2fms %8.1f%% %8u %8u %9.2fms\n", rate, (long long)wire, per_s,
+               r.p50_us / 1000.0, r.p99_us / 1000.0, busy, r.timeouts, r.bad_crc,
+               failed ? r.lost_us / 1000.0 / failed : 0.0);
+        if (config.check) {
+            CHECK(r.ok > 0 && r.ok == r.exchanges, "%u baud: %u of %u exchanges answered", rate, r.ok, r.exchanges);
+            CHECK(r.timeouts == 0, "%u baud: %u timeouts", rate, r.timeouts);
+            CHECK(r.bad_crc == 0 && r.bad_response == 0, "%u baud: %u bad crc, %u bad responses", rate, r.bad_crc,
+                  r.bad_response);
+        }
+    }
+    print_slave_costs();
+    if (config.check) {
+        for (int i = 0; i < config.slaves; i++) {
+            CHECK(slaves[i].crc_rejected == 0, "slave %d rejected %llu frames on CRC", slaves[i].address,
+                  (unsigned long long)slaves[i].crc_rejected);
+        }
+        printf("%d checks, %d failures\n", checks, failures);
+    }
+}
+
+static bool parse_bauds(char *list)
+{
+    config.baud_count = 0;
+    for (char *token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (config.baud_count == (int)(sizeof(config.bauds) / sizeof(config.bauds[0]))) {
+            return false;
+        }
+        config.bauds[config.baud_count++] = strtoul(token, NULL, 10);
+    }
+    return config.baud_count > 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --baud LIST         comma separated, default 9600..921600\n"
+            "  --slaves N          simulated slaves at addresses 1..N (default 3)\n"
+            "  --poll N            addresses the benchmark polls (default --slaves)\n"
+            "  --regs N            input registers per request (default 10)\n"
+            "  --turnaround US     slave delay before answering (default 0)\n"
+            "  --error-rate P      share of frames with a flipped bit (default 0)\n"
+            "  --drop-rate P       share of frames lost (default 0)\n"
+            "  --timeout MS        master response timeout (default 100)\n"
+            "  --gap US            idle time that ends a frame (default 3.5 characters, at least %d)\n"
+            "  --duration S        seconds per baud rate (default 2)\n"
+            "  --check             fail on any lost or wrong exchange, only on a clean line\n"
+            "  --expose            serve the slaves on an extra pty instead of benchmarking\n",
+            name, GAP_FLOOR_US);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "baud", required_argument, NULL, 'b' },
+        { "slaves", required_argument, NULL, 's' },
+        { "poll", required_argument, NULL, 'p' },
+        { "regs", required_argument, NULL, 'r' },
+        { "turnaround", required_argument, NULL, 't' },
+        { "error-rate", required_argument, NULL, 'e' },
+        { "drop-rate", required_argument, NULL, 'd' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "gap", required_argument, NULL, 'g' },
+        { "duration", required_argument, NULL, 'D' },
+        { "check", no_argument, NULL, 'c' },
+        { "expose", no_argument, NULL, 'x' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    memcpy(config.bauds, default_bauds, sizeof(default_bauds));
+    config.baud_count = sizeof(default_bauds) / sizeof(default_bauds[0]);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!parse_bauds(optarg)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 's': config.slaves = atoi(optarg); break;
+            case 'p': config.poll = atoi(optarg); break;
+            case 'r': config.regs = atoi(optarg); break;
+            case 't': config.turnaround_us = atoi(optarg); break;
+            case 'e': config.error_rate = atof(optarg); break;
+            case 'd': config.drop_rate = atof(optarg); break;
+            case 'T': config.timeout_ms = atoi(optarg); break;
+            case 'g': config.gap_us = atoi(optarg); break;
+            case 'D': config.duration_s = atof(optarg); break;
+            case 'c': config.check = true; break;
+            case 'x': config.expose = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (config.poll == 0) {
+        config.poll = config.slaves;
+    }
+    if (config.slaves < 0 || config.slaves > MAX_ENDPOINTS - 1 || config.poll < 1 || config.poll > 247 ||
+        config.regs < 1 || config.regs > 125 || (config.check && (config.error_rate > 0 || config.drop_rate > 0))) {
+        usage(argv[0]);
+        return 2;
+    }
+    baud = config.bauds[0];
+    srand48(1);
+    modbus_crc_init();
+
+    endpoint_t *master = &endpoints[endpoint_count++];
+    if (!endpoint_open(master)) {
+        perror("pty");
+        return 1;
+    }
+    for (int i = 0; i < config.slaves; i++) {
+        endpoint_t *endpoint = &endpoints[endpoint_count++];
+        if (!endpoint_open(endpoint)) {
+            perror("pty");
+            return 1;
+        }
+        slaves[i].address = i + 1;
+        slaves[i].endpoint = endpoint;
+        pthread_t thread;
+        pthread_create(&thread, NULL, slave_task, &slaves[i]);
+    }
+    pthread_t hub;
+    pthread_create(&hub, NULL, hub_task, NULL);
+
+    if (config.expose) {
+        // The first endpoint is left to the outside program, its side is held open by us
+        printf("Bus at %u baud on %s, slaves 1..%d. Ctrl-C to stop.\n", (uint32_t)baud, master->path,
+               config.slaves);
+        fflush(stdout);
+        for (;;) {
+            pause();
+        }
+    }
+    if (config.slaves == 0) {
+        fprintf(stderr, "Nothing to benchmark without --slaves\n");
+        return 2;
+    }
+    bench(master);
+    return failures != 0;
+}
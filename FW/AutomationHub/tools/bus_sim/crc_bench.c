@@ -0,0 +1,108 @@
+/* Modbus CRC check and microbenchmark.
+
+   Checks every implementation in main/src/modbus_crc.c bit for bit against usMBCRC16 from
+   esp-modbus (built from managed_components with the shims in shim/), then times them on
+   8, 64 and 256 byte frames. Cycles are TSC cycles on x86, elsewhere only ns are shown.
+   The on-target numbers come from CONFIG_MODBUS_CRC_BENCHMARK.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC                (1)
+#endif
+#include "inc/modbus_crc.h"
+
+#define ROUNDS                  (200000)
+
+unsigned short usMBCRC16(unsigned char *frame, unsigned short length);
+
+static uint16_t reference_crc(const uint8_t *data, size_t length)
+{
+    return usMBCRC16((unsigned char *)data, length);
+}
+
+typedef struct {
+    const char *name;
+    uint16_t (*crc)(const uint8_t *data, size_t length);
+} crc_impl_t;
+
+static const crc_impl_t impls[] = {
+    { "esp-modbus", reference_crc },
+    { "bitwise", modbus_crc16_bitwise },
+    { "table", modbus_crc16_table },
+    { "slice4", modbus_crc16_slice4 },
+    { "slice8", modbus_crc16_slice8 },
+};
+#define IMPL_COUNT              (sizeof(impls) / sizeof(impls[0]))
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(void)
+{
+    static uint8_t buffer[256 + 8];
+    static const size_t sizes[] = { 8, 64, 256 };
+    volatile uint16_t sink = 0;
+
+    modbus_crc_init();
+    srand(1);
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = rand();
+    }
+
+    // Every frame length at every alignment, then random frames
+    long checked = 0;
+    int mismatches = 0;
+    for (size_t length = 0; length <= 256; length++) {
+        for (int offset = 0; offset < 8; offset++) {
+            uint16_t expected = reference_crc(&buffer[offset], length);
+            for (size_t j = 1; j < IMPL_COUNT; j++, checked++) {
+                mismatches += impls[j].crc(&buffer[offset], length) != expected;
+            }
+        }
+    }
+    for (int round = 0; round < 100000; round++) {
+        size_t length = rand() % 257;
+        for (size_t i = 0; i < length; i++) {
+            buffer[i] = rand();
+        }
+        uint16_t expected = reference_crc(buffer, length);
+        for (size_t j = 1; j < IMPL_COUNT; j++, checked++) {
+            mismatches += impls[j].crc(buffer, length) != expected;
+        }
+    }
+    printf("%ld CRCs checked against esp-modbus, %d mismatches\n\n", checked, mismatches);
+
+    printf("%-11s", "");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        printf(" %16zu B", sizes[s]);
+    }
+    printf("\n");
+    for (size_t j = 0; j < IMPL_COUNT; j++) {
+        printf("%-11s", impls[j].name);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            int64_t started = now_ns();
+#ifdef HAVE_TSC
+            uint64_t tsc = __rdtsc();
+#endif
+            for (int round = 0; round < ROUNDS; round++) {
+                sink += impls[j].crc(buffer, sizes[s]);
+            }
+            double bytes = (double)ROUNDS * sizes[s];
+#ifdef HAVE_TSC
+            printf(" %5.2f c/B %5.2f ns/B", (__rdtsc() - tsc) / bytes, (now_ns() - started) / bytes);
+#else
+            printf(" %14.2f ns/B", (now_ns() - started) / bytes);
+#endif
+        }
+        printf("\n");
+    }
+    (void)sink;
+    return mismatches != 0;
+}
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "port_pty.h"
+
+int64_t port_pty_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// poll() with a microsecond timeout, -1 waits forever
+static int wait_readable(int fd, int64_t wait_us)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timespec ts = { .tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000 };
+    int result;
+    do {
+        result = ppoll(&pfd, 1, wait_us < 0 ? NULL : &ts, NULL);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+static bool pty_wait_event(void *ctx, rs485_event_t *event, uint32_t wait_ms)
+{
+    port_pty_t *pty = ctx;
+    int64_t wait_us = pty->receiving ? (int64_t)pty->gap_us
+                    : wait_ms == RS485_WAIT_FOREVER ? -1 : (int64_t)wait_ms * 1000;
+    int result = wait_readable(pty->fd, wait_us);
+    if (result < 0) {
+        return false;
+    }
+    event->type = RS485_EVENT_DATA;
+    if (result == 0) {
+        if (!pty->receiving) {
+            return false;
+        }
+        pty->receiving = false;
+        event->size = 0;
+        event->idle = true;
+        return true;
+    }
+    int available = 0;
+    ioctl(pty->fd, FIONREAD, &available);
+    pty->receiving = true;
+    event->size = available;
+    event->idle = false;
+    return true;
+}
+
+static int pty_read(void *ctx, uint8_t *data, size_t size)
+{
+    port_pty_t *pty = ctx;
+    return read(pty->fd, data, size);
+}
+
+static int pty_write(void *ctx, const uint8_t *data, size_t size)
+{
+    port_pty_t *pty = ctx;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = write(pty->fd, data + written, size - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += result;
+    }
+    return written;
+}
+
+static bool pty_wait_tx_done(void *ctx, uint32_t wait_ms)
+{
+    port_pty_t *pty = ctx;
+    return tcdrain(pty->fd) == 0;
+}
+
+bool port_pty_open(port_pty_t *pty, rs485_port_t *port, const char *path, uint32_t gap_us)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return false;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    pty->fd = fd;
+    pty->gap_us = gap_us;
+    pty->receiving = false;
+    *port = (rs485_port_t) {
+        .ctx = pty,
+        .wait_event = pty_wait_event,
+        .read = pty_read,
+        .write = pty_write,
+        .wait_tx_done = pty_wait_tx_done,
+        .now_us = port_pty_now_us,
+    };
+    return true;
+}
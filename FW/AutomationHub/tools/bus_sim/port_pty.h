@@ -0,0 +1,20 @@
+#ifndef _PORT_PTY_H_
+#define _PORT_PTY_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "inc/rs485_bus.h"
+
+// rs485_bus port on the slave side of a pseudo terminal. There is no RX timeout in a pty,
+// so the line counts as idle once nothing arrived for gap_us after the last byte.
+typedef struct {
+    int fd;
+    _Atomic uint32_t gap_us;
+    bool receiving;
+} port_pty_t;
+
+// Opens path raw, fills port. false with errno set on failure.
+bool port_pty_open(port_pty_t *pty, rs485_port_t *port, const char *path, uint32_t gap_us);
+int64_t port_pty_now_us(void);
+
+#endif // _PORT_PTY_H_
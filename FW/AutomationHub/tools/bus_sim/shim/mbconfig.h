@@ -0,0 +1,4 @@
+#ifndef _MB_CONFIG_H_
+#define _MB_CONFIG_H_
+#define MB_SLAVE_RTU_ENABLED    (1)
+#endif
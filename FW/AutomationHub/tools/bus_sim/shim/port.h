@@ -0,0 +1,6 @@
+// Just enough of the esp-modbus port layer to build its mbcrc.c on the host
+#ifndef _PORT_H_
+#define _PORT_H_
+typedef unsigned char UCHAR;
+typedef unsigned short USHORT;
+#endif
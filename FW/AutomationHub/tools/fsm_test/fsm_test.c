@@ -0,0 +1,245 @@
+/* Spa state machine check and microbenchmark.
+
+   Walks main/src/spa_fsm.c through every state, event and heat demand and compares each
+   result against the table below, written out from the intended behaviour rather than
+   copied from the firmware's: the next state, the actions asked for, the output mask, and
+   that nothing is asked of the caller when nothing changes. Then checks the request
+   helpers, and that the transition states are never entered, and times spa_fsm_dispatch
+   on a realistic event mix. Cycles are TSC cycles on x86, elsewhere only ns are shown.
+
+   make check
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC                (1)
+#endif
+#include "inc/output_manager.h"
+#include "inc/spa_fsm.h"
+
+#define ROUNDS                  (10000000)
+
+#define CIRC_PUMP               OUTPUT_BIT(eOutput1)
+#define HEATER                  OUTPUT_BIT(eOutput2)
+#define JETS_PUMP               OUTPUT_BIT(eOutput3)
+
+#define ENTER_HEATING           (FSM_ACT_START_CIRC_TIMER | FSM_ACT_STOP_JETS_TIMER)
+#define ENTER_JETS              (FSM_ACT_START_JETS_TIMER | FSM_ACT_STOP_CIRC_TIMER)
+#define ENTER_FAULT             (FSM_ACT_STOP_CIRC_TIMER | FSM_ACT_STOP_JETS_TIMER | FSM_ACT_CANCEL_TIMED_OUTPUTS)
+
+typedef struct {
+    uint8_t state;
+    spa_fsm_event_t event;
+    uint8_t next;
+    uint8_t actions;
+} expected_t;
+
+// Everything not listed is ignored
+static const expected_t expected[] = {
+    { startup, evStart,         heating,    ENTER_HEATING },
+    { startup, evFault,         fault,      ENTER_FAULT },
+    { idle,    evHeatRequest,   heating,    ENTER_HEATING },
+    { idle,    evJetsRequest,   jets,       ENTER_JETS },
+    { idle,    evCircTimer,     heating,    ENTER_HEATING },
+    { idle,    evFault,         fault,      ENTER_FAULT },
+    { heating, evHeatRequest,   heating,    ENTER_HEATING },
+    { heating, evJetsRequest,   jets,       ENTER_JETS },
+    { heating, evCircTimer,     idle,       0 },
+    { heating, evFault,         fault,      ENTER_FAULT },
+    { jets,    evHeatRequest,   heating,    ENTER_HEATING },
+    { jets,    evJetsRequest,   jets,       ENTER_JETS },
+    { jets,    evJetsTimer,     heating,    ENTER_HEATING },
+    { jets,    evFault,         fault,      ENTER_FAULT },
+};
+#define EXPECTED_COUNT          (sizeof(expected) / sizeof(expected[0]))
+
+static const char *state_names[NUMBER_OF_STATES] = {
+    "startup", "transitionToHeating", "idle", "heating", "transitionToJets", "jets", "fault",
+};
+static const char *event_names[NUMBER_OF_EVENTS] = {
+    "evStart", "evHeatRequest", "evJetsRequest", "evCircTimer", "evJetsTimer", "evFault", "evTempUpdate",
+};
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        checks++;                                               \
+        if (!(cond)) {                                          \
+            failures++;                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
+
+static uint32_t outputs_for(uint8_t state, bool demand)
+{
+    switch (state) {
+        case heating:   return CIRC_PUMP | (demand ? HEATER : 0);
+        case jets:      return JETS_PUMP;
+        default:        return 0;
+    }
+}
+
+static const expected_t *lookup(uint8_t state, spa_fsm_event_t event)
+{
+    for (size_t i = 0; i < EXPECTED_COUNT; i++) {
+        if (expected[i].state == state && expected[i].event == event) {
+            return &expected[i];
+        }
+    }
+    return NULL;
+}
+
+// A machine resting in state, with outputs already handed out for the demand it had then
+static void settle(spa_fsm_t *fsm, uint8_t state, bool previous_demand, bool demand)
+{
+    spa_fsm_init(fsm);
+    fsm->state = state;
+    fsm->outputs = outputs_for(state, previous_demand);
+    spa_fsm_set_heat_demand(fsm, demand);
+}
+
+static void check_table(void)
+{
+    for (int state = 0; state < NUMBER_OF_STATES; state++) {
+        for (int event = 0; event < NUMBER_OF_EVENTS; event++) {
+            for (int previous = 0; previous < 2; previous++) {
+                for (int demand = 0; demand < 2; demand++) {
+                    const char *s = state_names[state], *e = event_names[event];
+                    spa_fsm_t fsm;
+                    spa_fsm_result_t result;
+                    settle(&fsm, state, previous, demand);
+                    uint32_t before = fsm.outputs;
+                    bool act = spa_fsm_dispatch(&fsm, event, &result);
+
+                    const expected_t *want = lookup(state, event);
+                    uint8_t next = want != NULL ? want->next : state;
+                    uint32_t outputs = outputs_for(next, demand);
+                    CHECK(result.from == state, "%s %s: from %d", s, e, result.from);
+                    CHECK(result.transitioned == (want != NULL), "%s %s: transitioned %d", s, e, result.transitioned);
+                    CHECK(result.to == next && fsm.state == next, "%s %s: to %d, expected %d", s, e, result.to, next);
+                    CHECK(result.actions == (want != NULL ? want->actions : 0), "%s %s: actions 0x%x", s, e,
+                          result.actions);
+                    CHECK(result.outputs == outputs && fsm.outputs == outputs, "%s %s demand %d: outputs 0x%x, expected 0x%x",
+                          s, e, demand, result.outputs, outputs);
+                    CHECK(result.outputsChanged == (outputs != before), "%s %s: outputsChanged %d", s, e,
+                          result.outputsChanged);
+                    // Only asks the caller for something when there is something to do
+                    CHECK(act == (want != NULL || outputs != before), "%s %s demand %d->%d: returned %d", s, e,
+                          previous, demand, act);
+
+                    // The same event again with nothing new only acts when it moves the machine on
+                    bool again = spa_fsm_dispatch(&fsm, event, &result);
+                    const expected_t *repeat = lookup(next, event);
+                    bool changed = repeat != NULL && outputs_for(repeat->next, demand) != outputs;
+                    CHECK(result.outputsChanged == changed, "%s %s: outputsChanged %d on repeat", s, e,
+                          result.outputsChanged);
+                    CHECK(again == (repeat != NULL), "%s %s: repeat returned %d", s, e, again);
+                }
+            }
+        }
+    }
+}
+
+static void check_reachable(void)
+{
+    // Nothing leads into the transition states, and nothing leads out of fault
+    for (size_t i = 0; i < EXPECTED_COUNT; i++) {
+        CHECK(expected[i].next != transitionToHeating && expected[i].next != transitionToJets,
+              "expected table enters a transition state");
+    }
+    for (int state = 0; state < NUMBER_OF_STATES; state++) {
+        if (state == transitionToHeating || state == transitionToJets) {
+            continue;
+        }
+        for (int event = 0; event < NUMBER_OF_EVENTS; event++) {
+            spa_fsm_t fsm;
+            spa_fsm_result_t result;
+            settle(&fsm, state, false, false);
+            spa_fsm_dispatch(&fsm, event, &result);
+            CHECK(result.to != transitionToHeating && result.to != transitionToJets, "%s %s enters %s",
+                  state_names[state], event_names[event], state_names[result.to]);
+            if (state == fault) {
+                CHECK(result.to == fault, "fault left on %s", event_names[event]);
+            }
+        }
+    }
+
+    spa_fsm_t fsm;
+    spa_fsm_result_t result;
+    spa_fsm_init(&fsm);
+    CHECK(fsm.state == startup && fsm.outputs == 0 && !fsm.heatDemand, "init");
+    CHECK(!spa_fsm_dispatch(&fsm, NUMBER_OF_EVENTS, &result) && !result.transitioned, "out of range event acted on");
+    CHECK(fsm.state == startup, "out of range event moved the machine");
+}
+
+static void check_requests(void)
+{
+    for (int mode = 0; mode < NUMBER_OF_STATES + 2; mode++) {
+        bool request = mode == transitionToHeating || mode == transitionToJets;
+        CHECK(spa_fsm_is_request(mode) == request, "mode %d request %d", mode, spa_fsm_is_request(mode));
+    }
+    CHECK(spa_fsm_request_event(transitionToHeating) == evHeatRequest, "heating request event");
+    CHECK(spa_fsm_request_event(transitionToJets) == evJetsRequest, "jets request event");
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Mostly temperature samples flipping the heater, with the odd timer and request
+static void bench(void)
+{
+    static spa_fsm_event_t events[1024];
+    static bool demands[1024];
+    srand(1);
+    for (int i = 0; i < 1024; i++) {
+        int r = rand() % 100;
+        events[i] = r < 85 ? evTempUpdate : (r < 90 ? evCircTimer : (r < 95 ? evHeatRequest :
+                    (r < 98 ? evJetsRequest : evJetsTimer)));
+        demands[i] = rand() % 4 == 0;
+    }
+
+    spa_fsm_t fsm;
+    spa_fsm_result_t result;
+    volatile uint32_t sink = 0;
+    spa_fsm_init(&fsm);
+    spa_fsm_dispatch(&fsm, evStart, &result);
+
+    int64_t started = now_ns();
+#ifdef HAVE_TSC
+    uint64_t tsc = __rdtsc();
+#endif
+    for (int round = 0; round < ROUNDS; round++) {
+        spa_fsm_set_heat_demand(&fsm, demands[round & 1023]);
+        sink += spa_fsm_dispatch(&fsm, events[round & 1023], &result);
+    }
+#ifdef HAVE_TSC
+    double cycles = (double)(__rdtsc() - tsc) / ROUNDS;
+#endif
+    double ns = (double)(now_ns() - started) / ROUNDS;
+#ifdef HAVE_TSC
+    printf("spa_fsm_dispatch %.1f ns, %.1f c per step\n", ns, cycles);
+#else
+    printf("spa_fsm_dispatch %.1f ns per step\n", ns);
+#endif
+    (void)sink;
+}
+
+int main(void)
+{
+    check_table();
+    check_reachable();
+    check_requests();
+    printf("%d checks, %d failures\n", checks, failures);
+    bench();
+    return failures != 0;
+}
@@ -0,0 +1,266 @@
+/* Heater control comparison on a simulated spa.
+
+   Runs the firmware's PI controller (main/src/heater_pid.c) and the on/off hysteresis control
+   from state_handler.c against the same thermal model, one sample per second:
+
+     water           1500 l, losing heat to the air through the shell and cover
+     heater          3 kW element with its own thermal mass, emptied into the water by the
+                     circulation pump, barely at all while the pump is off
+     thermistor      in the heater housing, a first order lag behind the water leaving it,
+                     with a little noise
+
+   From cold it reports, on the water temperature itself, the time to reach the set point, the
+   overshoot past it, the band the water then stays in, and relay cycles per day once there.
+   --cycle M alternates M minutes of heating with M minutes of idle with the pump off, like the
+   circulation schedule, to show how each controller copes with the heater being taken away.
+   --check fails unless both reach the set point without overshooting it by a degree, and PI
+   holds a band no wider than hysteresis at no fewer relay cycles, which is the trade the
+   controllers are picked on.
+
+   make && ./heater_sim --hours 72 --setpoint 37 --ambient 10
+   make check
+*/
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "inc/heater_pid.h"
+
+#define STEP_MS                 (1000)
+#define WATER_J_PER_K           (1500.0 * 4186.0)
+#define HEATER_J_PER_K          (20000.0)
+#define HEATER_W                (3000.0)
+#define FLOW_W_PER_K            (400.0)     // Heater to water with the pump running
+#define STILL_W_PER_K           (15.0)      // Heater to water with the pump off
+#define LOSS_W_PER_K            (25.0)      // Water to air
+#define SENSOR_TAU_S            (60.0)
+#define SENSOR_MIX              (0.05)      // Share of the heater temperature the thermistor sees
+#define HYSTERESIS_VALUE        (1)         // As in state_handler.c
+
+typedef struct {
+    double hours;
+    int setpoint;
+    double ambient;
+    double start;
+    double noise;                   // Thermistor noise, degrees rms
+    int cycle_min;                  // 0 heats all the time
+    bool check;
+} sim_config_t;
+
+static sim_config_t config = {
+    .hours = 72.0,
+    .setpoint = 37,
+    .ambient = 10.0,
+    .start = 15.0,
+    .noise = 0.03,
+};
+
+typedef struct {
+    double water;
+    double heater;
+    double sensor;
+} plant_t;
+
+typedef struct {
+    const char *name;
+    bool reached;
+    double reach_h;
+    double overshoot;
+    double low;
+    double high;
+    uint32_t cycles;                // Off to on switches after reaching the set point
+    double steady_h;
+    double on_h;
+    bool relay;
+} result_t;
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        checks++;                                               \
+        if (!(cond)) {                                          \
+            failures++;                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
+
+// Gaussian noise from a fixed seed, both controllers see the same sequence
+static double noise_sample(unsigned int *seed)
+{
+    double u1 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static void plant_step(plant_t *plant, bool heater_on, bool pump_on, double dt)
+{
+    double coupling = pump_on ? FLOW_W_PER_K : STILL_W_PER_K;
+    double to_water = coupling * (plant->heater - plant->water);
+    double loss = LOSS_W_PER_K * (plant->water - config.ambient);
+    plant->heater += ((heater_on ? HEATER_W : 0.0) - to_water) * dt / HEATER_J_PER_K;
+    plant->water += (to_water - loss) * dt / WATER_J_PER_K;
+    double seen = plant->water + SENSOR_MIX * (plant->heater - plant->water);
+    plant->sensor += (seen - plant->sensor) * dt / SENSOR_TAU_S;
+}
+
+// isAboveSetTemp() from state_handler.c, on whole degrees like the firmware
+static bool hysteresis_above(int temp, bool *above)
+{
+    if (temp > config.setpoint) {
+        *above = true;
+    } else if (*above && temp < config.setpoint - HYSTERESIS_VALUE) {
+        *above = false;
+    }
+    return *above;
+}
+
+static void run(result_t *result, bool pi)
+{
+    plant_t plant = { config.start, config.start, config.start };
+    heater_pid_t pid = { 0 };
+    heater_pid_default_params(&pid.params);
+    bool above = false;
+    unsigned int seed = 1;
+    uint64_t steps = (uint64_t)(config.hours * 3600000.0 / STEP_MS);
+
+    for (uint64_t step = 0; step < steps; step++) {
+        uint32_t now_ms = step * STEP_MS;
+        bool heating = config.cycle_min == 0 || (now_ms / 60000 / config.cycle_min) % 2 == 0;
+        int32_t centi = lround((plant.sensor + config.noise * noise_sample(&seed)) * 100.0);
+
+        bool on;
+        if (pi) {
+            heater_pid_update(&pid, config.setpoint * 100, centi, now_ms, heating);
+            on = heater_pid_relay(&pid, now_ms, heating);
+        } else {
+            int temp = centi / 100;
+            temp = temp < 0 ? 0 : (temp > 50 ? 50 : temp);
+            on = heating && !hysteresis_above(temp, &above);
+        }
+
+        if (result->reached) {
+            double above_setpoint = plant.water - config.setpoint;
+            if (above_setpoint > result->overshoot) {
+                result->overshoot = above_setpoint;
+            }
+            if (plant.water < result->low) {
+                result->low = plant.water;
+            }
+            if (plant.water > result->high) {
+                result->high = plant.water;
+            }
+            result->cycles += on && !result->relay;
+            result->steady_h += STEP_MS / 3600000.0;
+        } else if (plant.water >= config.setpoint) {
+            result->reached = true;
+            result->reach_h = now_ms / 3600000.0;
+            result->low = result->high = plant.water;
+        }
+        result->on_h += on ? STEP_MS / 3600000.0 : 0.0;
+        result->relay = on;
+
+        // The pump runs while heating, see stateOutputs in spa_fsm.c
+        plant_step(&plant, on, heating, STEP_MS / 1000.0);
+    }
+}
+
+static double cycles_per_day(const result_t *result)
+{
+    return result->steady_h > 0 ? result->cycles * 24.0 / result->steady_h : 0.0;
+}
+
+static void print_result(const result_t *result)
+{
+    if (!result->reached) {
+        printf("%-12s %14s\n", result->name, "not reached");
+        return;
+    }
+    double per_day = cycles_per_day(result);
+    printf("%-12s %11.2f h %10.2f C %6.2f..%-6.2f C %12.1f %9.0f%%\n", result->name, result->reach_h,
+           result->overshoot, result->low, result->high, per_day, result->on_h * 100.0 / config.hours);
+}
+
+static void check_results(const result_t *hysteresis, const result_t *pi)
+{
+    const result_t *both[2] = { hysteresis, pi };
+    for (int i = 0; i < 2; i++) {
+        CHECK(both[i]->reached, "%s did not reach the set point", both[i]->name);
+        CHECK(both[i]->overshoot < 1.0, "%s overshoots by %.2f C", both[i]->name, both[i]->overshoot);
+    }
+    CHECK(pi->high - pi->low <= hysteresis->high - hysteresis->low, "PI band %.2f C, hysteresis %.2f C",
+          pi->high - pi->low, hysteresis->high - hysteresis->low);
+    CHECK(cycles_per_day(hysteresis) <= cycles_per_day(pi), "hysteresis %.1f cycles/day, PI %.1f",
+          cycles_per_day(hysteresis), cycles_per_day(pi));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --hours H           simulated time (default 72)\n"
+            "  --setpoint C        whole degrees, like the firmware (default 37)\n"
+            "  --ambient C         air temperature (default 10)\n"
+            "  --start C           water temperature at the start (default 15)\n"
+            "  --noise C           thermistor noise rms (default 0.03)\n"
+            "  --cycle M           M minutes heating, M minutes idle, 0 heats throughout (default 0)\n"
+            "  --check             exit non-zero unless the results match the documented trade\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "hours", required_argument, NULL, 'H' },
+        { "setpoint", required_argument, NULL, 's' },
+        { "ambient", required_argument, NULL, 'a' },
+        { "start", required_argument, NULL, 'S' },
+        { "noise", required_argument, NULL, 'n' },
+        { "cycle", required_argument, NULL, 'c' },
+        { "check", no_argument, NULL, 'C' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'H': config.hours = atof(optarg); break;
+            case 's': config.setpoint = atoi(optarg); break;
+            case 'a': config.ambient = atof(optarg); break;
+            case 'S': config.start = atof(optarg); break;
+            case 'n': config.noise = atof(optarg); break;
+            case 'c': config.cycle_min = atoi(optarg); break;
+            case 'C': config.check = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (config.hours <= 0 || config.hours > 24 * 30 || config.setpoint < 10 || config.setpoint > 40 ||
+        config.cycle_min < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    result_t results[2] = { { .name = "hysteresis" }, { .name = "PI" } };
+    run(&results[0], false);
+    run(&results[1], true);
+
+    printf("%.0f h from %.1f C to %d C, air %.1f C, %s\n\n", config.hours, config.start, config.setpoint,
+           config.ambient, config.cycle_min == 0 ? "heating throughout" : "heating half the time");
+    printf("%-12s %13s %12s %16s %12s %10s\n", "", "to set point", "overshoot", "band after", "cycles/day",
+           "heater on");
+    for (int i = 0; i < 2; i++) {
+        print_result(&results[i]);
+    }
+    if (config.check) {
+        check_results(&results[0], &results[1]);
+        printf("%d checks, %d failures\n", checks, failures);
+    }
+    return failures != 0;
+}
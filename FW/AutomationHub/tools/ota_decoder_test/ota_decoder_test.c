@@ -0,0 +1,402 @@
+/* Firmware update decoder check.
+
+   Runs main/src/ota_decoder.c on the host, with the ROM inflater replaced by zlib
+   (shim/rom/miniz.h), on payloads made by tools/ota_patch.py from two generated images:
+   a base and a new image that differs from it the way a rebuild does, with shifted
+   addresses, an inserted function and a moved block. It checks:
+
+     formats        raw, deflate and delta payloads decode to the new image, fed whole, a
+                    byte at a time and in BLE write sized chunks, so every record header,
+                    diff run and the zlib stream are split across calls, and the output
+                    wraps the 32 KB window several times
+     truncated      a payload cut short, inside the zlib stream or inside a delta record,
+                    is accepted as far as it goes but never reported finished
+     corrupt        flipped bits, trailing bytes, a bad magic, a base larger than the
+                    running image, seeks and diff runs outside the base, and output or base
+                    reads that fail are all rejected
+
+   make check
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "rom/miniz.h"
+#include "inc/ota_decoder.h"
+
+#define BASE_SIZE               (256 * 1024)
+#define BLE_CHUNK               (244)       // Write without response payload at a 247 byte MTU
+#define FLASH_ADDR              (0x400d0000)
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        checks++;                                               \
+        if (!(cond)) {                                          \
+            failures++;                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+} buffer_t;
+
+typedef struct {
+    const buffer_t *base;
+    uint8_t *out;
+    size_t out_length;
+    size_t out_capacity;
+    size_t fail_output_at;          // Output fails once this much was written, 0 never
+    bool fail_base;
+} sink_t;
+
+typedef struct {
+    bool fed;                       // Every feed returned true
+    bool finished;
+    bool matches;                   // Output is the expected image
+} decode_result_t;
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static bool read_file(const char *path, buffer_t *buffer)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    buffer->length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buffer->data = malloc(buffer->length + 1);
+    bool ok = fread(buffer->data, 1, buffer->length, f) == buffer->length;
+    fclose(f);
+    return ok;
+}
+
+static bool write_file(const char *path, const uint8_t *data, size_t length)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    bool ok = fwrite(data, 1, length, f) == length;
+    return fclose(f) == 0 && ok;
+}
+
+// Code like bytes: a small vocabulary of instruction words, and literal pools of addresses
+// into flash, which is what moves when code is inserted
+static void fill_code(uint8_t *p, size_t length)
+{
+    static const uint32_t words[] = { 0x004136, 0x0020c0, 0x1df0, 0xa0a2, 0x8c0c, 0x01cd, 0x0008e0, 0x22a0 };
+    size_t i = 0;
+    while (i + 4 <= length) {
+        uint32_t word;
+        if (rng() % 16 == 0) {
+            word = FLASH_ADDR + (rng() % BASE_SIZE & ~3u);
+        } else if (rng() % 4 == 0) {
+            word = rng();
+        } else {
+            word = words[rng() % 8] | words[rng() % 8] << 16;
+        }
+        memcpy(p + i, &word, 4);
+        i += 4;
+    }
+    for (; i < length; i++) {
+        p[i] = rng();
+    }
+}
+
+// Base, then the new image: addresses after the insertion point shifted, a new function
+// inserted, two blocks swapped and the tail grown
+static bool write_images(const char *base_path, const char *new_path)
+{
+    const size_t insert_at = 100 * 1024;
+    const size_t insert_length = 3000;
+    const size_t block = 16 * 1024;
+    const size_t tail = 5000;
+    uint8_t *base = malloc(BASE_SIZE);
+    uint8_t *image = malloc(BASE_SIZE + insert_length + tail);
+    fill_code(base, BASE_SIZE);
+
+    size_t n = 0;
+    memcpy(image, base, insert_at);
+    n = insert_at;
+    fill_code(image + n, insert_length);
+    n += insert_length;
+    memcpy(image + n, base + insert_at, BASE_SIZE - insert_at);
+    for (size_t i = n; i + 4 <= n + BASE_SIZE - insert_at; i += 4) {
+        uint32_t word;
+        memcpy(&word, image + i, 4);
+        if (word >= FLASH_ADDR + insert_at && word < FLASH_ADDR + BASE_SIZE) {
+            word += insert_length;
+            memcpy(image + i, &word, 4);
+        }
+    }
+    n += BASE_SIZE - insert_at;
+    // The block before the insertion moves after the one that follows it
+    uint8_t *swap = malloc(block);
+    memcpy(swap, image + insert_at - block, block);
+    memmove(image + insert_at - block, image + insert_at, block);
+    memcpy(image + insert_at, swap, block);
+    free(swap);
+    fill_code(image + n, tail);
+    n += tail;
+
+    bool ok = write_file(base_path, base, BASE_SIZE) && write_file(new_path, image, n);
+    free(base);
+    free(image);
+    return ok;
+}
+
+static bool sink_output(void *ctx, const uint8_t *data, size_t length)
+{
+    sink_t *sink = ctx;
+    if (sink->fail_output_at != 0 && sink->out_length + length >= sink->fail_output_at) {
+        return false;
+    }
+    if (sink->out_length + length > sink->out_capacity) {
+        sink->out_capacity = (sink->out_length + length) * 2;
+        sink->out = realloc(sink->out, sink->out_capacity);
+    }
+    memcpy(sink->out + sink->out_length, data, length);
+    sink->out_length += length;
+    return true;
+}
+
+static bool sink_read_base(void *ctx, uint32_t offset, uint8_t *data, size_t length)
+{
+    sink_t *sink = ctx;
+    if (sink->fail_base || offset + length > sink->base->length) {
+        return false;
+    }
+    memcpy(data, sink->base->data + offset, length);
+    return true;
+}
+
+// chunk 0 feeds pieces of random length up to a few BLE writes
+static decode_result_t decode_with(uint8_t format, const buffer_t *payload, size_t chunk, const buffer_t *base,
+                                   const buffer_t *expected, sink_t *sink)
+{
+    decode_result_t result = { .fed = true };
+    ota_decoder_t decoder;
+    sink->base = base;
+    if (!ota_decoder_begin(&decoder, format, sink_output, sink_read_base, base ? base->length : 0, sink)) {
+        result.fed = false;
+        return result;
+    }
+    size_t pos = 0;
+    while (pos < payload->length && result.fed) {
+        size_t n = chunk != 0 ? chunk : 1 + rng() % (4 * BLE_CHUNK);
+        if (n > payload->length - pos) {
+            n = payload->length - pos;
+        }
+        result.fed = ota_decoder_feed(&decoder, payload->data + pos, n);
+        pos += n;
+    }
+    result.finished = ota_decoder_finished(&decoder);
+    result.matches = expected != NULL && sink->out_length == expected->length &&
+                     memcmp(sink->out, expected->data, expected->length) == 0;
+    ota_decoder_end(&decoder);
+    free(sink->out);
+    sink->out = NULL;
+    sink->out_length = sink->out_capacity = 0;
+    return result;
+}
+
+static decode_result_t decode(uint8_t format, const buffer_t *payload, size_t chunk, const buffer_t *base,
+                              const buffer_t *expected)
+{
+    sink_t sink = { 0 };
+    return decode_with(format, payload, chunk, base, expected, &sink);
+}
+
+static buffer_t compress_buffer(const uint8_t *data, size_t length)
+{
+    buffer_t out;
+    uLongf size = compressBound(length);
+    out.data = malloc(size);
+    compress2(out.data, &size, data, length, 9);
+    out.length = size;
+    return out;
+}
+
+static buffer_t inflate_buffer(const buffer_t *payload, size_t capacity)
+{
+    buffer_t out;
+    uLongf size = capacity;
+    out.data = malloc(size);
+    out.length = uncompress(out.data, &size, payload->data, payload->length) == Z_OK ? size : 0;
+    return out;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static const char *format_names[] = { "raw", "deflate", "delta" };
+
+static void check_formats(const buffer_t *base, const buffer_t *image, const buffer_t *payloads[3])
+{
+    static const size_t chunks[] = { SIZE_MAX, 1, 20, BLE_CHUNK, 4096, 0 };
+    CHECK(image->length > 4 * TINFL_LZ_DICT_SIZE, "image of %zu bytes does not wrap the window", image->length);
+    for (int format = OTA_FORMAT_RAW; format <= OTA_FORMAT_DELTA; format++) {
+        for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+            size_t chunk = chunks[i] == SIZE_MAX ? payloads[format]->length : chunks[i];
+            decode_result_t r = decode(format, payloads[format], chunk, base, image);
+            CHECK(r.fed && r.finished && r.matches, "%s in %zu byte chunks: fed %d finished %d matches %d",
+                  format_names[format], chunk, r.fed, r.finished, r.matches);
+        }
+    }
+
+    // The patch has to start inside the window and go on past it for the records to span it
+    buffer_t patch = inflate_buffer(payloads[OTA_FORMAT_DELTA], 2 * image->length);
+    CHECK(patch.length > 8 && memcmp(patch.data, OTA_DELTA_MAGIC, 4) == 0, "delta payload is not a patch");
+    CHECK(patch.length > TINFL_LZ_DICT_SIZE, "patch of %zu bytes stays in one window", patch.length);
+    free(patch.data);
+
+    ota_decoder_t decoder;
+    CHECK(!ota_decoder_begin(&decoder, OTA_FORMAT_DELTA + 1, sink_output, sink_read_base, 0, NULL),
+          "unknown format accepted");
+}
+
+static void check_truncated(const buffer_t *base, const buffer_t *image, const buffer_t *payloads[3])
+{
+    for (int format = OTA_FORMAT_DEFLATE; format <= OTA_FORMAT_DELTA; format++) {
+        const buffer_t *payload = payloads[format];
+        const size_t lengths[] = { 1, 2, 10, payload->length / 2, payload->length - 5, payload->length - 1 };
+        for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+            buffer_t cut = { payload->data, lengths[i] };
+            decode_result_t r = decode(format, &cut, BLE_CHUNK, base, image);
+            CHECK(r.fed && !r.finished, "%s cut to %zu bytes: fed %d finished %d", format_names[format],
+                  lengths[i], r.fed, r.finished);
+        }
+    }
+
+    // A complete zlib stream of a patch that stops inside the start, a record header, a diff
+    // run or the extra bytes
+    buffer_t patch = inflate_buffer(payloads[OTA_FORMAT_DELTA], 2 * image->length);
+    uint32_t diff_length, extra_length;
+    memcpy(&diff_length, patch.data + 8, 4);
+    memcpy(&extra_length, patch.data + 12, 4);
+    const size_t lengths[] = { 6, 8 + 5, 8 + 12 + diff_length / 2, 8 + 12 + diff_length + extra_length / 2 + 1,
+                               patch.length - 1 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        buffer_t payload = compress_buffer(patch.data, lengths[i]);
+        decode_result_t r = decode(OTA_FORMAT_DELTA, &payload, BLE_CHUNK, base, NULL);
+        CHECK(r.fed && !r.finished, "patch cut to %zu bytes: fed %d finished %d", lengths[i], r.fed, r.finished);
+        free(payload.data);
+    }
+    free(patch.data);
+}
+
+static void check_corrupt(const buffer_t *base, const buffer_t *image, const buffer_t *payloads[3])
+{
+    for (int format = OTA_FORMAT_DEFLATE; format <= OTA_FORMAT_DELTA; format++) {
+        const buffer_t *payload = payloads[format];
+        buffer_t copy = { malloc(payload->length + 1), payload->length };
+        for (int i = 0; i <= 16; i++) {
+            size_t offset = i == 16 ? payload->length - 1 : payload->length * i / 16;
+            memcpy(copy.data, payload->data, payload->length);
+            copy.data[offset] ^= 1 << (i % 8);
+            decode_result_t r = decode(format, &copy, BLE_CHUNK, base, image);
+            CHECK(!r.fed, "%s with bit %d of byte %zu flipped: finished %d matches %d", format_names[format],
+                  i % 8, offset, r.finished, r.matches);
+        }
+        memcpy(copy.data, payload->data, payload->length);
+        copy.data[copy.length++] = 0;
+        decode_result_t r = decode(format, &copy, BLE_CHUNK, base, image);
+        CHECK(!r.fed, "%s with a trailing byte accepted", format_names[format]);
+        free(copy.data);
+
+        sink_t sink = { .fail_output_at = image->length / 2 };
+        r = decode_with(format, payload, BLE_CHUNK, base, image, &sink);
+        CHECK(!r.fed, "%s went on after the output failed", format_names[format]);
+    }
+
+    sink_t sink = { .fail_base = true };
+    decode_result_t r = decode_with(OTA_FORMAT_DELTA, payloads[OTA_FORMAT_DELTA], BLE_CHUNK, base, image, &sink);
+    CHECK(!r.fed, "delta went on after the base read failed");
+
+    // Patches that are well formed zlib but do not fit the base: after the magic and base
+    // size, records of diff length, extra length and seek, each followed by zeroed bytes
+    static const struct {
+        const char *name;
+        char magic[5];
+        int32_t base_delta;             // Added to the real base size
+        uint32_t records[2][3];
+    } patches[] = {
+        { "bad magic", "OSP2", 0, { { 0, 4, 0 } } },
+        { "base larger than the running image", OTA_DELTA_MAGIC, 1, { { 0, 4, 0 } } },
+        { "seek before the base", OTA_DELTA_MAGIC, 0, { { 16, 0, (uint32_t)-17 } } },
+        { "seek past the base", OTA_DELTA_MAGIC, 0, { { 16, 0, BASE_SIZE } } },
+        { "empty record seeking past the base", OTA_DELTA_MAGIC, 0, { { 0, 0, BASE_SIZE + 1 } } },
+        { "diff run past the base", OTA_DELTA_MAGIC, 0, { { 0, 0, BASE_SIZE - 8 }, { 16, 0, 0 } } },
+    };
+    for (size_t i = 0; i < sizeof(patches) / sizeof(patches[0]); i++) {
+        uint8_t patch[8 + 2 * (12 + 16)] = { 0 };
+        size_t length = 8;
+        memcpy(patch, patches[i].magic, 4);
+        put_u32(patch + 4, base->length + patches[i].base_delta);
+        for (int j = 0; j < 2; j++) {
+            const uint32_t *record = patches[i].records[j];
+            if (j > 0 && record[0] == 0 && record[1] == 0 && record[2] == 0) {
+                break;
+            }
+            for (int k = 0; k < 3; k++) {
+                put_u32(patch + length + 4 * k, record[k]);
+            }
+            length += 12 + record[0] + record[1];
+        }
+        buffer_t payload = compress_buffer(patch, length);
+        r = decode(OTA_FORMAT_DELTA, &payload, BLE_CHUNK, base, NULL);
+        CHECK(!r.fed, "%s accepted", patches[i].name);
+        free(payload.data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "--images") == 0) {
+        return write_images(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s base.bin new.bin new.deflate new.delta\n"
+                        "       %s --images base.bin new.bin\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    buffer_t base, image, deflate, delta;
+    if (!read_file(argv[1], &base) || !read_file(argv[2], &image) || !read_file(argv[3], &deflate) ||
+        !read_file(argv[4], &delta)) {
+        return 1;
+    }
+    const buffer_t *payloads[3] = { &image, &deflate, &delta };
+    printf("image %zu bytes, deflate %zu, delta %zu against a %zu byte base\n", image.length, deflate.length,
+           delta.length, base.length);
+
+    check_formats(&base, &image, payloads);
+    check_truncated(&base, &image, payloads);
+    check_corrupt(&base, &image, payloads);
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures != 0;
+}
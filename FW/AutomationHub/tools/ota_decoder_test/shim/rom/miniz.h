@@ -0,0 +1,86 @@
+// Just enough of the ROM tinfl API to build ota_decoder.c on the host, on top of zlib.
+// zlib keeps its own copy of the window, so back references are resolved there rather than
+// in the caller's wrapping buffer, everything else goes through ota_decoder.c as on the spa.
+#ifndef _MINIZ_H_
+#define _MINIZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE              32768
+#define TINFL_FLAG_PARSE_ZLIB_HEADER    1
+#define TINFL_FLAG_HAS_MORE_INPUT       2
+
+typedef uint8_t mz_uint8;
+
+typedef enum {
+    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+// zlib's state and window come out of the decompressor itself, so freeing it, as
+// ota_decoder_end does, releases everything like it does with the ROM decompressor
+typedef struct {
+    z_stream z;
+    size_t arena_used;
+    uint8_t arena[48 * 1024];
+} tinfl_decompressor;
+
+static voidpf tinfl_shim_alloc(voidpf opaque, uInt items, uInt size)
+{
+    tinfl_decompressor *r = opaque;
+    size_t bytes = ((size_t)items * size + 15) & ~(size_t)15;
+    if (r->arena_used + bytes > sizeof(r->arena)) {
+        return Z_NULL;
+    }
+    r->arena_used += bytes;
+    return r->arena + r->arena_used - bytes;
+}
+
+static void tinfl_shim_free(voidpf opaque, voidpf address)
+{
+}
+
+static inline void tinfl_init(tinfl_decompressor *r)
+{
+    memset(&r->z, 0, sizeof(r->z));
+    r->arena_used = 0;
+    r->z.zalloc = tinfl_shim_alloc;
+    r->z.zfree = tinfl_shim_free;
+    r->z.opaque = r;
+    inflateInit(&r->z);
+}
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *in, size_t *in_size,
+                                            mz_uint8 *out_start, mz_uint8 *out_next, size_t *out_size,
+                                            uint32_t flags)
+{
+    r->z.next_in = (Bytef *)in;
+    r->z.avail_in = *in_size;
+    r->z.next_out = out_next;
+    r->z.avail_out = *out_size;
+    int ret = inflate(&r->z, Z_NO_FLUSH);
+    *in_size -= r->z.avail_in;
+    *out_size -= r->z.avail_out;
+    switch (ret) {
+        case Z_STREAM_END:
+            return TINFL_STATUS_DONE;
+        case Z_OK:
+        case Z_BUF_ERROR:
+            return r->z.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+        case Z_DATA_ERROR:
+            return r->z.msg != NULL && strcmp(r->z.msg, "incorrect data check") == 0 ?
+                   TINFL_STATUS_ADLER32_MISMATCH : TINFL_STATUS_FAILED;
+        default:
+            return TINFL_STATUS_FAILED;
+    }
+}
+
+#endif // _MINIZ_H_
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""Build compressed and delta payloads for the BLE firmware update and compare their size.
+
+Usage: ota_patch.py build/AutomationHub.bin [--base running.bin] [-o payload] [--rate 20]
+
+Without -o it prints the bytes on air for the full image, the compressed image and, with
+--base, the delta against the image the spa is running, and the transfer time at --rate kB/s.
+The formats are described in main/inc/ota_decoder.h.
+"""
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+FORMAT_RAW = 0
+FORMAT_DEFLATE = 1
+FORMAT_DELTA = 2
+FORMATS = {"raw": FORMAT_RAW, "deflate": FORMAT_DEFLATE, "delta": FORMAT_DELTA}
+
+DELTA_MAGIC = b"OSP1"
+# esp_app_desc_t.app_elf_sha256, after the image and segment headers
+ELF_SHA256_OFFSET = 24 + 8 + 144
+
+KEY = 16            # Exact match needed to start a diff run
+INDEX_STEP = 4      # Every INDEX_STEP-th base offset is indexed
+LOOKAHEAD = 32      # A diff run goes on while half of the next LOOKAHEAD bytes still match
+
+
+def elf_sha256(image):
+    return image[ELF_SHA256_OFFSET:ELF_SHA256_OFFSET + 32]
+
+
+def _extend(base, new, b, n):
+    """Length of the run starting at new[n] aligned with base[b], allowing scattered changes
+    such as relocated addresses, which become zero bytes in the diff."""
+    start = n
+    last_match = n
+    while n < len(new) and b < len(base):
+        if new[n] == base[b]:
+            # Skip over identical stretches a block at a time
+            while n + 64 <= len(new) and b + 64 <= len(base) and new[n:n + 64] == base[b:b + 64]:
+                n += 64
+                b += 64
+            if n < len(new) and b < len(base) and new[n] == base[b]:
+                n += 1
+                b += 1
+            last_match = n
+            continue
+        ahead_new = new[n:n + LOOKAHEAD]
+        ahead_base = base[b:b + LOOKAHEAD]
+        same = sum(1 for x, y in zip(ahead_new, ahead_base) if x == y)
+        if same * 2 < LOOKAHEAD:
+            break
+        n += 1
+        b += 1
+    return last_match - start
+
+
+def find_runs(base, new):
+    """Returns (new offset, base offset, length) runs, everything between them is literal."""
+    index = {}
+    for i in range(0, len(base) - KEY + 1, INDEX_STEP):
+        index.setdefault(base[i:i + KEY], i)
+
+    runs = []
+    n = 0
+    run_end = 0
+    while n <= len(new) - KEY:
+        b = index.get(new[n:n + KEY])
+        if b is None:
+            n += 1
+            continue
+        # Grow back into the literal bytes before it
+        while n > run_end and b > 0 and new[n - 1] == base[b - 1]:
+            n -= 1
+            b -= 1
+        length = _extend(base, new, b, n)
+        runs.append((n, b, length))
+        n += length
+        run_end = n
+    return runs
+
+
+def make_delta(base, new):
+    out = bytearray(DELTA_MAGIC + struct.pack("<I", len(base)))
+    runs = find_runs(base, new)
+    base_pos = 0
+    n = 0
+    # Literal bytes before the first run go in a record without diff bytes
+    if not runs or runs[0][0] > 0:
+        first = runs[0] if runs else (len(new), 0, 0)
+        out += struct.pack("<IIi", 0, first[0], first[1])
+        out += new[:first[0]]
+        base_pos = first[1]
+        n = first[0]
+    for i, (run_new, run_base, length) in enumerate(runs):
+        assert run_new == n and run_base == base_pos
+        next_new, next_base = (runs[i + 1][0], runs[i + 1][1]) if i + 1 < len(runs) else (len(new), run_base + length)
+        extra = new[run_new + length:next_new]
+        out += struct.pack("<IIi", length, len(extra), next_base - (run_base + length))
+        out += bytes((x - y) & 0xFF for x, y in zip(new[run_new:run_new + length], base[run_base:run_base + length]))
+        out += extra
+        base_pos = next_base
+        n = next_new
+    return bytes(out)
+
+
+def apply_delta(base, patch):
+    """Reference decoder, the same steps as ota_decoder.c"""
+    assert patch[:4] == DELTA_MAGIC
+    (base_size,) = struct.unpack_from("<I", patch, 4)
+    assert base_size == len(base)
+    out = bytearray()
+    pos = 8
+    base_pos = 0
+    while pos < len(patch):
+        diff_len, extra_len, seek = struct.unpack_from("<IIi", patch, pos)
+        pos += 12
+        diff = patch[pos:pos + diff_len]
+        out += bytes((x + y) & 0xFF for x, y in zip(base[base_pos:base_pos + diff_len], diff))
+        pos += diff_len
+        out += patch[pos:pos + extra_len]
+        pos += extra_len
+        base_pos += diff_len + seek
+        assert 0 <= base_pos <= len(base)
+    return bytes(out)
+
+
+def make_payload(image, fmt, base=None):
+    if fmt == FORMAT_RAW:
+        return image
+    if fmt == FORMAT_DEFLATE:
+        return zlib.compress(image, 9)
+    return zlib.compress(make_delta(base, image), 9)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image")
+    parser.add_argument("--base", help="image the spa is running, needed for delta")
+    parser.add_argument("--format", choices=FORMATS, default=None)
+    parser.add_argument("-o", "--output")
+    parser.add_argument("--rate", type=float, default=20, help="link throughput in kB/s for the estimate")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    base = open(args.base, "rb").read() if args.base else None
+
+    if args.output:
+        fmt = FORMATS[args.format or ("delta" if base else "deflate")]
+        if fmt == FORMAT_DELTA and base is None:
+            sys.exit("delta needs --base")
+        open(args.output, "wb").write(make_payload(image, fmt, base))
+        return
+
+    rows = [("raw", image)]
+    rows.append(("deflate", make_payload(image, FORMAT_DEFLATE)))
+    if base is not None:
+        started = time.monotonic()
+        delta = make_delta(base, image)
+        assert apply_delta(base, delta) == image
+        print(f"delta built and checked in {time.monotonic() - started:.1f} s")
+        rows.append(("delta", zlib.compress(delta, 9)))
+    print(f"{'format':8} {'bytes':>9} {'of raw':>7} {'at ' + str(args.rate) + ' kB/s':>12}")
+    for name, payload in rows:
+        print(f"{name:8} {len(payload):9} {len(payload) / len(image):7.1%} {len(payload) / args.rate / 1024:11.1f}s")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+/* Thermistor conversion check and microbenchmark.
+
+   Sweeps every 12 bit millivolt code through the table lookup in main/src/thermistor.c and
+   compares it with the B-parameter formula evaluated in double precision, within the range
+   the table clamps to. Reports the largest error in each temperature band and fails when the
+   water temperatures a spa sees are off by more than SPA_MAX_ERROR_CENTI. The error grows
+   towards the hot end, where the curve steepens between 16 mV entries and the last entries
+   clamp. Then times the lookup against the per sample float formula it replaced. Cycles are
+   TSC cycles on x86, elsewhere only ns are shown.
+
+   make check
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC                (1)
+#endif
+#include "inc/thermistor.h"
+
+// Constants of main/src/thermistor.c
+#define DIVIDER_SUPPLY_MV       (5000)
+#define DIVIDER_LOWER_OHMS      (10000.0)
+#define DIVIDER_SERIES_OHMS     (11500.0)
+#define THERMISTOR_R25_OHMS     (10000.0)
+#define THERMISTOR_B            (3892.0)
+#define KELVIN_OFFSET           (273.15)
+
+#define CODES                   (4096)
+// Water temperatures have to be right to a few hundredths, the rest only needs to be close
+#define SPA_MIN_CENTI           (0)
+#define SPA_MAX_CENTI           (5000)
+#define SPA_MAX_ERROR_CENTI     (5.0)
+#define ROUNDS                  (2000)
+
+// Degrees C, NAN where the divider is open or shorted
+static double reference(int voltage_mV)
+{
+    if (voltage_mV <= 0 || voltage_mV >= DIVIDER_SUPPLY_MV) {
+        return NAN;
+    }
+    double voltage = voltage_mV / 1000.0;
+    double resistance = (DIVIDER_SUPPLY_MV / 1000.0 - voltage) * DIVIDER_LOWER_OHMS / voltage - DIVIDER_SERIES_OHMS;
+    if (resistance <= 0) {
+        return NAN;
+    }
+    return 1 / (log(resistance / THERMISTOR_R25_OHMS) / THERMISTOR_B + 1 / (25 + KELVIN_OFFSET)) - KELVIN_OFFSET;
+}
+
+// The conversion state_handler.c ran on every sample before the table
+static int32_t float_mv_to_centi(int voltage_mV)
+{
+    float voltage = (float)voltage_mV / 1000;
+    float resistance = ((DIVIDER_SUPPLY_MV / 1000.0f - voltage) * (float)DIVIDER_LOWER_OHMS) / voltage;
+    resistance = resistance - (float)DIVIDER_SERIES_OHMS;
+    float temp = 1 / ((logf(resistance / (float)THERMISTOR_R25_OHMS) / (float)THERMISTOR_B) +
+                      (1 / (25 + (float)KELVIN_OFFSET))) - (float)KELVIN_OFFSET;
+    return lroundf(temp * 100.0f);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct {
+    const char *name;
+    int32_t (*convert)(int voltage_mV);
+} convert_impl_t;
+
+static const convert_impl_t impls[] = {
+    { "float", float_mv_to_centi },
+    { "table", thermistor_mv_to_centi },
+};
+
+int main(void)
+{
+    volatile int32_t sink = 0;
+    thermistor_init();
+
+    static const int bands[][2] = { { -4000, 0 }, { 0, 5000 }, { 5000, 10000 }, { 10000, 15000 } };
+    double errors[4] = { 0 };
+    int error_codes[4] = { 0 }, counts[4] = { 0 };
+    double spa_error = 0;
+    for (int code = 0; code < CODES; code++) {
+        double want = reference(code) * 100.0;
+        if (isnan(want) || want < THERMISTOR_TEMP_MIN_CENTI || want > THERMISTOR_TEMP_MAX_CENTI) {
+            continue;
+        }
+        double error = fabs(thermistor_mv_to_centi(code) - want);
+        for (int b = 0; b < 4; b++) {
+            if (want >= bands[b][0] && want < bands[b][1] + (b == 3)) {
+                counts[b]++;
+                if (error > errors[b]) {
+                    errors[b] = error;
+                    error_codes[b] = code;
+                }
+            }
+        }
+        if (want >= SPA_MIN_CENTI && want <= SPA_MAX_CENTI && error > spa_error) {
+            spa_error = error;
+        }
+    }
+    for (int b = 0; b < 4; b++) {
+        printf("%4d..%-4d C %5d codes, max error %.4f C at %d mV\n", bands[b][0] / 100, bands[b][1] / 100,
+               counts[b], errors[b] / 100.0, error_codes[b]);
+    }
+    printf("\n");
+
+    // About -43 to 144 C, the float formula is undefined once the divider reads open or shorted
+    for (size_t j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+        int64_t started = now_ns();
+#ifdef HAVE_TSC
+        uint64_t tsc = __rdtsc();
+#endif
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int code = 100; code < 2300; code++) {
+                sink += impls[j].convert(code);
+            }
+        }
+        double conversions = (double)ROUNDS * 2200;
+#ifdef HAVE_TSC
+        printf("%-6s %6.2f ns %7.1f c per conversion\n", impls[j].name, (now_ns() - started) / conversions,
+               (__rdtsc() - tsc) / conversions);
+#else
+        printf("%-6s %6.2f ns per conversion\n", impls[j].name, (now_ns() - started) / conversions);
+#endif
+    }
+    (void)sink;
+    return spa_error > SPA_MAX_ERROR_CENTI;
+}